@@ -0,0 +1,599 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "vm.h"
+#include "code.h"
+#include "object.h"
+
+#ifdef BYTECODE_CACHE
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid      _getpid
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// File layout, in host byte order:
+//
+//   header     "AU3C", version, opcode count, source size, source hash
+//   globals    count, then each name as (length, chars)
+//   consts     count, then each top-level Const as (start, length, known,
+//              value)
+//   stores     count, then each (64-bit key, weight) of vm->stores
+//   function   arity, name, body; then for a lazy stub body line and
+//              Const count, else code count, code, line table size, line
+//              table, cache count, loop count, constant count,
+//              constants, switch count, switches
+//   switch     case count, targets, label count, labels
+//   label      low, high, case
+//
+// A value is a tag byte followed by its payload; a nested function is
+// written in place. Global slots in the code refer to the table in
+// the file and are remapped to this VM's slots when loading.
+
+#define CACHE_MAGIC     "AU3C"
+#define CACHE_VERSION   14
+
+// Features that change the serialized code; a file written with a
+// different set is rejected.
+#ifdef REGISTER_OPS
+#define FLAG_REGISTER_OPS   0x01
+#else
+#define FLAG_REGISTER_OPS   0
+#endif
+#ifdef LAZY_COMPILE
+#define FLAG_LAZY_COMPILE   0x02
+#else
+#define FLAG_LAZY_COMPILE   0
+#endif
+#ifdef INLINE_CALLS
+#define FLAG_INLINE_CALLS   0x04
+#else
+#define FLAG_INLINE_CALLS   0
+#endif
+#ifdef HOIST_LOADS
+#define FLAG_HOIST_LOADS    0x08
+#else
+#define FLAG_HOIST_LOADS    0
+#endif
+#ifdef PEEPHOLE
+#define FLAG_PEEPHOLE       0x10
+#else
+#define FLAG_PEEPHOLE       0
+#endif
+
+#define CACHE_FLAGS     (FLAG_REGISTER_OPS | FLAG_LAZY_COMPILE | FLAG_INLINE_CALLS | \
+                         FLAG_HOIST_LOADS | FLAG_PEEPHOLE)
+
+typedef enum {
+    TAG_NULL,
+    TAG_FALSE,
+    TAG_TRUE,
+    TAG_NUM,
+    TAG_STR,
+    TAG_ISTR,           // identifier, interned case-insensitively
+    TAG_FUN,
+} tag_t;
+
+typedef struct {
+    const uint8_t *current;
+    const uint8_t *end;
+    bool ok;
+} reader_t;
+
+static uint64_t hashSource(src_t *source)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < source->size; i++) {
+        hash ^= (uint8_t)source->buffer[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static char *cachePath(const char *path, uint64_t hash)
+{
+    const char *dir = getenv(CACHE_ENV);
+    char *buffer;
+    size_t size;
+
+    if (dir != NULL && *dir != '\0') {
+        size = strlen(dir) + 1 + 16 + sizeof(CACHE_EXT);
+        buffer = malloc(size);
+        snprintf(buffer, size, "%s/%016llx%s", dir, (unsigned long long)hash, CACHE_EXT);
+    }
+    else {
+        size = strlen(path) + 2;
+        buffer = malloc(size);
+        snprintf(buffer, size, "%sc", path);
+    }
+
+    return buffer;
+}
+
+static void readBytes(reader_t *reader, void *data, size_t size)
+{
+    if (!reader->ok || (size_t)(reader->end - reader->current) < size) {
+        reader->ok = false;
+        memset(data, '\0', size);
+        return;
+    }
+
+    memcpy(data, reader->current, size);
+    reader->current += size;
+}
+
+static int32_t readInt(reader_t *reader)
+{
+    int32_t value;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static str_t *readString(vm_t *vm, reader_t *reader, int32_t length, bool ignorecase)
+{
+    if (length < 0 || (size_t)(reader->end - reader->current) < (size_t)length) {
+        reader->ok = false;
+        return NULL;
+    }
+
+    str_t *string = str_copy(vm, (const char *)reader->current, length, ignorecase);
+    reader->current += length;
+    return string;
+}
+
+// Remap the global slots and check the Switch tables and closure
+// prototypes the code uses.
+static bool remapGlobals(chunk_t *chunk, int *globals, int count)
+{
+    for (int offset = 0; offset < chunk->count; offset += opcode_length(chunk->code[offset])) {
+        uint8_t *ip = &chunk->code[offset];
+
+        if (*ip == OP_JTABLE || *ip == OP_JHASH) {
+            int index = ip[2] << 8 | ip[3];
+            if (index >= chunk->switchCount) return false;
+
+            switch_t *table = &chunk->switches[index];
+            for (int i = 0; i <= table->caseCount; i++) {
+                if (table->targets[i] < 0 || table->targets[i] >= chunk->count) return false;
+            }
+        }
+
+        if (*ip == OP_CLOSURE) {
+            int index = ip[1] << 8 | ip[2];
+            if (index >= chunk->constants.count || !IS_FUN(chunk->constants.values[index])) return false;
+        }
+
+        if (*ip == OP_DEF || *ip == OP_GLD || *ip == OP_GST) {
+            if (ip[1] >= count || globals[ip[1]] > UINT8_MAX) return false;
+            ip[1] = globals[ip[1]];
+        }
+        else if (*ip == OP_DEF_W || *ip == OP_GLD_W || *ip == OP_GST_W) {
+            int slot = ip[1] << 8 | ip[2];
+            if (slot >= count || globals[slot] > UINT16_MAX) return false;
+            ip[1] = globals[slot] >> 8;
+            ip[2] = globals[slot] & 0xff;
+        }
+    }
+
+    return true;
+}
+
+static fun_t *readFunction(vm_t *vm, reader_t *reader, src_t *source, int *globals, int globalCount);
+
+static val_t readValue(vm_t *vm, reader_t *reader, src_t *source, int *globals, int globalCount)
+{
+    uint8_t tag;
+    double number;
+    val_t value = VAL_NULL;
+
+    readBytes(reader, &tag, 1);
+    switch (tag) {
+        case TAG_NULL:  value = VAL_NULL; break;
+        case TAG_FALSE: value = VAL_FALSE; break;
+        case TAG_TRUE:  value = VAL_TRUE; break;
+        case TAG_NUM:
+            readBytes(reader, &number, sizeof(number));
+            value = VAL_NUM(number);
+            break;
+        case TAG_STR:
+        case TAG_ISTR: {
+            str_t *string = readString(vm, reader, readInt(reader), tag == TAG_ISTR);
+            if (string != NULL) value = VAL_OBJ(string);
+            break;
+        }
+        case TAG_FUN:
+            // Only constant pools hold functions.
+            if (source == NULL) reader->ok = false;
+            else value = VAL_OBJ(readFunction(vm, reader, source, globals, globalCount));
+            break;
+        default:
+            reader->ok = false;
+            break;
+    }
+
+    return value;
+}
+
+// Labels are read after the constants, which keep their strings alive.
+static void readSwitches(vm_t *vm, reader_t *reader, chunk_t *chunk)
+{
+    for (int i = readInt(reader); i > 0 && reader->ok; i--) {
+        int at = chunk_switch(chunk);
+        switch_t *table = &chunk->switches[at];
+        int caseCount = readInt(reader);
+
+        if (caseCount < 0 || (size_t)(reader->end - reader->current) < (caseCount + 1) * 4ULL) {
+            reader->ok = false;
+            return;
+        }
+
+        table->targets = malloc((caseCount + 1) * sizeof(int));
+        for (int j = 0; j <= caseCount; j++) table->targets[j] = readInt(reader);
+
+        for (int j = readInt(reader); j > 0 && reader->ok; j--) {
+            val_t low = readValue(vm, reader, NULL, NULL, 0);
+            val_t high = readValue(vm, reader, NULL, NULL, 0);
+            int index = readInt(reader);
+
+            if (index < 0 || index >= caseCount || (!IS_NUM(low) && !IS_STR(low)) ||
+                (!IS_NUM(high) && !IS_STR(high))) {
+                reader->ok = false;
+            }
+            else {
+                switch_label(table, low, high, index);
+            }
+        }
+
+        table->caseCount = caseCount;
+        switch_build(table);
+    }
+}
+
+static fun_t *readFunction(vm_t *vm, reader_t *reader, src_t *source, int *globals, int globalCount)
+{
+    fun_t *function = fun_new(vm, source);
+    chunk_t *chunk = &function->chunk;
+
+    vm_push(vm, VAL_OBJ(function));
+    function->arity = readInt(reader);
+    int32_t nameLength = readInt(reader);
+    if (nameLength >= 0) function->name = readString(vm, reader, nameLength, true);
+
+    function->body = readInt(reader);
+    if (function->body >= 0) {
+        function->bodyLine = readInt(reader);
+        function->bodyConsts = readInt(reader);
+
+        if (function->name == NULL || (size_t)function->body >= source->size ||
+            function->bodyConsts < 0 || function->bodyConsts > source->constCount) {
+            reader->ok = false;
+        }
+
+        vm_pop(vm);
+        return function;
+    }
+
+    int count = readInt(reader);
+    if (count < 0 || (size_t)(reader->end - reader->current) < (size_t)count) {
+        reader->ok = false;
+        count = 0;
+    }
+
+    chunk->count = chunk->capacity = count;
+    chunk->code = malloc(count + 1);
+    readBytes(reader, chunk->code, count);
+
+    int upvalueCount = readInt(reader);
+    if (upvalueCount < 0 || upvalueCount > UINT8_COUNT ||
+        (size_t)(reader->end - reader->current) < upvalueCount * 2ULL) {
+        reader->ok = false;
+        upvalueCount = 0;
+    }
+
+    if (upvalueCount > 0) {
+        function->upvalueCount = upvalueCount;
+        function->captures = malloc(upvalueCount * 2);
+        readBytes(reader, function->captures, upvalueCount * 2);
+    }
+
+    int lineSize = readInt(reader);
+    if (lineSize < 0 || (size_t)(reader->end - reader->current) < (size_t)lineSize) {
+        reader->ok = false;
+        lineSize = 0;
+    }
+
+    chunk->lineSize = lineSize;
+    chunk->lineTable = malloc(lineSize + 1);
+    readBytes(reader, chunk->lineTable, lineSize);
+
+    for (int i = readInt(reader); i > 0 && reader->ok; i--) chunk_cache(chunk);
+    for (int i = readInt(reader); i > 0 && reader->ok; i--) chunk_call(chunk);
+    for (int i = readInt(reader); i > 0 && reader->ok; i--) chunk_loop(chunk);
+
+    for (int i = readInt(reader); i > 0 && reader->ok; i--) {
+        val_t value = readValue(vm, reader, source, globals, globalCount);
+        if (IS_FUN(value)) AS_FUN(value)->outer = function;
+        arr_add(&chunk->constants, value, true);
+    }
+    readSwitches(vm, reader, chunk);
+
+    if (reader->ok && !remapGlobals(chunk, globals, globalCount)) reader->ok = false;
+
+    vm_pop(vm);
+    return function;
+}
+
+static fun_t *readCache(vm_t *vm, const uint8_t *data, size_t size, src_t *source)
+{
+    reader_t reader = { data, data + size, true };
+    char magic[4];
+    uint64_t hash;
+
+    readBytes(&reader, magic, sizeof(magic));
+    if (memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 ||
+        readInt(&reader) != CACHE_VERSION ||
+        readInt(&reader) != (MAX_OPCODES | CACHE_FLAGS << 16) ||
+        readInt(&reader) != (int32_t)source->size) {
+        return NULL;
+    }
+
+    readBytes(&reader, &hash, sizeof(hash));
+    if (!reader.ok || hash != hashSource(source)) return NULL;
+
+    int globalCount = readInt(&reader);
+    if (globalCount < 0 || globalCount > UINT16_MAX + 1) return NULL;
+
+    int *globals = malloc((globalCount + 1) * sizeof(int));
+    for (int i = 0; i < globalCount && reader.ok; i++) {
+        str_t *name = readString(vm, &reader, readInt(&reader), true);
+        if (name != NULL) globals[i] = vm_global(vm, name);
+    }
+
+    int constCount = readInt(&reader);
+    for (int i = 0; i < constCount && reader.ok; i++) {
+        srcconst_t saved;
+        saved.start = readInt(&reader);
+        saved.length = readInt(&reader);
+        saved.known = readInt(&reader) != 0;
+        saved.value = readValue(vm, &reader, NULL, NULL, 0);
+
+        if (saved.start < 0 || saved.length < 0 ||
+            (size_t)saved.start + saved.length > source->size) {
+            reader.ok = false;
+        }
+        else {
+            if (source->constCount == source->constCapacity) {
+                source->constCapacity = GROW_CAP(source->constCapacity);
+                source->consts = realloc(source->consts, source->constCapacity * sizeof(srcconst_t));
+            }
+            source->consts[source->constCount++] = saved;
+        }
+    }
+
+    int storeCount = readInt(&reader);
+    for (int i = 0; i < storeCount && reader.ok; i++) {
+        uint64_t key;
+        readBytes(&reader, &key, sizeof(key));
+        int weight = readInt(&reader);
+        val_t stores = VAL_NUM(0);
+
+        hash_get(&vm->stores, key, &stores);
+        if (reader.ok) hash_set(&vm->stores, key, VAL_NUM(AS_NUM(stores) + weight));
+    }
+
+    fun_t *function = NULL;
+    if (reader.ok) function = readFunction(vm, &reader, source, globals, globalCount);
+
+    free(globals);
+    if (!reader.ok) source->constCount = 0;
+    return reader.ok ? function : NULL;
+}
+
+fun_t *cache_load(vm_t *vm, const char *path, src_t *source)
+{
+    char *fname = cachePath(path, hashSource(source));
+    fun_t *function = NULL;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file != INVALID_HANDLE_VALUE) {
+        DWORD size = GetFileSize(file, NULL);
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        if (mapping != NULL) {
+            void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if (data != NULL) {
+                function = readCache(vm, data, size, source);
+                UnmapViewOfFile(data);
+            }
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+    }
+#else
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+
+    if (fd >= 0) {
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                function = readCache(vm, data, st.st_size, source);
+                munmap(data, st.st_size);
+            }
+        }
+        close(fd);
+    }
+#endif
+
+    free(fname);
+    return function;
+}
+
+static void writeInt(FILE *file, int32_t value)
+{
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+static void writeString(FILE *file, str_t *string)
+{
+    writeInt(file, string->length);
+    fwrite(string->chars, 1, string->length, file);
+}
+
+static void writeFunction(FILE *file, fun_t *function);
+
+static void writeValue(FILE *file, val_t value)
+{
+    if (IS_NUM(value)) {
+        double number = AS_NUM(value);
+        fputc(TAG_NUM, file);
+        fwrite(&number, sizeof(number), 1, file);
+    }
+    else if (IS_BOOL(value)) {
+        fputc(AS_BOOL(value) ? TAG_TRUE : TAG_FALSE, file);
+    }
+    else if (IS_STR(value)) {
+        str_t *string = AS_STR(value);
+        bool ignorecase = hash_string(string->chars, string->length, true) == string->hash;
+        fputc(ignorecase ? TAG_ISTR : TAG_STR, file);
+        writeString(file, string);
+    }
+    else if (IS_FUN(value)) {
+        fputc(TAG_FUN, file);
+        writeFunction(file, AS_FUN(value));
+    }
+    else {
+        fputc(TAG_NULL, file);
+    }
+}
+
+static void writeFunction(FILE *file, fun_t *function)
+{
+    chunk_t *chunk = &function->chunk;
+
+    writeInt(file, function->arity);
+    if (function->name != NULL) writeString(file, function->name);
+    else writeInt(file, -1);
+
+    writeInt(file, function->body);
+    if (function->body >= 0) {
+        writeInt(file, function->bodyLine);
+        writeInt(file, function->bodyConsts);
+        return;
+    }
+
+    writeInt(file, chunk->count);
+    fwrite(chunk->code, 1, chunk->count, file);
+    writeInt(file, function->upvalueCount);
+    if (function->upvalueCount > 0) fwrite(function->captures, 1, function->upvalueCount * 2, file);
+    writeInt(file, chunk->lineSize);
+    fwrite(chunk->lineTable, 1, chunk->lineSize, file);
+    writeInt(file, chunk->cacheCount);
+    writeInt(file, chunk->callCount);
+    writeInt(file, chunk->loopCount);
+
+    writeInt(file, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeValue(file, chunk->constants.values[i]);
+    }
+
+    writeInt(file, chunk->switchCount);
+    for (int i = 0; i < chunk->switchCount; i++) {
+        switch_t *table = &chunk->switches[i];
+
+        writeInt(file, table->caseCount);
+        for (int j = 0; j <= table->caseCount; j++) writeInt(file, table->targets[j]);
+
+        writeInt(file, table->labelCount);
+        for (int j = 0; j < table->labelCount; j++) {
+            writeValue(file, table->labels[j].low);
+            writeValue(file, table->labels[j].high);
+            writeInt(file, table->labels[j].index);
+        }
+    }
+}
+
+bool cache_save(vm_t *vm, const char *path, src_t *source, fun_t *function)
+{
+    // The hash only covers the script, not the files it includes.
+    if (source->includedCount > 0) return false;
+
+    uint64_t hash = hashSource(source);
+    char *fname = cachePath(path, hash);
+    size_t size = strlen(fname) + 32;
+    char *temp = malloc(size);
+
+    // Write to a private file and rename it into place, so concurrent
+    // runs of the same script never see a partial cache.
+    snprintf(temp, size, "%s.%d", fname, (int)getpid());
+
+    FILE *file = fopen(temp, "wb");
+    bool ok = file != NULL;
+
+    if (ok) {
+        int globalCount = vm->globalValues->count;
+
+        fwrite(CACHE_MAGIC, 1, 4, file);
+        writeInt(file, CACHE_VERSION);
+        writeInt(file, MAX_OPCODES | CACHE_FLAGS << 16);
+        writeInt(file, (int32_t)source->size);
+        fwrite(&hash, sizeof(hash), 1, file);
+
+        writeInt(file, globalCount);
+        for (int i = 0; i < globalCount; i++) {
+            writeString(file, vm_global_name(vm, i));
+        }
+
+        writeInt(file, source->constCount);
+        for (int i = 0; i < source->constCount; i++) {
+            srcconst_t *saved = &source->consts[i];
+
+            writeInt(file, saved->start);
+            writeInt(file, saved->length);
+            writeInt(file, saved->known);
+            writeValue(file, saved->value);
+        }
+
+        int storeCount = 0;
+        for (int i = 0; i < vm->stores.capacity; i++) storeCount += IS_NUM(vm->stores.indexes[i].value);
+
+        writeInt(file, storeCount);
+        for (int i = 0; i < vm->stores.capacity; i++) {
+            index_t *index = &vm->stores.indexes[i];
+            if (!IS_NUM(index->value)) continue;
+
+            fwrite(&index->key, sizeof(index->key), 1, file);
+            writeInt(file, (int32_t)AS_NUM(index->value));
+        }
+
+        writeFunction(file, function);
+        ok = !ferror(file);
+        ok = fclose(file) == 0 && ok;
+
+#ifdef _WIN32
+        ok = ok && MoveFileExA(temp, fname, MOVEFILE_REPLACE_EXISTING);
+#else
+        ok = ok && rename(temp, fname) == 0;
+#endif
+        if (!ok) remove(temp);
+    }
+
+    free(temp);
+    free(fname);
+    return ok;
+}
+
+#endif
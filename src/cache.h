@@ -0,0 +1,22 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+
+#ifdef BYTECODE_CACHE
+
+// Compiled scripts are cached as "<script>c" next to the script, or as
+// "<hash>.au3c" in the directory named by the AU3_CACHE environment
+// variable. A cache file is only used if it was written from a source
+// with the same hash by a build with the same opcode set.
+#define CACHE_ENV       "AU3_CACHE"
+#define CACHE_EXT       ".au3c"
+
+// Map the cache for (path) and rebuild its function tree. Returns NULL
+// if there is no usable cache file for (source).
+fun_t *cache_load(vm_t *vm, const char *path, src_t *source);
+
+// Serialize (function), freshly returned by compile(), for later runs.
+bool cache_save(vm_t *vm, const char *path, src_t *source, fun_t *function);
+
+#endif
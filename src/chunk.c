@@ -1,20 +1,41 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include "code.h"
 #include "value.h"
+#include "object.h"
 
 #define CODE_PAGE   256
 
+// Largest span of integers, and the fewest values per entry, that the
+// dense table of a Switch is built for.
+#define DENSE_MAX   4096
+#define DENSE_FILL  4
+
 void chunk_init(chunk_t *chunk, src_t *source)
 {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
-    chunk->lines = NULL;
-    chunk->columns = NULL;
+    chunk->posCount = 0;
+    chunk->posCapacity = 0;
+    chunk->positions = NULL;
+    chunk->lineSize = 0;
+    chunk->lineTable = NULL;
     chunk->source = source;
+    chunk->cacheCount = 0;
+    chunk->caches = NULL;
+    chunk->callCount = 0;
+    chunk->calls = NULL;
+    chunk->quick = NULL;
+    chunk->farCount = 0;
+    chunk->farJumps = NULL;
+    chunk->loopCount = 0;
+    chunk->loops = NULL;
+    chunk->switchCount = 0;
+    chunk->switches = NULL;
 
     arr_init(&chunk->constants);
 }
@@ -22,7 +43,23 @@ void chunk_init(chunk_t *chunk, src_t *source)
 void chunk_free(chunk_t *chunk)
 {
     free(chunk->code);
-    free(chunk->lines);
+    free(chunk->positions);
+    free(chunk->lineTable);
+    free(chunk->caches);
+    free(chunk->calls);
+    free(chunk->quick);
+    free(chunk->farJumps);
+    free(chunk->loops);
+
+    for (int i = 0; i < chunk->switchCount; i++) {
+        switch_t *table = &chunk->switches[i];
+        free(table->targets);
+        free(table->labels);
+        free(table->dense);
+        free(table->ranges);
+        hash_free(&table->exact);
+    }
+    free(chunk->switches);
 
     arr_free(&chunk->constants);
     chunk_init(chunk, NULL);
@@ -33,14 +70,373 @@ void chunk_emit(chunk_t *chunk, uint8_t byte, int line, int column)
     if (chunk->count >= chunk->capacity) {
         chunk->capacity += CODE_PAGE;
         chunk->code = realloc(chunk->code, chunk->capacity * sizeof(uint8_t));
-        chunk->lines = realloc(chunk->lines, chunk->capacity * sizeof(uint16_t));
-        chunk->columns = realloc(chunk->columns, chunk->capacity * sizeof(uint16_t));
     }
 
-    chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
-    chunk->columns[chunk->count] = column;
-    chunk->count++;
+    // The compiler rewinds (count) to drop code, forget its positions.
+    while (chunk->posCount > 0 && chunk->positions[chunk->posCount - 1].offset >= chunk->count) {
+        chunk->posCount--;
+    }
+
+    pos_t *last = chunk->posCount > 0 ? &chunk->positions[chunk->posCount - 1] : NULL;
+    if (last == NULL || last->line != line || last->column != column) {
+        if (chunk->posCount == chunk->posCapacity) {
+            chunk->posCapacity = GROW_CAP(chunk->posCapacity);
+            chunk->positions = realloc(chunk->positions, chunk->posCapacity * sizeof(pos_t));
+        }
+        chunk->positions[chunk->posCount++] = (pos_t){ chunk->count, line, column };
+    }
+
+    chunk->code[chunk->count++] = byte;
+}
+
+static void putVarint(uint8_t **out, uint32_t value)
+{
+    while (value >= 0x80) {
+        *(*out)++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *(*out)++ = value;
+}
+
+static uint32_t getVarint(const uint8_t **in, const uint8_t *end)
+{
+    uint32_t value = 0;
+
+    for (int shift = 0; *in < end && shift < 32; shift += 7) {
+        uint8_t byte = *(*in)++;
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    return value;
+}
+
+// Encode the positions as (offset delta, zigzag line delta, column)
+// varints, usually three bytes per change instead of four per code
+// byte, and trim the code to its size.
+void chunk_finish(chunk_t *chunk)
+{
+    while (chunk->posCount > 0 && chunk->positions[chunk->posCount - 1].offset >= chunk->count) {
+        chunk->posCount--;
+    }
+
+    uint8_t *table = malloc(chunk->posCount * 11 + 1);
+    uint8_t *out = table;
+    int offset = 0, line = 0;
+
+    for (int i = 0; i < chunk->posCount; i++) {
+        pos_t *pos = &chunk->positions[i];
+        int delta = pos->line - line;
+
+        putVarint(&out, pos->offset - offset);
+        putVarint(&out, (uint32_t)(delta << 1) ^ (uint32_t)(delta >> 31));
+        putVarint(&out, pos->column);
+        offset = pos->offset;
+        line = pos->line;
+    }
+
+    free(chunk->lineTable);
+    chunk->lineSize = (int)(out - table);
+    chunk->lineTable = realloc(table, chunk->lineSize + 1);
+
+    free(chunk->positions);
+    chunk->positions = NULL;
+    chunk->posCount = chunk->posCapacity = 0;
+
+    if (chunk->count > 0 && chunk->count < chunk->capacity) {
+        chunk->code = realloc(chunk->code, chunk->count);
+        chunk->capacity = chunk->count;
+    }
+}
+
+// Only error reporting asks, so the finished table is decoded each time.
+void chunk_position(chunk_t *chunk, int offset, int *line, int *column)
+{
+    *line = 0;
+    *column = 0;
+
+    if (chunk->positions != NULL) {
+        for (int i = 0; i < chunk->posCount && chunk->positions[i].offset <= offset; i++) {
+            *line = chunk->positions[i].line;
+            *column = chunk->positions[i].column;
+        }
+        return;
+    }
+
+    const uint8_t *in = chunk->lineTable;
+    const uint8_t *end = in + chunk->lineSize;
+    int at = 0, ln = 0;
+
+    while (in < end) {
+        at += getVarint(&in, end);
+        uint32_t zigzag = getVarint(&in, end);
+        ln += (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+        int col = getVarint(&in, end);
+
+        if (at > offset) break;
+        *line = ln;
+        *column = col;
+    }
+}
+
+int chunk_cache(chunk_t *chunk)
+{
+    chunk->caches = realloc(chunk->caches, (chunk->cacheCount + 1) * sizeof(icache_t));
+    memset(&chunk->caches[chunk->cacheCount], '\0', sizeof(icache_t));
+    return chunk->cacheCount++;
+}
+
+int chunk_call(chunk_t *chunk)
+{
+    chunk->calls = realloc(chunk->calls, (chunk->callCount + 1) * sizeof(callsite_t));
+    memset(&chunk->calls[chunk->callCount], '\0', sizeof(callsite_t));
+    return chunk->callCount++;
+}
+
+// The quickening counts of the instruction at (ip), which runs after the
+// chunk is final.
+quick_t *chunk_quick(chunk_t *chunk, uint8_t *ip)
+{
+    if (chunk->quick == NULL) chunk->quick = calloc(chunk->count, sizeof(quick_t));
+    return &chunk->quick[ip - chunk->code];
+}
+
+void chunk_farjump(chunk_t *chunk, int from, int to)
+{
+    chunk->farJumps = realloc(chunk->farJumps, (chunk->farCount + 1) * sizeof(farjump_t));
+    chunk->farJumps[chunk->farCount].from = from;
+    chunk->farJumps[chunk->farCount].to = to;
+    chunk->farCount++;
+}
+
+int chunk_loop(chunk_t *chunk)
+{
+    chunk->loops = realloc(chunk->loops, (chunk->loopCount + 1) * sizeof(uint64_t));
+    chunk->loops[chunk->loopCount] = 0;
+    return chunk->loopCount++;
+}
+
+int chunk_switch(chunk_t *chunk)
+{
+    chunk->switches = realloc(chunk->switches, (chunk->switchCount + 1) * sizeof(switch_t));
+    switch_t *table = &chunk->switches[chunk->switchCount];
+
+    memset(table, '\0', sizeof(switch_t));
+    hash_init(&table->exact);
+    return chunk->switchCount++;
+}
+
+static val_t caseValue(val_t value)
+{
+    if (IS_BOOL(value)) return VAL_NUM(AS_BOOL(value));
+    if (IS_NUM(value) && AS_NUM(value) == 0) return VAL_NUM(0);
+    return value;
+}
+
+void switch_label(switch_t *table, val_t low, val_t high, int index)
+{
+    table->labels = realloc(table->labels, (table->labelCount + 1) * sizeof(swlabel_t));
+    swlabel_t *label = &table->labels[table->labelCount++];
+
+    label->low = caseValue(low);
+    label->high = caseValue(high);
+    label->index = index;
+    label->dense = false;
+    if (index >= table->caseCount) table->caseCount = index + 1;
+}
+
+static bool isInteger(val_t value)
+{
+    if (!IS_NUM(value)) return false;
+    double number = AS_NUM(value);
+    return number >= INT32_MIN / 2 && number <= INT32_MAX / 2 && number == (int)number;
+}
+
+static bool isSingle(swlabel_t *label)
+{
+    return AS_RAW(label->low) == AS_RAW(label->high);
+}
+
+void switch_build(switch_t *table)
+{
+    int low = INT32_MAX, high = INT32_MIN, values = 0;
+
+    for (int i = 0; i < table->labelCount; i++) {
+        swlabel_t *label = &table->labels[i];
+        if (!isInteger(label->low) || !isInteger(label->high)) continue;
+
+        int first = (int)AS_NUM(label->low), last = (int)AS_NUM(label->high);
+        if (first > last || last - first >= DENSE_MAX) continue;
+
+        if (first < low) low = first;
+        if (last > high) high = last;
+        values += last - first + 1;
+    }
+
+    // Fill the dense table in case order, so the first case wins.
+    if (values > 0 && high - low < DENSE_MAX && high - low < values * DENSE_FILL + 8) {
+        table->low = low;
+        table->count = high - low + 1;
+        table->dense = malloc(table->count * sizeof(int));
+        for (int i = 0; i < table->count; i++) table->dense[i] = -1;
+
+        for (int i = 0; i < table->labelCount; i++) {
+            swlabel_t *label = &table->labels[i];
+            if (!isInteger(label->low) || !isInteger(label->high)) continue;
+
+            int first = (int)AS_NUM(label->low), last = (int)AS_NUM(label->high);
+            if (first > last || first < low || last > high) continue;
+
+            for (int n = first; n <= last; n++) {
+                if (table->dense[n - low] < 0) table->dense[n - low] = label->index;
+            }
+            label->dense = true;
+        }
+    }
+
+    table->ranges = malloc(table->labelCount * sizeof(int));
+
+    for (int i = 0; i < table->labelCount; i++) {
+        swlabel_t *label = &table->labels[i];
+        val_t found;
+
+        if (!isSingle(label)) {
+            table->ranges[table->rangeCount++] = i;
+            if (!label->dense) table->sparseCount++;
+        }
+        else if (!label->dense && !(IS_NUM(label->low) && isnan(AS_NUM(label->low))) &&
+                 !hash_get(&table->exact, hash_value(label->low), &found)) {
+            hash_set(&table->exact, hash_value(label->low), VAL_NUM(label->index));
+        }
+    }
+}
+
+static int compareStrings(str_t *a, str_t *b)
+{
+    int length = a->length < b->length ? a->length : b->length;
+    int order = memcmp(a->chars, b->chars, length);
+    return order != 0 ? order : a->length - b->length;
+}
+
+static bool inRange(swlabel_t *label, val_t value)
+{
+    if (IS_NUM(value)) {
+        return IS_NUM(label->low) && IS_NUM(label->high) &&
+            AS_NUM(label->low) <= AS_NUM(value) && AS_NUM(value) <= AS_NUM(label->high);
+    }
+
+    return IS_STR(label->low) && IS_STR(label->high) &&
+        compareStrings(AS_STR(label->low), AS_STR(value)) <= 0 &&
+        compareStrings(AS_STR(value), AS_STR(label->high)) <= 0;
+}
+
+int switch_find(switch_t *table, val_t value)
+{
+    int match = table->caseCount;
+    bool dense = false;
+    val_t found;
+
+    value = caseValue(value);
+    if (!IS_NUM(value) && !IS_STR(value)) return match;
+
+    if (IS_NUM(value) && table->count > 0) {
+        double number = AS_NUM(value);
+
+        if (number >= table->low && number < (double)table->low + table->count &&
+            number == (int)number) {
+            int index = table->dense[(int)number - table->low];
+            if (index >= 0) match = index;
+            dense = true;
+        }
+    }
+
+    if (!dense && hash_get(&table->exact, hash_value(value), &found)) match = AS_INT(found);
+
+    // A range of an earlier case may still cover the value.
+    for (int i = 0; i < table->rangeCount; i++) {
+        swlabel_t *label = &table->labels[table->ranges[i]];
+
+        if (label->index >= match) break;
+        if (dense && label->dense) continue;
+        if (inRange(label, value)) match = label->index;
+    }
+
+    return match;
+}
+
+int opcode_length(opcode_t opcode)
+{
+    switch (opcode) {
+        case OP_PRINT: case OP_CONST:
+        case OP_DEF: case OP_GLD: case OP_GST: case OP_LD: case OP_ST: case OP_MAP: case OP_ADDK:
+        case OP_SUBK: case OP_DROP: case OP_ULD: case OP_UST:
+            return 2;
+        case OP_JMP: case OP_JMPF: case OP_JMPT: case OP_JMPF_POP: case OP_JMPT_POP:
+        case OP_JLT: case OP_JLE: case OP_JGT: case OP_JGE: case OP_JEQ: case OP_JNE:
+        case OP_LD_LD_ADD: case OP_MOVE: case OP_LOADK: case OP_CONST_W:
+        case OP_DEF_W: case OP_GLD_W: case OP_GST_W: case OP_CLOSURE: case OP_OLD: case OP_OST:
+            return 3;
+        case OP_CALL: case OP_TAILCALL: case OP_CALL_NUM: case OP_GET: case OP_SET:
+        case OP_FORPREP: case OP_FORLOOP: case OP_JTABLE: case OP_JHASH: case OP_ADDR: case OP_SUBR: case OP_MULR:
+        case OP_DIVR: case OP_ADDRK: case OP_SUBRK: case OP_MULRK: case OP_DIVRK:
+            return 4;
+        case OP_JMP_W: case OP_LOOP:
+            return 5;
+        case OP_FORPREP_W: case OP_FORLOOP_W:
+            return 6;
+        case OP_LOOP_W:
+            return 7;
+        default:
+            return 1;
+    }
+}
+
+void opcode_effect(uint8_t *ip, int *pops, int *pushes)
+{
+    *pops = 0;
+    *pushes = 0;
+
+    switch (*ip) {
+        case OP_PRINT:
+            *pops = ip[1];
+            break;
+        case OP_CALL: case OP_TAILCALL: case OP_CALL_NUM:
+            *pops = ip[1] + 1;
+            *pushes = 1;
+            break;
+        case OP_MAP:
+            *pops = ip[1];
+            *pushes = 1;
+            break;
+        case OP_DROP:
+            *pops = ip[1] + 1;
+            *pushes = 1;
+            break;
+        case OP_POP: case OP_RET: case OP_DEF: case OP_DEF_W: case OP_JMPF_POP: case OP_JMPT_POP:
+        case OP_CLOSE:
+            *pops = 1;
+            break;
+        case OP_NIL: case OP_TRUE: case OP_FALSE: case OP_CONST: case OP_CONST_W: case OP_GLD:
+        case OP_GLD_W: case OP_LD: case OP_LD_LD_ADD: case OP_CLOSURE: case OP_ULD: case OP_OLD:
+            *pushes = 1;
+            break;
+        case OP_NEG: case OP_NOT: case OP_ADDK: case OP_SUBK: case OP_GET:
+            *pops = 1;
+            *pushes = 1;
+            break;
+        case OP_LT: case OP_LE: case OP_EQ: case OP_ADD: case OP_SUB: case OP_MUL:
+        case OP_DIV: case OP_ADD_NN: case OP_SUB_NN: case OP_MUL_NN: case OP_DIV_NN:
+        case OP_LT_NN: case OP_LE_NN: case OP_ADD_SS: case OP_GETI: case OP_SET:
+            *pops = 2;
+            *pushes = 1;
+            break;
+        case OP_SETI:
+            *pops = 3;
+            *pushes = 1;
+            break;
+        case OP_JLT: case OP_JLE: case OP_JGT: case OP_JGE: case OP_JEQ: case OP_JNE:
+            *pops = 2;
+            break;
+    }
 }
 
 src_t *src_new(const char *fname)
@@ -60,14 +456,24 @@ src_t *src_new(const char *fname)
     if (s == NULL) s = fname;
 
     source->fname = strdup(s);
+    source->path = strdup(fname);
     source->buffer = buffer;
+    source->constCount = 0;
+    source->constCapacity = 0;
+    source->consts = NULL;
+    source->includedCount = 0;
+    source->included = NULL;
     return source;
 }
 
 void src_free(src_t *source)
 {
     if (source == NULL) return;
+    for (int i = 0; i < source->includedCount; i++) src_free(source->included[i]);
+    free(source->included);
     free(source->fname);
+    free(source->path);
     free(source->buffer);
+    free(source->consts);
     free(source);
 }
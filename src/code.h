@@ -2,12 +2,14 @@
 
 #include "common.h"
 #include "value.h"
+#include "hash.h"
 
 #define OPCODES() \
 /*        opcodes      args     stack       description */ \
     _CODE(PRINT)   	/* []       [-1, +0]    pop a value from stack */ \
     _CODE(POP)     	/* []       [-1, +0]    pop a value from stack and print it */ \
-    _CODE(CALL)    	/* [n]      [-n, +1]    */ \
+    _CODE(CALL)    	/* [n, c, c] [-n, +1]   call with (n) arguments, (c) is the call site cache */ \
+    _CODE(TAILCALL) /* [n, c, c] [-n, +1]   call in place of the current frame, a RET follows for natives; (c) is unused */ \
     _CODE(RET)     	/* []       [-1, +0]    */ \
     _CODE(NIL)     	/* []       [-0, +1]    push nil to stack */ \
     _CODE(TRUE)    	/* []       [-0, +1]    push true to stack */ \
@@ -22,18 +24,76 @@
     _CODE(SUB)     	/* []       [-2, +1]    */ \
     _CODE(MUL)     	/* []       [-2, +1]    */ \
     _CODE(DIV)     	/* []       [-2, +1]    */ \
-    _CODE(DEF)     	/* [k]      [-1, +0]    pop a value from stack and define as (k) in global */ \
-    _CODE(GLD)     	/* [k]      [-0, +1]    push a from (k) in global to stack */ \
-    _CODE(GST)     	/* [k]      [-0, +0]    set a value from stack as (k) in global */ \
+    _CODE(DEF)     	/* [g]      [-1, +0]    pop a value from stack and define as global slot (g) */ \
+    _CODE(GLD)     	/* [g]      [-0, +1]    push global slot (g) to stack */ \
+    _CODE(GST)     	/* [g]      [-0, +0]    set a value from stack as global slot (g) */ \
     _CODE(JMP)     	/* [s, s]   [-0, +0]    */ \
     _CODE(JMPF)    	/* [s, s]   [-1, +0]    */ \
     _CODE(LD)      	/* [s]      [-0, +1]    */ \
     _CODE(ST)      	/* [s]      [-0, +0]    */ \
     _CODE(MAP)      /* []       [-0, +1]    */ \
-    _CODE(GET)      \
-    _CODE(SET)      \
+    _CODE(GET)      /* [k, c, c] [-1, +1]   get field (k) of a map, (c) is the inline cache */ \
+    _CODE(SET)      /* [k, c, c] [-2, +1]   set field (k) of a map, (c) is the inline cache */ \
     _CODE(GETI)     \
-    _CODE(SETI)
+    _CODE(SETI)     \
+/* quickened forms, rewritten in place by the VM from type feedback */ \
+    _CODE(ADD_NN)   /* []       [-2, +1]    number + number */ \
+    _CODE(SUB_NN)   /* []       [-2, +1]    number - number */ \
+    _CODE(MUL_NN)   /* []       [-2, +1]    number * number */ \
+    _CODE(DIV_NN)   /* []       [-2, +1]    number / number */ \
+    _CODE(LT_NN)    /* []       [-2, +1]    number < number */ \
+    _CODE(LE_NN)    /* []       [-2, +1]    number <= number */ \
+    _CODE(ADD_SS)   /* []       [-2, +1]    string + string */ \
+    _CODE(CALL_NUM) /* [n, c, c] [-n, +1]   call a native over unboxed numbers, see native_t */ \
+/* superinstructions, emitted by the compiler for common sequences */ \
+    _CODE(JMPT)     /* [s, s]   [-0, +0]    jump if the top value is truthy, keep it */ \
+    _CODE(JMPF_POP) /* [s, s]   [-1, +0]    pop a value, jump if it is falsey */ \
+    _CODE(JMPT_POP) /* [s, s]   [-1, +0]    pop a value, jump if it is truthy */ \
+    _CODE(JLT)      /* [s, s]   [-2, +0]    pop a, b, jump unless a < b */ \
+    _CODE(JLE)      /* [s, s]   [-2, +0]    pop a, b, jump unless a <= b */ \
+    _CODE(JGT)      /* [s, s]   [-2, +0]    pop a, b, jump if a <= b */ \
+    _CODE(JGE)      /* [s, s]   [-2, +0]    pop a, b, jump if a < b */ \
+    _CODE(JEQ)      /* [s, s]   [-2, +0]    pop a, b, jump unless a == b */ \
+    _CODE(JNE)      /* [s, s]   [-2, +0]    pop a, b, jump unless a != b */ \
+    _CODE(LD_LD_ADD) /* [s, s]  [-0, +1]    push local (s) + local (s) */ \
+    _CODE(ADDK)     /* [k]      [-1, +1]    add constant (k) to the top value */ \
+    _CODE(SUBK)     /* [k]      [-1, +1]    subtract constant (k) from the top value */ \
+/* three-address forms over frame slots (d, a, b) and constants (k), see REGISTER_OPS */ \
+    _CODE(MOVE)     /* [d, a]   [-0, +0]    d = a */ \
+    _CODE(LOADK)    /* [d, k]   [-0, +0]    d = k */ \
+    _CODE(ADDR)     /* [d, a, b] [-0, +0]   d = a + b */ \
+    _CODE(SUBR)     /* [d, a, b] [-0, +0]   d = a - b */ \
+    _CODE(MULR)     /* [d, a, b] [-0, +0]   d = a * b */ \
+    _CODE(DIVR)     /* [d, a, b] [-0, +0]   d = a / b */ \
+    _CODE(ADDRK)    /* [d, a, k] [-0, +0]   d = a + k */ \
+    _CODE(SUBRK)    /* [d, a, k] [-0, +0]   d = a - k */ \
+    _CODE(MULRK)    /* [d, a, k] [-0, +0]   d = a * k */ \
+    _CODE(DIVRK)    /* [d, a, k] [-0, +0]   d = a / k */ \
+/* wide operand forms, emitted past the byte operand and 16-bit jump limits */ \
+    _CODE(CONST_W)  /* [k, k]   [-0, +1]    push a constant from (k) to stack */ \
+    _CODE(DEF_W)    /* [g, g]   [-1, +0]    pop a value from stack and define as global slot (g) */ \
+    _CODE(GLD_W)    /* [g, g]   [-0, +1]    push global slot (g) to stack */ \
+    _CODE(GST_W)    /* [g, g]   [-0, +0]    set a value from stack as global slot (g) */ \
+    _CODE(JMP_W)    /* [s, s, s, s] [-0, +0] jump by a signed 32-bit offset */ \
+    _CODE(FORPREP_W) /* [a, s, s, s, s] [-0, +0] FORPREP with a 32-bit offset */ \
+    _CODE(FORLOOP_W) /* [a, s, s, s, s] [-0, +0] FORLOOP with a 32-bit offset */ \
+    _CODE(LOOP_W)   /* [l, l, s, s, s, s] [-0, +0] LOOP with a 32-bit offset */ \
+/* counted loops, slots (a .. a+3) hold the counter, limit, step and loop variable */ \
+    _CODE(FORPREP)  /* [a, s, s] [-0, +0]   make slots (a .. a+2) numbers, jump (s) forward if the loop does not run */ \
+    _CODE(FORLOOP)  /* [a, s, s] [-0, +0]   step the counter, jump (s) back while it is within the limit */ \
+    _CODE(LOOP)     /* [l, l, s, s] [-0, +0] count a pass of loop (l) and jump (s) back to its header */ \
+/* Switch dispatch on local (a) through table (t), see switch_t */ \
+    _CODE(JTABLE)   /* [a, t, t] [-0, +0]   jump to the case of a number, indexing the dense table first */ \
+    _CODE(JHASH)    /* [a, t, t] [-0, +0]   jump to the case of a string, hashing the interned string first */ \
+/* left by INLINE_CALLS where an inlined body returned */ \
+    _CODE(DROP)     /* [n]      [-n-1, +1]  keep the top value, drop the (n) values below it */ \
+/* variables of enclosing functions, boxed (u) for escaping closures or read in place (n, s) */ \
+    _CODE(CLOSURE)  /* [k, k]   [-0, +1]    push a closure of the prototype at (k), capturing its upvalues */ \
+    _CODE(CLOSE)    /* []       [-1, +0]    pop a captured local, closing its upvalue */ \
+    _CODE(ULD)      /* [u]      [-0, +1]    push upvalue (u) */ \
+    _CODE(UST)      /* [u]      [-0, +0]    set a value from stack as upvalue (u) */ \
+    _CODE(OLD)      /* [n, s]   [-0, +1]    push slot (s) of the frame of the function (n) levels out */ \
+    _CODE(OST)      /* [n, s]   [-0, +0]    set a value from stack as slot (s) of that frame */
 
 typedef enum {
 #define _CODE(x)    OP_##x,
@@ -42,28 +102,186 @@ typedef enum {
     MAX_OPCODES
 } opcode_t;
 
+// A Const declared at the top level of a script, kept for the function
+// bodies LAZY_COMPILE compiles after the script.
 typedef struct {
+    int start;          // name, as an offset into the source buffer
+    int length;
+    val_t value;
+    bool known;
+} srcconst_t;
+
+typedef struct _src {
     char *buffer;
     char *fname;
+    char *path;
     size_t size;
+    int constCount;
+    int constCapacity;
+    srcconst_t *consts;
+    int includedCount;
+    struct _src **included; // files it #includes, freed with it
 } src_t;
 
 src_t *src_new(const char *fname);
 void src_free(src_t *source);
 
+#define IC_WAYS     4
+
+// One entry per shape seen at an OP_GET/OP_SET site. A store that adds
+// a field records the shape it transitions to in (target).
+typedef struct {
+    shp_t *shape;
+    shp_t *target;
+    int slot;
+} icway_t;
+
+typedef struct {
+    int count;
+    icway_t ways[IC_WAYS];
+} icache_t;
+
+// The callee an OP_CALL site saw last: a script function, by prototype
+// so that closures of one share it, or a native. A repeat call skips the
+// checks the first one passed. A site that changed callee SITE_MISSES
+// times is megamorphic and no longer cached.
+typedef enum {
+    SITE_EMPTY,
+    SITE_FUN,
+    SITE_NATIVE,
+    SITE_MEGA
+} sitekind_t;
+
+#define SITE_MISSES 4
+
+typedef struct {
+    const void *target;
+    uint8_t kind;
+    uint8_t misses;
+} callsite_t;
+
+// What a generic instruction that has a specialized form saw, by the
+// offset of the instruction: it is rewritten after QUICK_HITS operands
+// that fit the specialized form, and stays generic once the specialized
+// form gave up QUICK_DEOPTS times.
+#define QUICK_HITS      8
+#define QUICK_DEOPTS    4
+
+typedef struct {
+    uint8_t hits;
+    uint8_t deopts;
+} quick_t;
+
+// A jump patched past the reach of its 16-bit operand, from the jump
+// instruction at (from) to (to). chunk_optimize() encodes it in long form.
+typedef struct {
+    int from;
+    int to;
+} farjump_t;
+
+// A constant Case value, or the range (low .. high) of a "Case low To
+// high". Booleans are stored as the numbers they compare equal to.
+typedef struct {
+    val_t low;
+    val_t high;
+    int index;          // case the label belongs to, in source order
+    bool dense;         // covered by the dense table for integers
+} swlabel_t;
+
+// The cases of a Switch tested by one OP_JTABLE or OP_JHASH. The first
+// matching case wins, as if the labels were tested in order. The lookup
+// structures are rebuilt from the labels by switch_build().
+typedef struct {
+    int caseCount;
+    int *targets;       // code offset per case, then the offset for no match
+    int labelCount;
+    swlabel_t *labels;
+    int low;            // integers (low .. low + count - 1) index (dense)
+    int count;
+    int *dense;         // case per integer, or -1
+    hash_t exact;       // case per other single value
+    int rangeCount;
+    int *ranges;        // labels that are ranges
+    int sparseCount;    // ranges the dense table does not cover
+} switch_t;
+
+// The source position of the code from (offset) up to the next entry.
+typedef struct {
+    int offset;
+    uint16_t line;
+    uint16_t column;
+} pos_t;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t *code;
-    uint16_t *lines;
-    uint16_t *columns;
+    int posCount;
+    int posCapacity;
+    pos_t *positions;       // while compiling, until chunk_finish()
+    int lineSize;
+    uint8_t *lineTable;     // the positions delta-encoded, once finished
     src_t *source;
     arr_t constants;
+    int cacheCount;
+    icache_t *caches;
+    int callCount;
+    callsite_t *calls;      // one per OP_CALL site, see callsite_t
+    quick_t *quick;         // one per byte of code, on first use
+    int farCount;
+    farjump_t *farJumps;
+    int loopCount;
+    uint64_t *loops;        // passes through each loop header, see OP_LOOP
+    int switchCount;
+    switch_t *switches;
 } chunk_t;
 
 void chunk_init(chunk_t *chunk, src_t *source);
 void chunk_free(chunk_t *chunk);
 void chunk_emit(chunk_t *chunk, uint8_t byte, int ln, int col);
+void chunk_finish(chunk_t *chunk);
+void chunk_position(chunk_t *chunk, int offset, int *line, int *column);
+int chunk_cache(chunk_t *chunk);
+int chunk_call(chunk_t *chunk);
+quick_t *chunk_quick(chunk_t *chunk, uint8_t *ip);
+void chunk_farjump(chunk_t *chunk, int from, int to);
+int chunk_loop(chunk_t *chunk);
+int chunk_switch(chunk_t *chunk);
+
+void switch_label(switch_t *table, val_t low, val_t high, int index);
+void switch_build(switch_t *table);
+
+// The case of (table) that (value) selects, or (caseCount) if none does.
+int switch_find(switch_t *table, val_t value);
+
+// Size of an instruction in bytes, opcode included.
+int opcode_length(opcode_t opcode);
+
+// Values the instruction at (ip) pops and pushes on the fall-through
+// path. Branches leave the stack as falling through does.
+void opcode_effect(uint8_t *ip, int *pops, int *pushes);
+
+typedef struct {
+    int bytes;
+    int dispatches;
+} peep_t;
+
+// The script function a call through global (slot) with (argCount)
+// arguments always reaches, compiled, or NULL if there is none.
+typedef fun_t *(*callee_t)(void *context, int slot, int argCount);
+
+// What INLINE_CALLS needs to know about the chunk being optimized.
+typedef struct {
+    callee_t callee;
+    void *context;
+    int arity;
+} inliner_t;
+
+// Thread jumps, drop dead and redundant instructions and compact the
+// chunk, encoding far jumps in long form. What was removed is added to
+// (saved) if it is not NULL. With an (inliner), small functions called
+// through globals are inlined first.
+void chunk_optimize(chunk_t *chunk, peep_t *saved, inliner_t *inliner);
 
 static const char *opcode_tostr(opcode_t opcode) {
 #define _CODE(x) #x,
@@ -108,6 +326,7 @@ typedef enum {
     TOKEN_CASE,
     TOKEN_CLASS,
     TOKEN_CONST,
+    TOKEN_CONTINUELOOP,
     TOKEN_DEFAULT,
     TOKEN_DIM,
     TOKEN_DO,
@@ -178,6 +397,11 @@ typedef struct {
 } lexer_t;
 
 void lexer_init(lexer_t *lexer, const char *source);
+bool equal_str(const char *a, const char *b, int len);
 tok_t lexer_scan(lexer_t *lexer);
 
 fun_t *compile(vm_t *vm, src_t *source);
+
+// Compile the body of a function left as a stub by LAZY_COMPILE, in
+// place. Returns false, having reported the error, if it does not compile.
+bool compile_lazy(vm_t *vm, fun_t *function);
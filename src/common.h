@@ -16,8 +16,14 @@
 
 #define GROW_CAP(x)         ((x) < 8 ? 8 : (x) * 2)
 
-#define FRAMES_MAX          64
-#define STACK_MAX           (FRAMES_MAX * UINT8_COUNT)
+// The stack and frames start with room for FRAMES_MIN calls and grow on
+// demand; a frame takes up to UINT8_COUNT stack slots.
+#define FRAMES_MIN          4
+#define FRAMES_MAX          1024
+
+// A traceback shows this many of the innermost and of the outermost
+// frames, and counts the ones between.
+#define TRACE_FRAMES        10
 
 #define VM_INIT_ERROR       -1
 #define VM_OK               0
@@ -25,6 +31,22 @@
 #define VM_RUNTIME_ERROR    2
 
 #define DEBUG_PRINT_CODE
+#define NAN_BOXING
+#define REGISTER_OPS
+#define BYTECODE_CACHE
+#define PEEPHOLE
+#define LAZY_COMPILE
+#define INLINE_CALLS
+#define HOIST_LOADS
+
+#if defined(NAN_BOXING) && (defined(__x86_64__) || defined(_M_X64))
+#define JIT
+#endif
+#define JIT_THRESHOLD       64
+#define JIT_LOOP_THRESHOLD  1024
+#define INCLUDE_THREADS     4
+#define INLINE_MAX          32
+#define HOIST_MAX           8
 
 typedef struct _val val_t;
 typedef struct _vm  vm_t;
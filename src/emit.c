@@ -0,0 +1,834 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emit.h"
+#include "vm.h"
+#include "code.h"
+#include "object.h"
+
+// Ahead-of-time translation to C. Every fun_t becomes a native with the
+// cfn_t signature that runs its bytecode as straight-line C over the VM
+// stack: jumps become gotos, number operations are inlined and the rest
+// calls the same runtime the interpreter uses. A call through a global
+// that only ever holds one script function is made directly. A script
+// with an instruction that has no translation, such as those of nested
+// functions, is reported and not translated.
+
+#define NOT_DIRECT      -1
+#define NEVER_DIRECT    -2
+
+typedef struct {
+    vm_t *vm;
+    FILE *out;
+    fun_t **functions;
+    int *constBase;         // first index of each function's constants in K[]
+    int count;
+    int capacity;
+    int constCount;
+    int *switchBase;        // first index of each function's Switch tables in S[]
+    int switchCount;
+    int *direct;            // global slot -> function index
+    bool failed;            // met an instruction without a translation
+} emitter_t;
+
+static const char *prelude =
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "#include \"vm.h\"\n"
+    "#include \"object.h\"\n"
+    "#include \"libs.h\"\n"
+    "\n"
+    "#define PUSH(v)     *(vm->top++) = (v)\n"
+    "#define POP()       *(--vm->top)\n"
+    "#define PEEK(i)     (vm->top[-1 - (i)])\n"
+    "#define GLOBAL(i)   (vm->globalValues->values[G[i]])\n"
+    "#define NUM_NUM(a, b) (IS_NUM(a) && IS_NUM(b))\n"
+    "\n"
+    "static val_t *K;\n"
+    "static switch_t *S;\n"
+    "\n"
+    "static void fail(vm_t *vm, const char *message)\n"
+    "{\n"
+    "    vm_error(vm, \"%s\", message);\n"
+    "    exit(VM_RUNTIME_ERROR);\n"
+    "}\n"
+    "\n"
+    "static void enter(vm_t *vm, int argc, int arity)\n"
+    "{\n"
+    "    if (argc != arity) {\n"
+    "        vm_error(vm, \"Expected %d arguments but got %d.\", arity, argc);\n"
+    "        exit(VM_RUNTIME_ERROR);\n"
+    "    }\n"
+    "    if (vm->top - vm->stack > (vm->maxFrames - 1) * UINT8_COUNT || !vm_reserve(vm, UINT8_COUNT)) {\n"
+    "        fail(vm, \"Stack overflow.\");\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static void undefined(vm_t *vm, int slot)\n"
+    "{\n"
+    "    vm_error(vm, \"Undefined variable '%s'.\", vm_global_name(vm, slot)->chars);\n"
+    "    exit(VM_RUNTIME_ERROR);\n"
+    "}\n"
+    "\n"
+    "static void arith(vm_t *vm, char op)\n"
+    "{\n"
+    "    double a, b;\n"
+    "\n"
+    "    if (op == '+' && vm_add(vm)) return;\n"
+    "    if (!val_tonums(PEEK(1), PEEK(0), &a, &b)) {\n"
+    "        fail(vm, op == '+' ? \"Operands must be two numbers/booleans/strings.\"\n"
+    "            : \"Operands must be two numbers/booleans.\");\n"
+    "    }\n"
+    "\n"
+    "    vm->top -= 2;\n"
+    "    switch (op) {\n"
+    "        case '-': PUSH(VAL_NUM(a - b)); break;\n"
+    "        case '*': PUSH(VAL_NUM(a * b)); break;\n"
+    "        case '/': PUSH(VAL_NUM(a / b)); break;\n"
+    "        case '<': PUSH(VAL_BOOL(a < b)); break;\n"
+    "        case 'l': PUSH(VAL_BOOL(a <= b)); break;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static void neg(vm_t *vm)\n"
+    "{\n"
+    "    if (IS_NUM(PEEK(0))) PEEK(0) = VAL_NUM(-AS_NUM(PEEK(0)));\n"
+    "    else if (IS_BOOL(PEEK(0))) PEEK(0) = VAL_NUM(-(char)AS_BOOL(PEEK(0)));\n"
+    "    else fail(vm, \"Operands must be a number/boolean.\");\n"
+    "}\n"
+    "\n"
+    "static void print(vm_t *vm, int count)\n"
+    "{\n"
+    "    for (int i = count - 1; i >= 0; i--) {\n"
+    "        val_print(PEEK(i));\n"
+    "        if (i > 0) printf(\"\\t\");\n"
+    "    }\n"
+    "    printf(\"\\n\");\n"
+    "    vm->top -= count;\n"
+    "}\n"
+    "\n"
+    "static void call(vm_t *vm, int argc)\n"
+    "{\n"
+    "    if (!vm_call(vm, PEEK(argc), argc)) exit(VM_RUNTIME_ERROR);\n"
+    "}\n"
+    "\n"
+    "static void newMap(vm_t *vm, int count)\n"
+    "{\n"
+    "    map_t *map = map_new(vm);\n"
+    "    for (int i = count - 1; i >= 0; i--) {\n"
+    "        hash_set(&map->hash, AS_RAW(VAL_NUM(i)), PEEK(i));\n"
+    "    }\n"
+    "    vm->top -= count;\n"
+    "    PUSH(VAL_OBJ(map));\n"
+    "}\n"
+    "\n"
+    "static void getField(vm_t *vm, val_t name)\n"
+    "{\n"
+    "    val_t value = VAL_NULL;\n"
+    "    if (!IS_MAP(PEEK(0))) fail(vm, \"Operands must be a map.\");\n"
+    "    map_get(AS_MAP(PEEK(0)), AS_STR(name), &value);\n"
+    "    PEEK(0) = value;\n"
+    "}\n"
+    "\n"
+    "static void setField(vm_t *vm, val_t name)\n"
+    "{\n"
+    "    val_t value = PEEK(0);\n"
+    "    if (!IS_MAP(PEEK(1))) fail(vm, \"Operands must be a map.\");\n"
+    "    map_put(vm, AS_MAP(PEEK(1)), AS_STR(name), value);\n"
+    "    vm->top--;\n"
+    "    PEEK(0) = value;\n"
+    "}\n"
+    "\n"
+    "static void getIndex(vm_t *vm)\n"
+    "{\n"
+    "    val_t value = VAL_NULL;\n"
+    "    if (!IS_MAP(PEEK(1))) fail(vm, \"Operands must be a map.\");\n"
+    "    if (IS_NUM(PEEK(0))) hash_get(&AS_MAP(PEEK(1))->hash, AS_RAW(PEEK(0)), &value);\n"
+    "    else if (IS_STR(PEEK(0))) map_get(AS_MAP(PEEK(1)), AS_STR(PEEK(0)), &value);\n"
+    "    else fail(vm, \"Operands must be a number or string.\");\n"
+    "    vm->top--;\n"
+    "    PEEK(0) = value;\n"
+    "}\n"
+    "\n"
+    "static void setIndex(vm_t *vm)\n"
+    "{\n"
+    "    val_t value = PEEK(0);\n"
+    "    if (!IS_MAP(PEEK(2))) fail(vm, \"Operands must be a map.\");\n"
+    "    if (IS_NUM(PEEK(1))) hash_set(&AS_MAP(PEEK(2))->hash, AS_RAW(PEEK(1)), value);\n"
+    "    else if (IS_STR(PEEK(1))) map_put(vm, AS_MAP(PEEK(2)), AS_STR(PEEK(1)), value);\n"
+    "    else fail(vm, \"Operands must be a number or string.\");\n"
+    "    vm->top -= 2;\n"
+    "    PEEK(0) = value;\n"
+    "}\n"
+    "\n"
+    "static bool forprep(vm_t *vm, val_t *slot)\n"
+    "{\n"
+    "    double start, limit, step;\n"
+    "    if (!val_tonums(slot[0], slot[1], &start, &limit) || !val_tonums(slot[2], slot[2], &step, &step)) {\n"
+    "        fail(vm, \"'For' values must be numbers/booleans.\");\n"
+    "    }\n"
+    "    if (step == 0) fail(vm, \"'For' step is zero.\");\n"
+    "    slot[0] = slot[3] = VAL_NUM(start);\n"
+    "    slot[1] = VAL_NUM(limit);\n"
+    "    slot[2] = VAL_NUM(step);\n"
+    "    return step > 0 ? start <= limit : start >= limit;\n"
+    "}\n"
+    "\n"
+    "static double tonum(vm_t *vm, val_t value)\n"
+    "{\n"
+    "    double a, b;\n"
+    "    if (!val_tonums(value, value, &a, &b)) fail(vm, \"Operands must be two numbers/booleans.\");\n"
+    "    return a;\n"
+    "}\n"
+    "\n";
+
+static int functionIndex(emitter_t *e, fun_t *function)
+{
+    for (int i = 0; i < e->count; i++) {
+        if (e->functions[i] == function) return i;
+    }
+
+    return NOT_DIRECT;
+}
+
+static bool collect(emitter_t *e, fun_t *function)
+{
+    // Translated code never meets a stub, so compile them all up front.
+    if (function->body >= 0 && !compile_lazy(e->vm, function)) return false;
+
+    if (e->count == e->capacity) {
+        e->capacity = GROW_CAP(e->capacity);
+        e->functions = realloc(e->functions, e->capacity * sizeof(fun_t *));
+        e->constBase = realloc(e->constBase, e->capacity * sizeof(int));
+        e->switchBase = realloc(e->switchBase, e->capacity * sizeof(int));
+    }
+
+    e->functions[e->count] = function;
+    e->switchBase[e->count] = e->switchCount;
+    e->constBase[e->count++] = e->constCount;
+    e->constCount += function->chunk.constants.count;
+    e->switchCount += function->chunk.switchCount;
+
+    arr_t *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUN(constants->values[i]) && !collect(e, AS_FUN(constants->values[i]))) return false;
+    }
+
+    return true;
+}
+
+// The constant or global slot operand, byte or wide.
+static int argument(uint8_t *ip)
+{
+    switch (*ip) {
+        case OP_CONST_W: case OP_DEF_W: case OP_GLD_W: case OP_GST_W:
+            return ip[1] << 8 | ip[2];
+        default:
+            return ip[1];
+    }
+}
+
+// A global qualifies for direct calls if its only store is one DEF of a
+// function constant.
+static void findDirectGlobals(emitter_t *e)
+{
+    int globalCount = e->vm->globalValues->count;
+
+    e->direct = malloc((globalCount + 1) * sizeof(int));
+    for (int i = 0; i < globalCount; i++) e->direct[i] = NOT_DIRECT;
+
+    for (int f = 0; f < e->count; f++) {
+        chunk_t *chunk = &e->functions[f]->chunk;
+        int previous = -1;
+
+        for (int offset = 0; offset < chunk->count; ) {
+            uint8_t *ip = &chunk->code[offset];
+            int slot = argument(ip);
+
+            if (*ip == OP_GST || *ip == OP_GST_W) {
+                e->direct[slot] = NEVER_DIRECT;
+            }
+            else if (*ip == OP_DEF || *ip == OP_DEF_W) {
+                val_t value = VAL_NULL;
+                if (previous >= 0 && (chunk->code[previous] == OP_CONST || chunk->code[previous] == OP_CONST_W)) {
+                    value = chunk->constants.values[argument(&chunk->code[previous])];
+                }
+
+                if (IS_FUN(value) && e->direct[slot] == NOT_DIRECT) {
+                    e->direct[slot] = functionIndex(e, AS_FUN(value));
+                }
+                else {
+                    e->direct[slot] = NEVER_DIRECT;
+                }
+            }
+
+            previous = offset;
+            offset += opcode_length(*ip);
+        }
+    }
+}
+
+static bool isJump(uint8_t opcode)
+{
+    switch (opcode) {
+        case OP_JMP: case OP_JMPF: case OP_JMPT: case OP_JMPF_POP: case OP_JMPT_POP:
+        case OP_JLT: case OP_JLE: case OP_JGT: case OP_JGE: case OP_JEQ: case OP_JNE:
+        case OP_JMP_W: case OP_FORPREP: case OP_FORLOOP: case OP_LOOP:
+        case OP_FORPREP_W: case OP_FORLOOP_W: case OP_LOOP_W:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int32_t readLong(uint8_t *ip)
+{
+    return (int32_t)((uint32_t)ip[0] << 24 | ip[1] << 16 | ip[2] << 8 | ip[3]);
+}
+
+static int jumpTarget(uint8_t *code, int offset)
+{
+    if (code[offset] == OP_JMP_W) return offset + 5 + readLong(&code[offset + 1]);
+    if (code[offset] == OP_FORPREP) return offset + 4 + ((code[offset + 2] << 8) | code[offset + 3]);
+    if (code[offset] == OP_FORLOOP) return offset + 4 - ((code[offset + 2] << 8) | code[offset + 3]);
+    if (code[offset] == OP_FORPREP_W) return offset + 6 + readLong(&code[offset + 2]);
+    if (code[offset] == OP_FORLOOP_W) return offset + 6 - readLong(&code[offset + 2]);
+    if (code[offset] == OP_LOOP_W) return offset + 7 - readLong(&code[offset + 3]);
+    if (code[offset] == OP_LOOP) return offset + 5 - ((code[offset + 3] << 8) | code[offset + 4]);
+
+    return offset + 3 + ((code[offset + 1] << 8) | code[offset + 2]);
+}
+
+static bool isSwitch(uint8_t opcode)
+{
+    return opcode == OP_JTABLE || opcode == OP_JHASH;
+}
+
+static switch_t *switchTable(chunk_t *chunk, int offset)
+{
+    uint8_t *ip = &chunk->code[offset];
+    return &chunk->switches[ip[2] << 8 | ip[3]];
+}
+
+// Record the stack state at a branch to (target), merging it with the
+// states of other branches there.
+static void branchTo(int **pending, int *pendingDepth, int size, int target, int *producers, int depth)
+{
+    int *state = pending[target];
+
+    if (state == NULL) {
+        pending[target] = malloc(size * sizeof(int));
+        pendingDepth[target] = depth;
+        memcpy(pending[target], producers, depth * sizeof(int));
+    }
+    else {
+        for (int i = 0; i < depth; i++) {
+            if (state[i] != producers[i]) state[i] = -1;
+        }
+    }
+}
+
+// Simulate the stack to find which instruction pushed the callee of each
+// CALL. Returns, per offset, the function a CALL can invoke directly.
+static int *findCallees(emitter_t *e, chunk_t *chunk)
+{
+    int size = chunk->count + 1;
+    int *callees = malloc(size * sizeof(int));
+    int *producers = malloc(size * sizeof(int));
+    int **pending = calloc(size, sizeof(int *));
+    int *pendingDepth = calloc(size, sizeof(int));
+    int depth = 0;
+    bool live = true;
+
+    for (int i = 0; i < size; i++) callees[i] = NOT_DIRECT;
+
+    for (int offset = 0; offset < chunk->count; ) {
+        uint8_t *ip = &chunk->code[offset];
+        int pops, pushes;
+
+        if (pending[offset] != NULL) {
+            if (!live) {
+                depth = pendingDepth[offset];
+                memcpy(producers, pending[offset], depth * sizeof(int));
+            }
+            for (int i = 0; i < depth; i++) {
+                if (producers[i] != pending[offset][i]) producers[i] = -1;
+            }
+            live = true;
+        }
+
+        if (!live) {
+            offset += opcode_length(*ip);
+            continue;
+        }
+
+        if ((*ip == OP_CALL || *ip == OP_TAILCALL) && depth - ip[1] - 1 >= 0) {
+            int callee = producers[depth - ip[1] - 1];
+            if (callee >= 0 && (chunk->code[callee] == OP_GLD || chunk->code[callee] == OP_GLD_W)) {
+                callees[offset] = e->direct[argument(&chunk->code[callee])];
+            }
+        }
+
+        opcode_effect(ip, &pops, &pushes);
+        depth -= pops;
+        for (int i = 0; i < pushes; i++) producers[depth++] = offset;
+
+        if (isJump(*ip)) {
+            branchTo(pending, pendingDepth, size, jumpTarget(chunk->code, offset), producers, depth);
+        }
+        else if (isSwitch(*ip)) {
+            switch_t *table = switchTable(chunk, offset);
+            for (int i = 0; i <= table->caseCount; i++) {
+                branchTo(pending, pendingDepth, size, table->targets[i], producers, depth);
+            }
+        }
+
+        if (*ip == OP_JMP || *ip == OP_JMP_W || *ip == OP_LOOP || *ip == OP_LOOP_W || *ip == OP_RET ||
+            isSwitch(*ip)) {
+            live = false;
+        }
+        offset += opcode_length(*ip);
+    }
+
+    for (int i = 0; i < size; i++) free(pending[i]);
+    free(pending);
+    free(pendingDepth);
+    free(producers);
+    return callees;
+}
+
+#define OUT(...)    fprintf(e->out, __VA_ARGS__)
+
+static void emitBinary(emitter_t *e, char op, const char *cop, bool boolean)
+{
+    OUT("    if (NUM_NUM(PEEK(1), PEEK(0))) { PEEK(1) = %s(AS_NUM(PEEK(1)) %s AS_NUM(PEEK(0))); vm->top--; }\n",
+        boolean ? "VAL_BOOL" : "VAL_NUM", cop);
+    OUT("    else arith(vm, '%c');\n", op);
+}
+
+// d = a op b over slots; (b) is either a slot or a constant expression.
+static void emitRegister(emitter_t *e, char op, const char *cop, int d, int a, const char *b)
+{
+    OUT("    if (NUM_NUM(slots[%d], %s)) slots[%d] = VAL_NUM(AS_NUM(slots[%d]) %s AS_NUM(%s));\n",
+        a, b, d, a, cop, b);
+    OUT("    else { PUSH(slots[%d]); PUSH(%s); arith(vm, '%c'); slots[%d] = POP(); }\n", a, b, op, d);
+}
+
+static void emitCompareJump(emitter_t *e, const char *unless, const char *cop, int target)
+{
+    OUT("    if (%s(tonum(vm, PEEK(1)) %s tonum(vm, PEEK(0)))) { vm->top -= 2; goto L%d; }\n", unless, cop, target);
+    OUT("    vm->top -= 2;\n");
+}
+
+static void unsupported(emitter_t *e, int index, int offset)
+{
+    fun_t *function = e->functions[index];
+    chunk_t *chunk = &function->chunk;
+    int line, column;
+
+    chunk_position(chunk, offset, &line, &column);
+    fprintf(stderr, "[%s:%d:%d] Error in %s: Opcode %s has no C translation.\n",
+        chunk->source->fname, line, column,
+        function->name == NULL ? "script" : function->name->chars, opcode_tostr(chunk->code[offset]));
+    e->failed = true;
+}
+
+static void emitInstruction(emitter_t *e, int index, int offset, int callee)
+{
+    chunk_t *chunk = &e->functions[index]->chunk;
+    uint8_t *ip = &chunk->code[offset];
+    int k = e->constBase[index];
+    char operand[32];
+
+    switch (*ip) {
+        case OP_PRINT:  OUT("    print(vm, %d);\n", ip[1]); break;
+        case OP_POP:    OUT("    vm->top--;\n"); break;
+        case OP_DROP:   OUT("    vm->top[-%d] = vm->top[-1]; vm->top -= %d;\n", ip[1] + 1, ip[1]); break;
+        case OP_RET:    OUT("    return POP();\n"); break;
+        case OP_NIL:    OUT("    PUSH(VAL_NULL);\n"); break;
+        case OP_TRUE:   OUT("    PUSH(VAL_TRUE);\n"); break;
+        case OP_FALSE:  OUT("    PUSH(VAL_FALSE);\n"); break;
+        case OP_CONST:
+        case OP_CONST_W:
+            OUT("    PUSH(K[%d]);\n", k + argument(ip));
+            break;
+        case OP_NEG:    OUT("    neg(vm);\n"); break;
+        case OP_NOT:    OUT("    PEEK(0) = VAL_BOOL(IS_FALSEY(PEEK(0)));\n"); break;
+        case OP_EQ:     OUT("    PEEK(1) = VAL_BOOL(val_equal(PEEK(1), PEEK(0))); vm->top--;\n"); break;
+
+        case OP_CALL:
+        case OP_CALL_NUM:
+        case OP_TAILCALL:
+            // A function calling itself starts over; other tail calls are
+            // made as calls, and the RET after them returns the result.
+            if (*ip == OP_TAILCALL && callee == index && ip[1] == e->functions[index]->arity) {
+                OUT("    memmove(slots + 1, vm->top - %d, %d * sizeof(val_t)); vm->top = slots + %d;\n",
+                    ip[1], ip[1], ip[1] + 1);
+                OUT("    goto L0;\n");
+                break;
+            }
+            if (callee >= 0) {
+                OUT("    { ptrdiff_t at = vm->top - %d - vm->stack; val_t result = fn_%d(vm, %d, vm->top - %d); "
+                    "vm->top = vm->stack + at - 1; PUSH(result); }\n", ip[1], callee, ip[1], ip[1]);
+            }
+            else {
+                OUT("    call(vm, %d);\n", ip[1]);
+            }
+            // The call may have moved the stack.
+            OUT("    slots = vm->stack + base;\n");
+            break;
+
+        case OP_ADD: case OP_ADD_NN: case OP_ADD_SS: emitBinary(e, '+', "+", false); break;
+        case OP_SUB: case OP_SUB_NN: emitBinary(e, '-', "-", false); break;
+        case OP_MUL: case OP_MUL_NN: emitBinary(e, '*', "*", false); break;
+        case OP_DIV: case OP_DIV_NN: emitBinary(e, '/', "/", false); break;
+        case OP_LT: case OP_LT_NN: emitBinary(e, '<', "<", true); break;
+        case OP_LE: case OP_LE_NN: emitBinary(e, 'l', "<=", true); break;
+
+        case OP_DEF:
+        case OP_DEF_W:
+            OUT("    GLOBAL(%d) = POP();\n", argument(ip));
+            break;
+        case OP_GLD:
+        case OP_GLD_W:
+            OUT("    if (IS_UNDEF(GLOBAL(%d))) undefined(vm, G[%d]);\n", argument(ip), argument(ip));
+            OUT("    PUSH(GLOBAL(%d));\n", argument(ip));
+            break;
+        case OP_GST:
+        case OP_GST_W:
+            OUT("    if (IS_UNDEF(GLOBAL(%d))) undefined(vm, G[%d]);\n", argument(ip), argument(ip));
+            OUT("    GLOBAL(%d) = PEEK(0);\n", argument(ip));
+            break;
+        case OP_LD:     OUT("    PUSH(slots[%d]);\n", ip[1]); break;
+        case OP_ST:     OUT("    slots[%d] = PEEK(0);\n", ip[1]); break;
+
+        case OP_JMP:
+        case OP_JMP_W:
+        case OP_LOOP:
+        case OP_LOOP_W:
+            OUT("    goto L%d;\n", jumpTarget(chunk->code, offset));
+            break;
+        case OP_JMPF:
+            OUT("    if (IS_FALSEY(PEEK(0))) goto L%d;\n", jumpTarget(chunk->code, offset));
+            break;
+        case OP_JMPT:
+            OUT("    if (!IS_FALSEY(PEEK(0))) goto L%d;\n", jumpTarget(chunk->code, offset));
+            break;
+        case OP_JMPF_POP:
+            OUT("    if (IS_FALSEY(POP())) goto L%d;\n", jumpTarget(chunk->code, offset));
+            break;
+        case OP_JMPT_POP:
+            OUT("    if (!IS_FALSEY(POP())) goto L%d;\n", jumpTarget(chunk->code, offset));
+            break;
+        case OP_JLT: emitCompareJump(e, "!", "<", jumpTarget(chunk->code, offset)); break;
+        case OP_JLE: emitCompareJump(e, "!", "<=", jumpTarget(chunk->code, offset)); break;
+        case OP_JGT: emitCompareJump(e, "", "<=", jumpTarget(chunk->code, offset)); break;
+        case OP_JGE: emitCompareJump(e, "", "<", jumpTarget(chunk->code, offset)); break;
+        case OP_JEQ:
+        case OP_JNE:
+            OUT("    if (%sval_equal(PEEK(1), PEEK(0))) { vm->top -= 2; goto L%d; }\n",
+                *ip == OP_JEQ ? "!" : "", jumpTarget(chunk->code, offset));
+            OUT("    vm->top -= 2;\n");
+            break;
+
+        case OP_FORPREP:
+        case OP_FORPREP_W:
+            OUT("    if (!forprep(vm, &slots[%d])) goto L%d;\n", ip[1], jumpTarget(chunk->code, offset));
+            break;
+        case OP_FORLOOP:
+        case OP_FORLOOP_W:
+            OUT("    slots[%d] = slots[%d] = VAL_NUM(AS_NUM(slots[%d]) + AS_NUM(slots[%d]));\n",
+                ip[1], ip[1] + 3, ip[1], ip[1] + 2);
+            OUT("    if (AS_NUM(slots[%d]) > 0 ? AS_NUM(slots[%d]) <= AS_NUM(slots[%d]) "
+                ": AS_NUM(slots[%d]) >= AS_NUM(slots[%d])) goto L%d;\n",
+                ip[1] + 2, ip[1], ip[1] + 1, ip[1], ip[1] + 1, jumpTarget(chunk->code, offset));
+            break;
+
+        case OP_JTABLE:
+        case OP_JHASH: {
+            switch_t *table = switchTable(chunk, offset);
+            OUT("    switch (switch_find(&S[%d], slots[%d])) {\n",
+                e->switchBase[index] + (ip[2] << 8 | ip[3]), ip[1]);
+            for (int i = 0; i < table->caseCount; i++) {
+                OUT("        case %d: goto L%d;\n", i, table->targets[i]);
+            }
+            OUT("        default: goto L%d;\n    }\n", table->targets[table->caseCount]);
+            break;
+        }
+
+        case OP_MAP:    OUT("    newMap(vm, %d);\n", ip[1]); break;
+        case OP_GET:    OUT("    getField(vm, K[%d]);\n", k + ip[1]); break;
+        case OP_SET:    OUT("    setField(vm, K[%d]);\n", k + ip[1]); break;
+        case OP_GETI:   OUT("    getIndex(vm);\n"); break;
+        case OP_SETI:   OUT("    setIndex(vm);\n"); break;
+
+        case OP_LD_LD_ADD:
+            OUT("    PUSH(slots[%d]); PUSH(slots[%d]);\n", ip[1], ip[2]);
+            emitBinary(e, '+', "+", false);
+            break;
+        case OP_ADDK:
+        case OP_SUBK:
+            OUT("    PUSH(K[%d]);\n", k + ip[1]);
+            if (*ip == OP_ADDK) emitBinary(e, '+', "+", false);
+            else emitBinary(e, '-', "-", false);
+            break;
+
+        case OP_MOVE:   OUT("    slots[%d] = slots[%d];\n", ip[1], ip[2]); break;
+        case OP_LOADK:  OUT("    slots[%d] = K[%d];\n", ip[1], k + ip[2]); break;
+
+        case OP_ADDR: case OP_SUBR: case OP_MULR: case OP_DIVR:
+            snprintf(operand, sizeof(operand), "slots[%d]", ip[3]);
+            goto registerOp;
+        case OP_ADDRK: case OP_SUBRK: case OP_MULRK: case OP_DIVRK:
+            snprintf(operand, sizeof(operand), "K[%d]", k + ip[3]);
+        registerOp: {
+            static const char ops[] = "+-*/+-*/";
+            char op = ops[*ip - OP_ADDR];
+            char cop[2] = { op, '\0' };
+            emitRegister(e, op, cop, ip[1], ip[2], operand);
+            break;
+        }
+
+        default:
+            unsupported(e, index, offset);
+            break;
+    }
+}
+
+static void emitFunction(emitter_t *e, int index)
+{
+    fun_t *function = e->functions[index];
+    chunk_t *chunk = &function->chunk;
+    bool *labels = calloc(chunk->count + 1, sizeof(bool));
+    int *callees = findCallees(e, chunk);
+
+    for (int offset = 0; offset < chunk->count; offset += opcode_length(chunk->code[offset])) {
+        if (chunk->code[offset] == OP_TAILCALL && callees[offset] == index) labels[0] = true;
+        if (isJump(chunk->code[offset])) labels[jumpTarget(chunk->code, offset)] = true;
+        if (isSwitch(chunk->code[offset])) {
+            switch_t *table = switchTable(chunk, offset);
+            for (int i = 0; i <= table->caseCount; i++) labels[table->targets[i]] = true;
+        }
+    }
+
+    OUT("// %s\n", function->name == NULL ? "<script>" : function->name->chars);
+    OUT("static val_t fn_%d(vm_t *vm, int argc, val_t *args)\n{\n", index);
+    OUT("    ptrdiff_t base = args - 1 - vm->stack;\n");
+    OUT("    enter(vm, argc, %d);\n", function->arity);
+    OUT("    val_t *slots = vm->stack + base;\n\n");
+
+    for (int offset = 0; offset < chunk->count; offset += opcode_length(chunk->code[offset])) {
+        if (labels[offset]) OUT("L%d:\n", offset);
+        emitInstruction(e, index, offset, callees[offset]);
+    }
+
+    OUT("    return VAL_NULL;\n}\n\n");
+    free(labels);
+    free(callees);
+}
+
+static void emitString(emitter_t *e, str_t *string)
+{
+    OUT("\"");
+    for (int i = 0; i < string->length; i++) {
+        unsigned char c = string->chars[i];
+        if (c == '"' || c == '\\') OUT("\\%c", c);
+        else if (c >= 32 && c < 127 && c != '?') OUT("%c", c);
+        else OUT("\\%03o", c);
+    }
+    OUT("\"");
+}
+
+// A number as a C expression; %g writes NaN and the infinities as names
+// C does not know.
+static void emitNumber(emitter_t *e, double number)
+{
+    if (isnan(number)) OUT("VAL_NUM(0.0 / 0.0)");
+    else if (isinf(number)) OUT("VAL_NUM(%s1.0 / 0.0)", number < 0 ? "-" : "");
+    else OUT("VAL_NUM(%.17g)", number);
+}
+
+static void emitConstant(emitter_t *e, val_t value)
+{
+    OUT("    arr_add(pool, ");
+
+    if (IS_NUM(value)) {
+        emitNumber(e, AS_NUM(value));
+    }
+    else if (IS_BOOL(value)) {
+        OUT(AS_BOOL(value) ? "VAL_TRUE" : "VAL_FALSE");
+    }
+    else if (IS_STR(value)) {
+        str_t *string = AS_STR(value);
+        bool ignorecase = hash_string(string->chars, string->length, true) == string->hash;
+        OUT("VAL_OBJ(str_copy(vm, ");
+        emitString(e, string);
+        OUT(", %d, %s))", string->length, ignorecase ? "true" : "false");
+    }
+    else if (IS_FUN(value)) {
+        OUT("VAL_CFN(&native_%d)", functionIndex(e, AS_FUN(value)));
+    }
+    else {
+        OUT("VAL_NULL");
+    }
+
+    OUT(", true);\n");
+}
+
+// A Switch label, which is a number or one of the function's string
+// constants.
+static void emitLabel(emitter_t *e, int index, val_t value)
+{
+    arr_t *constants = &e->functions[index]->chunk.constants;
+
+    if (IS_NUM(value)) {
+        emitNumber(e, AS_NUM(value));
+        return;
+    }
+
+    for (int i = 0; i < constants->count; i++) {
+        if (AS_RAW(constants->values[i]) == AS_RAW(value)) {
+            OUT("K[%d]", e->constBase[index] + i);
+            return;
+        }
+    }
+    OUT("VAL_NULL");
+}
+
+// Rebuild the Switch tables of every function in S[], in order.
+static void emitSwitches(emitter_t *e)
+{
+    for (int f = 0; f < e->count; f++) {
+        chunk_t *chunk = &e->functions[f]->chunk;
+
+        for (int t = 0; t < chunk->switchCount; t++) {
+            switch_t *table = &chunk->switches[t];
+
+            OUT("    chunk_switch(&script->chunk);\n");
+            OUT("    table = &script->chunk.switches[%d];\n", t + e->switchBase[f]);
+            for (int i = 0; i < table->labelCount; i++) {
+                swlabel_t *label = &table->labels[i];
+                OUT("    switch_label(table, ");
+                emitLabel(e, f, label->low);
+                OUT(", ");
+                emitLabel(e, f, label->high);
+                OUT(", %d);\n", label->index);
+            }
+            OUT("    table->caseCount = %d;\n", table->caseCount);
+            OUT("    switch_build(table);\n");
+        }
+    }
+    OUT("    S = script->chunk.switches;\n\n");
+}
+
+static void emitMain(emitter_t *e)
+{
+    int globalCount = e->vm->globalValues->count;
+
+    OUT("int main(int argc, char **argv)\n{\n");
+    OUT("    vm_t *vm = vm_create();\n");
+    OUT("    if (vm == NULL) return VM_INIT_ERROR;\n\n");
+    OUT("    load_libmath(vm);\n");
+    OUT("    load_libthread(vm);\n\n");
+
+    // The constants live in a function object on the stack so the GC
+    // sees them, in the slot a script function would take.
+    OUT("    fun_t *script = fun_new(vm, NULL);\n");
+    OUT("    arr_t *pool = &script->chunk.constants;\n");
+    OUT("    PUSH(VAL_OBJ(script));\n\n");
+
+    for (int i = 0; i < e->count; i++) {
+        arr_t *constants = &e->functions[i]->chunk.constants;
+        for (int j = 0; j < constants->count; j++) emitConstant(e, constants->values[j]);
+    }
+    OUT("    K = pool->values;\n\n");
+
+    if (e->switchCount > 0) {
+        OUT("    switch_t *table;\n");
+        emitSwitches(e);
+    }
+
+    for (int i = 0; i < globalCount; i++) {
+        str_t *name = vm_global_name(e->vm, i);
+        OUT("    G[%d] = vm_global(vm, str_copy(vm, ", i);
+        emitString(e, name);
+        OUT(", %d, true));\n", name->length);
+    }
+
+    OUT("\n    fn_0(vm, 0, vm->top);\n");
+    OUT("    vm_close(vm);\n");
+    OUT("    return VM_OK;\n}\n");
+}
+
+bool emit_c(vm_t *vm, fun_t *script, const char *fname, FILE *out)
+{
+    emitter_t emitter;
+    emitter_t *e = &emitter;
+
+    memset(e, '\0', sizeof(emitter_t));
+    e->vm = vm;
+
+    // The translation goes to a scratch file first, so that a script that
+    // cannot be translated leaves no half a program in (out).
+    e->out = tmpfile();
+    if (e->out == NULL || !collect(e, script)) {
+        if (e->out != NULL) fclose(e->out);
+        free(e->functions);
+        free(e->constBase);
+        free(e->switchBase);
+        return false;
+    }
+    findDirectGlobals(e);
+
+    OUT("// Generated by 'au3 --emit-c %s'.\n", fname);
+    OUT("%s", prelude);
+    OUT("static int G[%d];\n\n", vm->globalValues->count + 1);
+
+    for (int i = 0; i < e->count; i++) {
+        OUT("static val_t fn_%d(vm_t *vm, int argc, val_t *args);\n", i);
+    }
+    OUT("\n");
+    // Each checks its own arguments on entry.
+    for (int i = 0; i < e->count; i++) {
+        OUT("static const native_t native_%d = { fn_%d, -1 };\n", i, i);
+    }
+    OUT("\n");
+
+    for (int i = 0; i < e->count; i++) emitFunction(e, i);
+    emitMain(e);
+
+    if (!e->failed) {
+        char buffer[4096];
+        size_t size;
+
+        rewind(e->out);
+        while ((size = fread(buffer, 1, sizeof(buffer), e->out)) > 0) fwrite(buffer, 1, size, out);
+    }
+
+    fclose(e->out);
+    free(e->functions);
+    free(e->constBase);
+    free(e->switchBase);
+    free(e->direct);
+    return !e->failed;
+}
+
+int emit_file(vm_t *vm, const char *fname, FILE *out)
+{
+    src_t *source = src_new(fname);
+    if (source == NULL) return VM_COMPILE_ERROR;
+
+    fun_t *function = compile(vm, source);
+    int result = VM_COMPILE_ERROR;
+
+    if (function != NULL) {
+        result = emit_c(vm, function, source->fname, out) ? VM_OK : VM_COMPILE_ERROR;
+    }
+
+    src_free(source);
+    return result;
+}
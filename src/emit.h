@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// Translate a compiled script and every function reachable from its
+// constants into one C translation unit that links against the runtime.
+bool emit_c(vm_t *vm, fun_t *script, const char *fname, FILE *out);
+
+int emit_file(vm_t *vm, const char *fname, FILE *out);
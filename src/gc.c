@@ -101,7 +101,8 @@ static void blackenObject(gc_t *gc, obj_t *object)
             fun_t *function = (fun_t *)object;
             markObject(gc, (obj_t *)function->name);
             mark_array(gc, &function->chunk.constants);
-            for (int i = 0; i < function->upvalueCount; i++) {
+            markObject(gc, (obj_t *)function->proto);
+            for (int i = 0; function->upvalues != NULL && i < function->upvalueCount; i++) {
                 markObject(gc, (obj_t *)function->upvalues[i]);
             }
             break;
@@ -110,6 +111,19 @@ static void blackenObject(gc_t *gc, obj_t *object)
             map_t *map = (map_t *)object;
             markTable(gc, &map->table);
             mark_hash(gc, &map->hash);
+            if (map->shape != NULL) {
+                markObject(gc, (obj_t *)map->shape);
+                for (int i = 0; i < map->shape->count; i++) {
+                    markValue(gc, map->fields[i]);
+                }
+            }
+            break;
+        }
+        case OT_SHP: {
+            shp_t *shape = (shp_t *)object;
+            markObject(gc, (obj_t *)shape->parent);
+            markObject(gc, (obj_t *)shape->key);
+            markTable(gc, &shape->transitions);
             break;
         }
     }
@@ -119,6 +133,8 @@ static void markRoots(vm_t *vm)
 {
     gc_t *gc = vm->gc;
 
+    markObject(gc, (obj_t *)vm->emptyShape);
+
     for (int i = 0; i < vm->numRoots; i++) {
         markObject(gc, vm->tempRoots[i]);
     }
@@ -191,6 +207,7 @@ void gc_collect(gc_t *gc)
 
     markRoots(vm);
     markTable(gc, vm->globals);
+    mark_array(gc, vm->globalValues);
     traceReferences(gc);
     removeWhite(vm->strings);
     sweep(gc);
@@ -19,6 +19,24 @@ void hash_free(hash_t *hash)
     hash_init(hash);
 }
 
+void hash_copy(hash_t *to, hash_t *from)
+{
+    hash_init(to);
+    for (int i = 0; i < from->capacity; i++) {
+        index_t *index = &from->indexes[i];
+        if (index->key != UNUSED_INDEX) hash_set(to, index->key, index->value);
+    }
+}
+
+uint64_t hash_value(val_t value)
+{
+    uint64_t key = AS_RAW(value) ^ ((uint64_t)AS_TYPE(value) << 56);
+
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return (key ^ (key >> 31)) & (UNUSED_INDEX - 1);
+}
+
 static index_t *hash_find(index_t *indexes, int capacity, uint64_t key)
 {
     uint32_t i = key % capacity;
@@ -16,6 +16,11 @@ typedef struct {
 
 void hash_init(hash_t *hash);
 void hash_free(hash_t *hash);
+void hash_copy(hash_t *to, hash_t *from);
+
+// A well-mixed key for (value), compared by its bits. Never the
+// reserved empty key.
+uint64_t hash_value(val_t value);
 
 bool hash_get(hash_t *hash, uint64_t key, val_t *value);
 bool hash_set(hash_t *hash, uint64_t key, val_t value);
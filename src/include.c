@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "include.h"
+#include "vm.h"
+
+#ifdef _WIN32
+static SRWLOCK lock = SRWLOCK_INIT;
+#else
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void include_lock()
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&lock);
+#else
+    pthread_mutex_lock(&lock);
+#endif
+}
+
+void include_unlock()
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&lock);
+#else
+    pthread_mutex_unlock(&lock);
+#endif
+}
+
+static bool isAbsolute(const char *path)
+{
+    return path[0] == '/' || path[0] == '\\' || (path[0] != '\0' && path[1] == ':');
+}
+
+// (name) relative to the directory of (from).
+static char *resolvePath(const char *from, const char *name, int length)
+{
+    int dir = 0;
+
+    if (!isAbsolute(name)) {
+        for (int i = 0; from[i] != '\0'; i++) {
+            if (from[i] == '/' || from[i] == '\\') dir = i + 1;
+        }
+    }
+
+    char *path = malloc(dir + length + 1);
+    memcpy(path, from, dir);
+    memcpy(path + dir, name, length);
+    path[dir + length] = '\0';
+    return path;
+}
+
+static int addUnit(graph_t *graph, char *path, src_t *source)
+{
+    for (int i = 0; i < graph->count; i++) {
+        if (strcmp(graph->units[i].path, path) == 0) {
+            free(path);
+            return i;
+        }
+    }
+
+    if (graph->count == graph->capacity) {
+        graph->capacity = GROW_CAP(graph->capacity);
+        graph->units = realloc(graph->units, graph->capacity * sizeof(unit_t));
+    }
+
+    unit_t *unit = &graph->units[graph->count];
+    unit->path = path;
+    unit->source = source != NULL ? source : src_new(path);
+    unit->function = NULL;
+    unit->includes = NULL;
+    unit->includeCount = 0;
+    unit->hadError = false;
+    return graph->count++;
+}
+
+#ifdef HOIST_LOADS
+static void noteStored(vm_t *vm, uint64_t key)
+{
+    val_t count = VAL_NUM(0);
+
+    hash_get(&vm->stores, key, &count);
+    hash_set(&vm->stores, key, VAL_NUM(AS_NUM(count) + 1));
+}
+
+static bool declares(toktype_t type)
+{
+    switch (type) {
+        case TOKEN_GLOBAL: case TOKEN_LOCAL: case TOKEN_DIM: case TOKEN_CONST:
+        case TOKEN_STATIC: case TOKEN_VAR: case TOKEN_FUNC: case TOKEN_FOR:
+        case TOKEN_REDIM:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Record what (token) stores to, if anything, from the tokens before it.
+// Every name on an Enum line is defined. An '=' that compares counts
+// too, which only makes HOIST_LOADS more careful.
+static void scanStore(vm_t *vm, tok_t *token, tok_t *back, tok_t *twoBack, int enumLine)
+{
+    if (token->type == TOKEN_IDENTIFIER && (declares(back->type) || token->line == enumLine)) {
+        noteStored(vm, STORED_NAME(hash_string(token->start, token->length, true)));
+    }
+    else if (token->type == TOKEN_EQUAL && back->type == TOKEN_IDENTIFIER) {
+        uint32_t hash = hash_string(back->start, back->length, true);
+        noteStored(vm, twoBack->type == TOKEN_DOT ? STORED_FIELD(hash) : STORED_NAME(hash));
+    }
+    else if (token->type == TOKEN_EQUAL && back->type == TOKEN_RBRACKET) {
+        noteStored(vm, STORED_INDEX);
+    }
+}
+#endif
+
+// Record the '#include "file"' lines of (index), as the parser will
+// meet them, and with HOIST_LOADS every store written in it.
+static void scanUnit(graph_t *graph, int index)
+{
+    lexer_t lexer;
+    int capacity = 0;
+#ifdef HOIST_LOADS
+    tok_t back = { NULL, NULL, TOKEN_EOF }, twoBack = back;
+    int enumLine = -1;
+#endif
+
+    if (graph->units[index].source == NULL) return;
+    lexer_init(&lexer, graph->units[index].source->buffer);
+
+    for (tok_t token = lexer_scan(&lexer); token.type != TOKEN_EOF; token = lexer_scan(&lexer)) {
+#ifdef HOIST_LOADS
+        if (token.type == TOKEN_ENUM) enumLine = token.line;
+        scanStore(graph->vm, &token, &back, &twoBack, enumLine);
+        twoBack = back;
+        back = token;
+#endif
+
+        if (token.type != TOKEN_PREPROCESSOR || token.length != 8 ||
+            !equal_str(token.start, "#include", 8)) {
+            continue;
+        }
+
+        token = lexer_scan(&lexer);
+        if (token.type != TOKEN_STRING) continue;
+
+        char *path = resolvePath(graph->units[index].path, token.start + 1, token.length - 2);
+        int target = addUnit(graph, path, NULL);
+
+        // Adding may have moved the units.
+        unit_t *unit = &graph->units[index];
+        if (unit->includeCount == capacity) {
+            capacity = GROW_CAP(capacity);
+            unit->includes = realloc(unit->includes, capacity * sizeof(incl_t));
+        }
+        unit->includes[unit->includeCount].unit = target;
+        unit->includes[unit->includeCount++].runs = false;
+    }
+}
+
+static void markRuns(graph_t *graph, int index, bool *reached)
+{
+    unit_t *unit = &graph->units[index];
+
+    for (int i = 0; i < unit->includeCount; i++) {
+        int target = unit->includes[i].unit;
+        if (reached[target] || graph->units[target].source == NULL) continue;
+
+        reached[target] = true;
+        unit->includes[i].runs = true;
+        markRuns(graph, target, reached);
+    }
+}
+
+void include_scan(vm_t *vm, src_t *script, graph_t *graph)
+{
+    graph->vm = vm;
+    graph->units = NULL;
+    graph->count = 0;
+    graph->capacity = 0;
+
+    addUnit(graph, strdup(script->path), script);
+    for (int i = 0; i < graph->count; i++) scanUnit(graph, i);
+
+    for (int i = 0; i < graph->count; i++) {
+        graph->units[i].function = fun_new(vm, graph->units[i].source);
+    }
+
+    bool *reached = calloc(graph->count, sizeof(bool));
+    reached[0] = true;
+    markRuns(graph, 0, reached);
+    free(reached);
+}
+
+void include_free(graph_t *graph)
+{
+    src_t *script = graph->units[0].source;
+
+    for (int i = 0; i < graph->count; i++) {
+        unit_t *unit = &graph->units[i];
+
+        if (i > 0 && unit->source != NULL) {
+            script->included = realloc(script->included, (script->includedCount + 1) * sizeof(src_t *));
+            script->included[script->includedCount++] = unit->source;
+        }
+        free(unit->path);
+        free(unit->includes);
+    }
+
+    free(graph->units);
+}
+
+typedef struct {
+    graph_t *graph;
+    void (*work)(graph_t *graph, unit_t *unit);
+    int next;
+} pool_t;
+
+#ifdef _WIN32
+static DWORD WINAPI worker(void *data)
+#else
+static void *worker(void *data)
+#endif
+{
+    pool_t *pool = data;
+
+    for (;;) {
+        include_lock();
+        int index = pool->next++;
+        include_unlock();
+
+        if (index >= pool->graph->count) break;
+        pool->work(pool->graph, &pool->graph->units[index]);
+    }
+
+    return 0;
+}
+
+static int processors()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+void include_parallel(graph_t *graph, void (*work)(graph_t *graph, unit_t *unit))
+{
+    pool_t pool = { graph, work, 0 };
+    int count = graph->count < INCLUDE_THREADS ? graph->count : INCLUDE_THREADS;
+    if (count > 1 && processors() < count) count = processors();
+
+    // This thread is the first worker.
+#ifdef _WIN32
+    HANDLE threads[INCLUDE_THREADS];
+    for (int i = 1; i < count; i++) {
+        threads[i] = CreateThread(NULL, 0, worker, &pool, 0, NULL);
+    }
+    worker(&pool);
+    for (int i = 1; i < count; i++) {
+        if (threads[i] == NULL) continue;
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+#else
+    pthread_t threads[INCLUDE_THREADS];
+    bool started[INCLUDE_THREADS];
+    for (int i = 1; i < count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, worker, &pool) == 0;
+    }
+    worker(&pool);
+    for (int i = 1; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+#endif
+}
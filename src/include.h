@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+#include "code.h"
+#include "object.h"
+
+// An '#include "file"' as written in a unit, in source order.
+typedef struct {
+    int unit;               // the unit it names
+    bool runs;              // first one reached for that unit
+} incl_t;
+
+// One file of a script: the script itself or a file it includes. Each
+// is compiled on its own into the function (function), which runs its
+// top-level code.
+typedef struct {
+    char *path;
+    src_t *source;          // NULL if the file could not be read
+    fun_t *function;
+    incl_t *includes;
+    int includeCount;
+    bool hadError;
+} unit_t;
+
+typedef struct {
+    vm_t *vm;
+    unit_t *units;          // units[0] is the script
+    int count;
+    int capacity;
+} graph_t;
+
+// Find every file (script) includes, directly or not. Each reachable
+// file is read once, however many times it is included, and runs where
+// a depth-first walk of the includes in source order first reaches it.
+void include_scan(vm_t *vm, src_t *script, graph_t *graph);
+
+// Hand the included sources over to the script, which frees them with
+// its own, and release the rest.
+void include_free(graph_t *graph);
+
+// Run (work) for every unit of (graph), on up to INCLUDE_THREADS threads
+// and no more than there are processors.
+void include_parallel(graph_t *graph, void (*work)(graph_t *graph, unit_t *unit));
+
+// Serializes what the workers share: the string table, the heap and the
+// global slots.
+void include_lock();
+void include_unlock();
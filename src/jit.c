@@ -0,0 +1,1264 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "vm.h"
+#include "value.h"
+#include "code.h"
+#include "object.h"
+
+#ifdef JIT
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// A baseline template JIT. Common instructions are emitted inline over
+// the NaN-boxed stack with a number fast path, everything else becomes a
+// direct call to a helper below. Branches become native jumps, so the
+// dispatch loop disappears while the VM stack, frames and error
+// reporting stay exactly as the interpreter leaves them.
+
+#define PUSH(v)     *((vm)->top++) = (v)
+#define POP()       *(--(vm)->top)
+#define PEEK(i)     ((vm)->top[-1 - (i)])
+
+#define FRAME()     (&vm->frames[vm->frameCount - 1])
+#define SLOTS()     (FRAME()->slots)
+#define CONSTS()    (FRAME()->function->chunk.constants.values)
+#define SHORT(ip)   ((ip)[0] << 8 | (ip)[1])
+#define CACHE()     (&FRAME()->function->chunk.caches[SHORT(ip + 1)])
+#define LONG(ip)    ((int32_t)((uint32_t)(ip)[0] << 24 | (ip)[1] << 16 | (ip)[2] << 8 | (ip)[3]))
+
+// Helpers get (ip) pointing at the operands of their instruction and
+// return 0 to fall through, 1 to take the branch and -1 on an error.
+typedef int (*helper_t)(vm_t *vm, uint8_t *ip);
+
+// Returned by compiled code that handed its frame to the callee of an
+// OP_TAILCALL, which jit_enter() then runs in it.
+#define TAIL_CALLED     3
+
+#define FAIL(fmt, ...) \
+    do { \
+        FRAME()->ip = ip; \
+        vm_error(vm, fmt, ##__VA_ARGS__); \
+        return -1; \
+    } while (0)
+
+#define BINARY(name, type, op) \
+    static int name(vm_t *vm, uint8_t *ip) \
+    { \
+        double a, b; \
+        if (!val_tonums(PEEK(1), PEEK(0), &a, &b)) { \
+            FAIL("Operands must be two numbers/booleans."); \
+        } \
+        vm->top -= 2; \
+        PUSH(type(a op b)); \
+        return 0; \
+    }
+
+#define JUMP_WHEN(name, cond) \
+    static int name(vm_t *vm, uint8_t *ip) \
+    { \
+        double a, b; \
+        if (!val_tonums(PEEK(1), PEEK(0), &a, &b)) { \
+            FAIL("Operands must be two numbers/booleans."); \
+        } \
+        vm->top -= 2; \
+        return cond; \
+    }
+
+#define ARITH_R(name, op, rhs) \
+    static int name(vm_t *vm, uint8_t *ip) \
+    { \
+        val_t *slots = SLOTS(); \
+        double a, b; \
+        if (!val_tonums(slots[ip[1]], rhs, &a, &b)) { \
+            FAIL("Operands must be two numbers/booleans."); \
+        } \
+        slots[ip[0]] = VAL_NUM(a op b); \
+        return 0; \
+    }
+
+static int jitPrint(vm_t *vm, uint8_t *ip)
+{
+    int count = ip[0];
+
+    for (int i = count - 1; i >= 0; i--) {
+        val_print(PEEK(i));
+        if (i > 0) printf("\t");
+    }
+    printf("\n");
+
+    vm->top -= count;
+    return 0;
+}
+
+static int jitPop(vm_t *vm, uint8_t *ip)
+{
+    vm->top--;
+    return 0;
+}
+
+static int jitDrop(vm_t *vm, uint8_t *ip)
+{
+    PEEK(ip[0]) = PEEK(0);
+    vm->top -= ip[0];
+    return 0;
+}
+
+static int jitNil(vm_t *vm, uint8_t *ip)
+{
+    PUSH(VAL_NULL);
+    return 0;
+}
+
+static int jitTrue(vm_t *vm, uint8_t *ip)
+{
+    PUSH(VAL_TRUE);
+    return 0;
+}
+
+static int jitFalse(vm_t *vm, uint8_t *ip)
+{
+    PUSH(VAL_FALSE);
+    return 0;
+}
+
+static int jitConst(vm_t *vm, uint8_t *ip)
+{
+    PUSH(CONSTS()[ip[0]]);
+    return 0;
+}
+
+static int jitCall(vm_t *vm, uint8_t *ip)
+{
+    int argCount = ip[0];
+    int frameCount = vm->frameCount;
+    callsite_t *site = &FRAME()->function->chunk.calls[SHORT(ip + 1)];
+
+    FRAME()->ip = ip + 3;
+    if (!vm_callsite(vm, site, argCount)) return -1;
+    if (vm->frameCount == frameCount) return 0;
+
+    fun_t *function = FRAME()->function;
+    int result = function->jit != NULL ? jit_enter(vm) : vm_execute(vm);
+    return result == VM_OK ? 0 : -1;
+}
+
+// OP_CALL_NUM stays on its fast path while the callee is a native over
+// numbers, and makes a full call when it is not.
+static int jitCallNum(vm_t *vm, uint8_t *ip)
+{
+    if (vm_calldirect(vm, ip[0])) return 0;
+    return jitCall(vm, ip);
+}
+
+// Returns 1 when the frame now runs the callee, see TAIL_CALLED.
+static int jitTailCall(vm_t *vm, uint8_t *ip)
+{
+    int argCount = ip[0];
+
+    FRAME()->ip = ip + 3;
+    if (!IS_FUN(PEEK(argCount))) return vm_call(vm, PEEK(argCount), argCount) ? 0 : -1;
+    return vm_tailcall(vm, argCount) ? 1 : -1;
+}
+
+static int jitRet(vm_t *vm, uint8_t *ip)
+{
+    val_t result = POP();
+
+    vm_closeupvalues(vm, FRAME()->slots);
+    vm->top = FRAME()->slots;
+    vm->frameCount--;
+    PUSH(result);
+    return 0;
+}
+
+static int jitNot(vm_t *vm, uint8_t *ip)
+{
+    PEEK(0) = VAL_BOOL(IS_FALSEY(PEEK(0)));
+    return 0;
+}
+
+static int jitNeg(vm_t *vm, uint8_t *ip)
+{
+    switch (AS_TYPE(PEEK(0))) {
+        case VT_BOOL:
+            PEEK(0) = VAL_NUM(-(char)AS_BOOL(PEEK(0)));
+            return 0;
+        case VT_NUM:
+            PEEK(0) = VAL_NUM(-AS_NUM(PEEK(0)));
+            return 0;
+        default:
+            break;
+    }
+    FAIL("Operands must be a number/boolean.");
+}
+
+static int jitEq(vm_t *vm, uint8_t *ip)
+{
+    val_t b = POP();
+    val_t a = POP();
+    PUSH(VAL_BOOL(val_equal(a, b)));
+    return 0;
+}
+
+static int jitAdd(vm_t *vm, uint8_t *ip)
+{
+    if (IS_NUM(PEEK(0)) && IS_NUM(PEEK(1))) {
+        double b = AS_NUM(POP());
+        double a = AS_NUM(POP());
+        PUSH(VAL_NUM(a + b));
+        return 0;
+    }
+
+    if (!vm_add(vm)) FAIL("Operands must be two numbers/booleans/strings.");
+    return 0;
+}
+
+BINARY(jitSub, VAL_NUM, -)
+BINARY(jitMul, VAL_NUM, *)
+BINARY(jitDiv, VAL_NUM, /)
+BINARY(jitLt, VAL_BOOL, <)
+BINARY(jitLe, VAL_BOOL, <=)
+
+static int jitDef(vm_t *vm, uint8_t *ip)
+{
+    vm->globalValues->values[ip[0]] = POP();
+    return 0;
+}
+
+static int jitGld(vm_t *vm, uint8_t *ip)
+{
+    val_t value = vm->globalValues->values[ip[0]];
+    if (IS_UNDEF(value)) {
+        FAIL("Undefined variable '%s'.", vm_global_name(vm, ip[0])->chars);
+    }
+    PUSH(value);
+    return 0;
+}
+
+static int jitGst(vm_t *vm, uint8_t *ip)
+{
+    val_t *global = &vm->globalValues->values[ip[0]];
+    if (IS_UNDEF(*global)) {
+        FAIL("Undefined variable '%s'.", vm_global_name(vm, ip[0])->chars);
+    }
+    *global = PEEK(0);
+    return 0;
+}
+
+static int jitConstW(vm_t *vm, uint8_t *ip)
+{
+    PUSH(CONSTS()[SHORT(ip)]);
+    return 0;
+}
+
+static int jitDefW(vm_t *vm, uint8_t *ip)
+{
+    vm->globalValues->values[SHORT(ip)] = POP();
+    return 0;
+}
+
+static int jitGldW(vm_t *vm, uint8_t *ip)
+{
+    val_t value = vm->globalValues->values[SHORT(ip)];
+    if (IS_UNDEF(value)) {
+        FAIL("Undefined variable '%s'.", vm_global_name(vm, SHORT(ip))->chars);
+    }
+    PUSH(value);
+    return 0;
+}
+
+static int jitGstW(vm_t *vm, uint8_t *ip)
+{
+    val_t *global = &vm->globalValues->values[SHORT(ip)];
+    if (IS_UNDEF(*global)) {
+        FAIL("Undefined variable '%s'.", vm_global_name(vm, SHORT(ip))->chars);
+    }
+    *global = PEEK(0);
+    return 0;
+}
+
+static int jitLd(vm_t *vm, uint8_t *ip)
+{
+    PUSH(SLOTS()[ip[0]]);
+    return 0;
+}
+
+static int jitSt(vm_t *vm, uint8_t *ip)
+{
+    SLOTS()[ip[0]] = PEEK(0);
+    return 0;
+}
+
+static int jitClosure(vm_t *vm, uint8_t *ip)
+{
+    vm_closure(vm, AS_FUN(CONSTS()[SHORT(ip)]));
+    return 0;
+}
+
+static int jitClose(vm_t *vm, uint8_t *ip)
+{
+    vm_closeupvalues(vm, vm->top - 1);
+    vm->top--;
+    return 0;
+}
+
+static int jitUld(vm_t *vm, uint8_t *ip)
+{
+    PUSH(*FRAME()->function->upvalues[ip[0]]->location);
+    return 0;
+}
+
+static int jitUst(vm_t *vm, uint8_t *ip)
+{
+    *FRAME()->function->upvalues[ip[0]]->location = PEEK(0);
+    return 0;
+}
+
+static int jitOld(vm_t *vm, uint8_t *ip)
+{
+    PUSH(*vm_outer(vm, ip[0], ip[1]));
+    return 0;
+}
+
+static int jitOst(vm_t *vm, uint8_t *ip)
+{
+    *vm_outer(vm, ip[0], ip[1]) = PEEK(0);
+    return 0;
+}
+
+static int jitJmpf(vm_t *vm, uint8_t *ip)
+{
+    return IS_FALSEY(PEEK(0));
+}
+
+static int jitJmpt(vm_t *vm, uint8_t *ip)
+{
+    return !IS_FALSEY(PEEK(0));
+}
+
+static int jitJmpfPop(vm_t *vm, uint8_t *ip)
+{
+    return IS_FALSEY(POP());
+}
+
+static int jitJmptPop(vm_t *vm, uint8_t *ip)
+{
+    return !IS_FALSEY(POP());
+}
+
+JUMP_WHEN(jitJlt, !(a < b))
+JUMP_WHEN(jitJle, !(a <= b))
+JUMP_WHEN(jitJgt, a <= b)
+JUMP_WHEN(jitJge, a < b)
+
+static int jitJeq(vm_t *vm, uint8_t *ip)
+{
+    val_t b = POP();
+    val_t a = POP();
+    return !val_equal(a, b);
+}
+
+static int jitJne(vm_t *vm, uint8_t *ip)
+{
+    val_t b = POP();
+    val_t a = POP();
+    return val_equal(a, b);
+}
+
+// Branches past the loop when it does not run.
+static int jitForprep(vm_t *vm, uint8_t *ip)
+{
+    val_t *slot = &SLOTS()[ip[0]];
+    double start, limit, step;
+
+    if (!val_tonums(slot[0], slot[1], &start, &limit) ||
+        !val_tonums(slot[2], slot[2], &step, &step)) {
+        FAIL("'For' values must be numbers/booleans.");
+    }
+    if (step == 0) FAIL("'For' step is zero.");
+
+    slot[0] = VAL_NUM(start);
+    slot[1] = VAL_NUM(limit);
+    slot[2] = VAL_NUM(step);
+    if (!(step > 0 ? start <= limit : start >= limit)) return 1;
+
+    slot[3] = slot[0];
+    return 0;
+}
+
+static int jitForloop(vm_t *vm, uint8_t *ip)
+{
+    val_t *slot = &SLOTS()[ip[0]];
+    double step = AS_NUM(slot[2]);
+    double counter = AS_NUM(slot[0]) + step;
+
+    slot[0] = slot[3] = VAL_NUM(counter);
+    return step > 0 ? counter <= AS_NUM(slot[1]) : counter >= AS_NUM(slot[1]);
+}
+
+// Returns the case the subject selects rather than a branch decision.
+static int jitSwitch(vm_t *vm, uint8_t *ip)
+{
+    switch_t *table = &FRAME()->function->chunk.switches[SHORT(ip + 1)];
+    return switch_find(table, SLOTS()[ip[0]]);
+}
+
+static int jitLdLdAdd(vm_t *vm, uint8_t *ip)
+{
+    val_t *slots = SLOTS();
+    PUSH(slots[ip[0]]);
+    PUSH(slots[ip[1]]);
+    return jitAdd(vm, ip);
+}
+
+static int jitAddk(vm_t *vm, uint8_t *ip)
+{
+    PUSH(CONSTS()[ip[0]]);
+    return jitAdd(vm, ip);
+}
+
+static int jitSubk(vm_t *vm, uint8_t *ip)
+{
+    PUSH(CONSTS()[ip[0]]);
+    return jitSub(vm, ip);
+}
+
+static int jitMove(vm_t *vm, uint8_t *ip)
+{
+    val_t *slots = SLOTS();
+    slots[ip[0]] = slots[ip[1]];
+    return 0;
+}
+
+static int jitLoadk(vm_t *vm, uint8_t *ip)
+{
+    SLOTS()[ip[0]] = CONSTS()[ip[1]];
+    return 0;
+}
+
+static int addR(vm_t *vm, uint8_t *ip, val_t b)
+{
+    val_t *slots = SLOTS();
+
+    PUSH(slots[ip[1]]);
+    PUSH(b);
+    if (jitAdd(vm, ip) < 0) return -1;
+    SLOTS()[ip[0]] = POP();
+    return 0;
+}
+
+static int jitAddr(vm_t *vm, uint8_t *ip)
+{
+    return addR(vm, ip, SLOTS()[ip[2]]);
+}
+
+static int jitAddrk(vm_t *vm, uint8_t *ip)
+{
+    return addR(vm, ip, CONSTS()[ip[2]]);
+}
+
+ARITH_R(jitSubr, -, slots[ip[2]])
+ARITH_R(jitMulr, *, slots[ip[2]])
+ARITH_R(jitDivr, /, slots[ip[2]])
+ARITH_R(jitSubrk, -, CONSTS()[ip[2]])
+ARITH_R(jitMulrk, *, CONSTS()[ip[2]])
+ARITH_R(jitDivrk, /, CONSTS()[ip[2]])
+
+static int jitMap(vm_t *vm, uint8_t *ip)
+{
+    int count = ip[0];
+    map_t *map = map_new(vm);
+
+    for (int i = count - 1; i >= 0; i--) {
+        hash_set(&map->hash, AS_RAW(VAL_NUM(i)), PEEK(i));
+    }
+
+    vm->top -= count;
+    PUSH(VAL_OBJ(map));
+    return 0;
+}
+
+// Field access goes through the inline cache the interpreter shares.
+static int jitGet(vm_t *vm, uint8_t *ip)
+{
+    if (!IS_MAP(PEEK(0))) FAIL("Operands must be a map.");
+
+    PEEK(0) = vm_getfield(AS_MAP(PEEK(0)), AS_STR(CONSTS()[ip[0]]), CACHE());
+    return 0;
+}
+
+static int jitSet(vm_t *vm, uint8_t *ip)
+{
+    if (!IS_MAP(PEEK(1))) FAIL("Operands must be a map.");
+
+    val_t value = PEEK(0);
+    vm_setfield(vm, AS_MAP(PEEK(1)), AS_STR(CONSTS()[ip[0]]), CACHE(), value);
+    vm->top--;
+    PEEK(0) = value;
+    return 0;
+}
+
+static int jitGeti(vm_t *vm, uint8_t *ip)
+{
+    if (!IS_MAP(PEEK(1))) FAIL("Operands must be a map.");
+
+    map_t *map = AS_MAP(PEEK(1));
+    val_t value = VAL_NULL;
+
+    if (IS_NUM(PEEK(0))) hash_get(&map->hash, AS_RAW(PEEK(0)), &value);
+    else if (IS_STR(PEEK(0))) map_get(map, AS_STR(PEEK(0)), &value);
+    else FAIL("Operands must be a number or string.");
+
+    vm->top--;
+    PEEK(0) = value;
+    return 0;
+}
+
+static int jitSeti(vm_t *vm, uint8_t *ip)
+{
+    if (!IS_MAP(PEEK(2))) FAIL("Operands must be a map.");
+
+    map_t *map = AS_MAP(PEEK(2));
+    val_t value = PEEK(0);
+
+    if (IS_NUM(PEEK(1))) hash_set(&map->hash, AS_RAW(PEEK(1)), value);
+    else if (IS_STR(PEEK(1))) map_put(vm, map, AS_STR(PEEK(1)), value);
+    else FAIL("Operands must be a number or string.");
+
+    vm->top -= 2;
+    PEEK(0) = value;
+    return 0;
+}
+
+typedef enum {
+    OK_NONE,        // not supported, the function stays interpreted
+    OK_PLAIN,       // helper can not fail
+    OK_FAIL,        // helper may raise a runtime error
+    OK_CALL,        // like OK_FAIL, and the stack may move under the helper
+    OK_BRANCH,      // conditional jump, helper decides
+    OK_JUMP,        // unconditional jump, no helper
+    OK_TABLE,       // jump through a table, helper picks the entry
+    OK_TAIL,        // tail call, helper may hand the frame to the callee
+    OK_RET
+} opkind_t;
+
+static const struct {
+    helper_t helper;
+    uint8_t kind;
+} opTable[MAX_OPCODES] = {
+    [OP_PRINT]      = { jitPrint,   OK_PLAIN },
+    [OP_POP]        = { jitPop,     OK_PLAIN },
+    [OP_CALL]       = { jitCall,    OK_CALL },
+    [OP_TAILCALL]   = { jitTailCall, OK_TAIL },
+    [OP_CALL_NUM]   = { jitCallNum, OK_CALL },
+    [OP_RET]        = { jitRet,     OK_RET },
+    [OP_NIL]        = { jitNil,     OK_PLAIN },
+    [OP_TRUE]       = { jitTrue,    OK_PLAIN },
+    [OP_FALSE]      = { jitFalse,   OK_PLAIN },
+    [OP_CONST]      = { jitConst,   OK_PLAIN },
+    [OP_NEG]        = { jitNeg,     OK_FAIL },
+    [OP_NOT]        = { jitNot,     OK_PLAIN },
+    [OP_LT]         = { jitLt,      OK_FAIL },
+    [OP_LE]         = { jitLe,      OK_FAIL },
+    [OP_EQ]         = { jitEq,      OK_PLAIN },
+    [OP_ADD]        = { jitAdd,     OK_FAIL },
+    [OP_SUB]        = { jitSub,     OK_FAIL },
+    [OP_MUL]        = { jitMul,     OK_FAIL },
+    [OP_DIV]        = { jitDiv,     OK_FAIL },
+    [OP_DEF]        = { jitDef,     OK_PLAIN },
+    [OP_GLD]        = { jitGld,     OK_FAIL },
+    [OP_GST]        = { jitGst,     OK_FAIL },
+    [OP_JMP]        = { NULL,       OK_JUMP },
+    [OP_JMPF]       = { jitJmpf,    OK_BRANCH },
+    [OP_LD]         = { jitLd,      OK_PLAIN },
+    [OP_ST]         = { jitSt,      OK_PLAIN },
+    [OP_MAP]        = { jitMap,     OK_PLAIN },
+    [OP_GET]        = { jitGet,     OK_FAIL },
+    [OP_SET]        = { jitSet,     OK_FAIL },
+    [OP_GETI]       = { jitGeti,    OK_FAIL },
+    [OP_SETI]       = { jitSeti,    OK_FAIL },
+    [OP_ADD_NN]     = { jitAdd,     OK_FAIL },
+    [OP_SUB_NN]     = { jitSub,     OK_FAIL },
+    [OP_MUL_NN]     = { jitMul,     OK_FAIL },
+    [OP_DIV_NN]     = { jitDiv,     OK_FAIL },
+    [OP_LT_NN]      = { jitLt,      OK_FAIL },
+    [OP_LE_NN]      = { jitLe,      OK_FAIL },
+    [OP_ADD_SS]     = { jitAdd,     OK_FAIL },
+    [OP_JMPT]       = { jitJmpt,    OK_BRANCH },
+    [OP_JMPF_POP]   = { jitJmpfPop, OK_BRANCH },
+    [OP_JMPT_POP]   = { jitJmptPop, OK_BRANCH },
+    [OP_JLT]        = { jitJlt,     OK_BRANCH },
+    [OP_JLE]        = { jitJle,     OK_BRANCH },
+    [OP_JGT]        = { jitJgt,     OK_BRANCH },
+    [OP_JGE]        = { jitJge,     OK_BRANCH },
+    [OP_JEQ]        = { jitJeq,     OK_BRANCH },
+    [OP_JNE]        = { jitJne,     OK_BRANCH },
+    [OP_LD_LD_ADD]  = { jitLdLdAdd, OK_FAIL },
+    [OP_ADDK]       = { jitAddk,    OK_FAIL },
+    [OP_SUBK]       = { jitSubk,    OK_FAIL },
+    [OP_MOVE]       = { jitMove,    OK_PLAIN },
+    [OP_LOADK]      = { jitLoadk,   OK_PLAIN },
+    [OP_ADDR]       = { jitAddr,    OK_FAIL },
+    [OP_SUBR]       = { jitSubr,    OK_FAIL },
+    [OP_MULR]       = { jitMulr,    OK_FAIL },
+    [OP_DIVR]       = { jitDivr,    OK_FAIL },
+    [OP_ADDRK]      = { jitAddrk,   OK_FAIL },
+    [OP_SUBRK]      = { jitSubrk,   OK_FAIL },
+    [OP_MULRK]      = { jitMulrk,   OK_FAIL },
+    [OP_DIVRK]      = { jitDivrk,   OK_FAIL },
+    [OP_CONST_W]    = { jitConstW,  OK_PLAIN },
+    [OP_DEF_W]      = { jitDefW,    OK_PLAIN },
+    [OP_GLD_W]      = { jitGldW,    OK_FAIL },
+    [OP_GST_W]      = { jitGstW,    OK_FAIL },
+    [OP_JMP_W]      = { NULL,       OK_JUMP },
+    [OP_FORPREP]    = { jitForprep, OK_BRANCH },
+    [OP_FORLOOP]    = { jitForloop, OK_BRANCH },
+    [OP_FORPREP_W]  = { jitForprep, OK_BRANCH },
+    [OP_FORLOOP_W]  = { jitForloop, OK_BRANCH },
+    [OP_LOOP]       = { NULL,       OK_JUMP },
+    [OP_LOOP_W]     = { NULL,       OK_JUMP },
+    [OP_JTABLE]     = { jitSwitch,  OK_TABLE },
+    [OP_JHASH]      = { jitSwitch,  OK_TABLE },
+    [OP_DROP]       = { jitDrop,    OK_PLAIN },
+    [OP_CLOSURE]    = { jitClosure, OK_PLAIN },
+    [OP_CLOSE]      = { jitClose,   OK_PLAIN },
+    [OP_ULD]        = { jitUld,     OK_PLAIN },
+    [OP_UST]        = { jitUst,     OK_PLAIN },
+    [OP_OLD]        = { jitOld,     OK_PLAIN },
+    [OP_OST]        = { jitOst,     OK_PLAIN },
+};
+
+#define ERROR_LABEL     -1
+
+typedef struct {
+    int at;             // offset of a rel32 in the native code
+    int target;         // bytecode offset, or ERROR_LABEL
+    int base;           // native offset the rel32 is relative to
+} fixup_t;
+
+typedef struct {
+    uint8_t *code;
+    int count;
+    int capacity;
+    int *labels;        // bytecode offset -> native offset
+    fixup_t *fixups;
+    int fixupCount;
+    int fixupCapacity;
+} asm_t;
+
+// Registers kept live across the function: rbx is the vm_t *, r12 the
+// frame slots, r13 a cached copy of vm->top and r14 the QNAN mask.
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R12 = 12, R13, R14 };
+
+#define TOP_OFFSET      ((int32_t)offsetof(vm_t, top))
+#define STACK_OFFSET    ((int32_t)offsetof(vm_t, stack))
+#define SLOT(i)         ((int32_t)((i) * (int)sizeof(val_t)))
+
+#define CC_B            0x82
+#define CC_AE           0x83
+#define CC_E            0x84
+#define CC_NE           0x85
+#define CC_BE           0x86
+#define CC_A            0x87
+#define CC_S            0x88
+
+static void emitBytes(asm_t *as, const uint8_t *bytes, int length)
+{
+    if (as->count + length > as->capacity) {
+        as->capacity = GROW_CAP(as->capacity + length);
+        as->code = realloc(as->code, as->capacity);
+    }
+
+    memcpy(as->code + as->count, bytes, length);
+    as->count += length;
+}
+
+#define EMIT(as, ...) \
+    do { \
+        const uint8_t _bytes[] = { __VA_ARGS__ }; \
+        emitBytes(as, _bytes, sizeof(_bytes)); \
+    } while (0)
+
+static void emitInt32(asm_t *as, int32_t value)
+{
+    emitBytes(as, (uint8_t *)&value, sizeof(value));
+}
+
+static void emitImm64(asm_t *as, uint64_t value)
+{
+    emitBytes(as, (uint8_t *)&value, sizeof(value));
+}
+
+// mov reg, imm64
+static void emitMovImm(asm_t *as, int reg, uint64_t value)
+{
+    EMIT(as, 0x48 | ((reg & 8) >> 3), 0xB8 + (reg & 7));
+    emitImm64(as, value);
+}
+
+static void emitModRM(asm_t *as, int reg, int base, int32_t disp)
+{
+    EMIT(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) EMIT(as, 0x24);
+    emitInt32(as, disp);
+}
+
+// A 64-bit 'op reg, [base + disp]' (0x8B loads, 0x89 stores).
+static void emitMem(asm_t *as, uint8_t op, int reg, int base, int32_t disp)
+{
+    EMIT(as, 0x48 | ((reg & 8) >> 1) | ((base & 8) >> 3), op);
+    emitModRM(as, reg, base, disp);
+}
+
+// A scalar double 'op xmm, [base + disp]'.
+static void emitSse(asm_t *as, uint8_t prefix, uint8_t op, int xmm, int base, int32_t disp)
+{
+    EMIT(as, prefix);
+    if (base & 8) EMIT(as, 0x41);
+    EMIT(as, 0x0F, op);
+    emitModRM(as, xmm, base, disp);
+}
+
+static void emitOffset(asm_t *as, int target, int base)
+{
+    if (as->fixupCount == as->fixupCapacity) {
+        as->fixupCapacity = GROW_CAP(as->fixupCapacity);
+        as->fixups = realloc(as->fixups, as->fixupCapacity * sizeof(fixup_t));
+    }
+
+    as->fixups[as->fixupCount++] = (fixup_t){ as->count, target, base };
+    emitInt32(as, 0);
+}
+
+static void emitRel32(asm_t *as, int target)
+{
+    emitOffset(as, target, as->count + 4);
+}
+
+static void emitJcc(asm_t *as, uint8_t cc, int target)
+{
+    EMIT(as, 0x0F, cc);
+    emitRel32(as, target);
+}
+
+// Jumps inside one template (cc 0 is a plain jmp), patched by patchHere().
+static int emitLocalJcc(asm_t *as, uint8_t cc)
+{
+    if (cc == 0) EMIT(as, 0xE9);
+    else EMIT(as, 0x0F, cc);
+    emitInt32(as, 0);
+    return as->count - 4;
+}
+
+static void patchHere(asm_t *as, int at)
+{
+    int32_t rel = as->count - (at + 4);
+    memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+static void emitPrologue(asm_t *as)
+{
+    EMIT(as, 0x53);                         // push rbx
+    EMIT(as, 0x41, 0x54);                   // push r12
+    EMIT(as, 0x41, 0x55);                   // push r13
+    EMIT(as, 0x41, 0x56);                   // push r14
+#ifdef _WIN64
+    EMIT(as, 0x48, 0x83, 0xEC, 0x28);       // sub rsp, 40
+    EMIT(as, 0x48, 0x89, 0xCB);             // mov rbx, rcx
+    EMIT(as, 0x49, 0x89, 0xD4);             // mov r12, rdx
+#else
+    EMIT(as, 0x48, 0x83, 0xEC, 0x08);       // sub rsp, 8
+    EMIT(as, 0x48, 0x89, 0xFB);             // mov rbx, rdi
+    EMIT(as, 0x49, 0x89, 0xF4);             // mov r12, rsi
+#endif
+    emitMem(as, 0x8B, R13, RBX, TOP_OFFSET);
+    emitMovImm(as, R14, QNAN);
+}
+
+static void emitEpilogue(asm_t *as)
+{
+#ifdef _WIN64
+    EMIT(as, 0x48, 0x83, 0xC4, 0x28);       // add rsp, 40
+#else
+    EMIT(as, 0x48, 0x83, 0xC4, 0x08);       // add rsp, 8
+#endif
+    EMIT(as, 0x41, 0x5E);                   // pop r14
+    EMIT(as, 0x41, 0x5D);                   // pop r13
+    EMIT(as, 0x41, 0x5C);                   // pop r12
+    EMIT(as, 0x5B, 0xC3);                   // pop rbx; ret
+}
+
+// Helpers see vm->top, so r13 is written back before and reloaded after.
+static void emitHelper(asm_t *as, helper_t helper, uint8_t *ip)
+{
+    emitMem(as, 0x89, R13, RBX, TOP_OFFSET);
+#ifdef _WIN64
+    EMIT(as, 0x48, 0x89, 0xD9);             // mov rcx, rbx
+    emitMovImm(as, RDX, (uint64_t)(uintptr_t)ip);
+#else
+    EMIT(as, 0x48, 0x89, 0xDF);             // mov rdi, rbx
+    emitMovImm(as, RSI, (uint64_t)(uintptr_t)ip);
+#endif
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)helper);
+    EMIT(as, 0xFF, 0xD0);                   // call rax
+    emitMem(as, 0x8B, R13, RBX, TOP_OFFSET);
+}
+
+static void emitSlowPath(asm_t *as, uint8_t kind, helper_t helper, uint8_t *ip, int target)
+{
+    emitHelper(as, helper, ip);
+
+    switch (kind) {
+        case OK_FAIL:
+            EMIT(as, 0x85, 0xC0);           // test eax, eax
+            emitJcc(as, CC_NE, ERROR_LABEL);
+            break;
+        case OK_BRANCH:
+            EMIT(as, 0x85, 0xC0);           // test eax, eax
+            emitJcc(as, CC_S, ERROR_LABEL);
+            emitJcc(as, CC_NE, target);
+            break;
+    }
+}
+
+typedef struct {
+    int base;           // register, or -1 for an immediate number
+    int32_t disp;
+    uint64_t raw;
+} operand_t;
+
+#define STACK_AT(i)     ((operand_t){ R13, SLOT(i), 0 })
+#define LOCAL(i)        ((operand_t){ R12, SLOT(i), 0 })
+#define NUMBER(v)       ((operand_t){ -1, 0, AS_RAW(v) })
+
+static void emitPush(asm_t *as)
+{
+    emitMem(as, 0x89, RAX, R13, 0);         // mov [r13], rax
+    EMIT(as, 0x49, 0x83, 0xC5, 0x08);       // add r13, 8
+}
+
+static void emitAdjust(asm_t *as, int slots)
+{
+    if (slots > 0) EMIT(as, 0x49, 0x83, 0xC5, (uint8_t)SLOT(slots));   // add r13, n
+    if (slots < 0) EMIT(as, 0x49, 0x83, 0xED, (uint8_t)SLOT(-slots));  // sub r13, n
+}
+
+// Jump to the returned label unless the value at (op) is a number.
+static int emitNumberCheck(asm_t *as, operand_t op)
+{
+    emitMem(as, 0x8B, RAX, op.base, op.disp);
+    EMIT(as, 0x4C, 0x21, 0xF0);             // and rax, r14
+    EMIT(as, 0x4C, 0x39, 0xF0);             // cmp rax, r14
+    return emitLocalJcc(as, CC_E);
+}
+
+static void emitLoadXmm(asm_t *as, int xmm, operand_t op)
+{
+    if (op.base < 0) {
+        emitMovImm(as, RAX, op.raw);
+        EMIT(as, 0x66, 0x48, 0x0F, 0x6E, 0xC0 | (xmm << 3));  // movq xmm, rax
+    }
+    else {
+        emitSse(as, 0xF2, 0x10, xmm, op.base, op.disp);        // movsd xmm, [op]
+    }
+}
+
+// dst = a (sseop) b on doubles, falling back to the helper when either
+// operand is not a number. (adjust) moves the stack top afterwards.
+static void emitArith(asm_t *as, uint8_t sseop, operand_t a, operand_t b,
+    operand_t dst, int adjust, helper_t helper, uint8_t *ip)
+{
+    int slow[2], count = 0;
+
+    if (a.base >= 0) slow[count++] = emitNumberCheck(as, a);
+    if (b.base >= 0) slow[count++] = emitNumberCheck(as, b);
+
+    emitLoadXmm(as, 0, a);
+    emitLoadXmm(as, 1, b);
+    EMIT(as, 0xF2, 0x0F, sseop, 0xC1);                         // op xmm0, xmm1
+    emitSse(as, 0xF2, 0x11, 0, dst.base, dst.disp);            // movsd [dst], xmm0
+    emitAdjust(as, adjust);
+    int done = emitLocalJcc(as, 0);
+
+    for (int i = 0; i < count; i++) patchHere(as, slow[i]);
+    emitSlowPath(as, OK_FAIL, helper, ip, 0);
+    patchHere(as, done);
+}
+
+// Pop two numbers and jump to (target) unless the comparison holds.
+static void emitCompareJump(asm_t *as, uint8_t opcode, helper_t helper, uint8_t *ip, int target)
+{
+    int slow[2];
+
+    slow[0] = emitNumberCheck(as, STACK_AT(-2));
+    slow[1] = emitNumberCheck(as, STACK_AT(-1));
+    emitLoadXmm(as, 0, STACK_AT(-2));
+    emitLoadXmm(as, 1, STACK_AT(-1));
+    emitAdjust(as, -2);
+
+    // ucomisd sets CF/ZF like an unsigned compare and all flags on NaN,
+    // so 'b > a' reads as 'a < b'. An unordered result jumps for JLT/JLE
+    // and falls through for their negations JGE/JGT.
+    EMIT(as, 0x66, 0x0F, 0x2E, 0xC8);
+    switch (opcode) {
+        case OP_JLT: emitJcc(as, CC_BE, target); break;
+        case OP_JLE: emitJcc(as, CC_B, target); break;
+        case OP_JGT: emitJcc(as, CC_AE, target); break;
+        case OP_JGE: emitJcc(as, CC_A, target); break;
+    }
+    int done = emitLocalJcc(as, 0);
+
+    patchHere(as, slow[0]);
+    patchHere(as, slow[1]);
+    emitSlowPath(as, OK_BRANCH, helper, ip, target);
+    patchHere(as, done);
+}
+
+// The counter, limit and step are numbers once FORPREP ran, so the loop
+// step needs no type checks. The loop variable is written even when the
+// loop ends, it goes out of scope there.
+static void emitForLoop(asm_t *as, int a, int target)
+{
+    emitSse(as, 0xF2, 0x10, 0, R12, SLOT(a));         // movsd xmm0, counter
+    emitSse(as, 0xF2, 0x58, 0, R12, SLOT(a + 2));     // addsd xmm0, step
+    emitSse(as, 0xF2, 0x11, 0, R12, SLOT(a));         // movsd counter, xmm0
+    emitSse(as, 0xF2, 0x11, 0, R12, SLOT(a + 3));     // movsd variable, xmm0
+    emitSse(as, 0xF2, 0x10, 1, R12, SLOT(a + 1));     // movsd xmm1, limit
+    EMIT(as, 0x66, 0x0F, 0x57, 0xD2);                 // xorpd xmm2, xmm2
+    emitSse(as, 0x66, 0x2E, 2, R12, SLOT(a + 2));     // ucomisd xmm2, step
+    int up = emitLocalJcc(as, CC_B);
+
+    EMIT(as, 0x66, 0x0F, 0x2E, 0xC1);                 // ucomisd xmm0, xmm1
+    emitJcc(as, CC_AE, target);
+    int done = emitLocalJcc(as, 0);
+
+    patchHere(as, up);
+    EMIT(as, 0x66, 0x0F, 0x2E, 0xC8);                 // ucomisd xmm1, xmm0
+    emitJcc(as, CC_AE, target);
+    patchHere(as, done);
+}
+
+// Jump to the case of an OP_JTABLE or OP_JHASH Switch.
+// The helper returns the case, which indexes a table of 32-bit offsets
+// from the table to the code of each case.
+static void emitJumpTable(asm_t *as, switch_t *table, helper_t helper, uint8_t *ip)
+{
+    emitHelper(as, helper, ip);
+    EMIT(as, 0x89, 0xC0);                   // mov eax, eax
+    EMIT(as, 0x48, 0x8D, 0x15);             // lea rdx, [rip + table]
+    int lea = as->count;
+    emitInt32(as, 0);
+    EMIT(as, 0x48, 0x63, 0x04, 0x82);       // movsxd rax, dword [rdx + rax*4]
+    EMIT(as, 0x48, 0x01, 0xD0);             // add rax, rdx
+    EMIT(as, 0xFF, 0xE0);                   // jmp rax
+
+    patchHere(as, lea);
+    int base = as->count;
+    for (int i = 0; i <= table->caseCount; i++) emitOffset(as, table->targets[i], base);
+}
+
+// Jump to (target) if rax holds a falsey value.
+static void emitFalseyJump(asm_t *as, int target)
+{
+    static const uint64_t falsey[] = { RAW_FALSE, RAW_NULL, RAW_PTR };
+
+    EMIT(as, 0x48, 0x85, 0xC0);             // test rax, rax
+    emitJcc(as, CC_E, target);
+
+    for (int i = 0; i < 3; i++) {
+        emitMovImm(as, RDX, falsey[i]);
+        EMIT(as, 0x48, 0x39, 0xD0);         // cmp rax, rdx
+        emitJcc(as, CC_E, target);
+    }
+}
+
+static uint8_t sseOp(uint8_t opcode)
+{
+    switch (opcode) {
+        case OP_ADD: case OP_ADD_NN: case OP_ADDK: case OP_LD_LD_ADD:
+        case OP_ADDR: case OP_ADDRK:
+            return 0x58;
+        case OP_SUB: case OP_SUB_NN: case OP_SUBK: case OP_SUBR: case OP_SUBRK:
+            return 0x5C;
+        case OP_MUL: case OP_MUL_NN: case OP_MULR: case OP_MULRK:
+            return 0x59;
+        default:
+            return 0x5E;
+    }
+}
+
+// Emit the common opcodes inline, returns false to use the helper.
+static bool emitInline(asm_t *as, chunk_t *chunk, uint8_t opcode, uint8_t *ip, int target)
+{
+    val_t *consts = chunk->constants.values;
+    helper_t helper = opTable[opcode].helper;
+
+    switch (opcode) {
+        case OP_POP:
+            emitAdjust(as, -1);
+            return true;
+        case OP_DROP:
+            // The adjustment is an 8-bit displacement.
+            if (SLOT(ip[0]) > INT8_MAX) return false;
+            emitMem(as, 0x8B, RAX, R13, SLOT(-1));
+            emitMem(as, 0x89, RAX, R13, SLOT(-1 - ip[0]));
+            emitAdjust(as, -ip[0]);
+            return true;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_CONST: {
+            val_t value = opcode == OP_NIL ? VAL_NULL : opcode == OP_TRUE ? VAL_TRUE :
+                opcode == OP_FALSE ? VAL_FALSE : consts[ip[0]];
+            emitMovImm(as, RAX, AS_RAW(value));
+            emitPush(as);
+            return true;
+        }
+        case OP_LD:
+            emitMem(as, 0x8B, RAX, R12, SLOT(ip[0]));
+            emitPush(as);
+            return true;
+        case OP_ST:
+            emitMem(as, 0x8B, RAX, R13, SLOT(-1));
+            emitMem(as, 0x89, RAX, R12, SLOT(ip[0]));
+            return true;
+        case OP_MOVE:
+            emitMem(as, 0x8B, RAX, R12, SLOT(ip[1]));
+            emitMem(as, 0x89, RAX, R12, SLOT(ip[0]));
+            return true;
+        case OP_LOADK:
+            emitMovImm(as, RAX, AS_RAW(consts[ip[1]]));
+            emitMem(as, 0x89, RAX, R12, SLOT(ip[0]));
+            return true;
+        case OP_GLD: {
+            emitMem(as, 0x8B, RAX, RBX, (int32_t)offsetof(vm_t, globalValues));
+            emitMem(as, 0x8B, RAX, RAX, (int32_t)offsetof(arr_t, values));
+            emitMem(as, 0x8B, RAX, RAX, SLOT(ip[0]));
+            emitMovImm(as, RDX, RAW_UNDEF);
+            EMIT(as, 0x48, 0x39, 0xD0);     // cmp rax, rdx
+            int slow = emitLocalJcc(as, CC_E);
+            emitPush(as);
+            int done = emitLocalJcc(as, 0);
+            patchHere(as, slow);
+            emitSlowPath(as, OK_FAIL, helper, ip, 0);
+            patchHere(as, done);
+            return true;
+        }
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+        case OP_ADD_NN: case OP_SUB_NN: case OP_MUL_NN: case OP_DIV_NN:
+            emitArith(as, sseOp(opcode), STACK_AT(-2), STACK_AT(-1), STACK_AT(-2), -1, helper, ip);
+            return true;
+        case OP_ADDK:
+        case OP_SUBK:
+            if (!IS_NUM(consts[ip[0]])) return false;
+            emitArith(as, sseOp(opcode), STACK_AT(-1), NUMBER(consts[ip[0]]), STACK_AT(-1), 0, helper, ip);
+            return true;
+        case OP_LD_LD_ADD:
+            emitArith(as, sseOp(opcode), LOCAL(ip[0]), LOCAL(ip[1]), STACK_AT(0), 1, helper, ip);
+            return true;
+        case OP_ADDR: case OP_SUBR: case OP_MULR: case OP_DIVR:
+            emitArith(as, sseOp(opcode), LOCAL(ip[1]), LOCAL(ip[2]), LOCAL(ip[0]), 0, helper, ip);
+            return true;
+        case OP_ADDRK: case OP_SUBRK: case OP_MULRK: case OP_DIVRK:
+            if (!IS_NUM(consts[ip[2]])) return false;
+            emitArith(as, sseOp(opcode), LOCAL(ip[1]), NUMBER(consts[ip[2]]), LOCAL(ip[0]), 0, helper, ip);
+            return true;
+        case OP_JLT: case OP_JLE: case OP_JGT: case OP_JGE:
+            emitCompareJump(as, opcode, helper, ip, target);
+            return true;
+        case OP_JMPF_POP:
+            emitMem(as, 0x8B, RAX, R13, SLOT(-1));
+            emitAdjust(as, -1);
+            emitFalseyJump(as, target);
+            return true;
+        case OP_JMPF:
+            emitMem(as, 0x8B, RAX, R13, SLOT(-1));
+            emitFalseyJump(as, target);
+            return true;
+        case OP_FORLOOP: case OP_FORLOOP_W:
+            emitForLoop(as, ip[0], target);
+            return true;
+        case OP_LOOP: case OP_LOOP_W:
+            emitMovImm(as, RAX, (uint64_t)(uintptr_t)&chunk->loops[SHORT(ip)]);
+            EMIT(as, 0x48, 0x83, 0x00, 0x01);       // add qword [rax], 1
+            EMIT(as, 0xE9);                         // jmp target
+            emitRel32(as, target);
+            return true;
+    }
+
+    return false;
+}
+
+static bool translate(asm_t *as, chunk_t *chunk)
+{
+    emitPrologue(as);
+
+    for (int offset = 0; offset < chunk->count; ) {
+        uint8_t *ip = &chunk->code[offset];
+        uint8_t opcode = *ip++;
+
+        if (opcode >= MAX_OPCODES || opTable[opcode].kind == OK_NONE) return false;
+
+        int length = opcode_length(opcode);
+        int target = offset + length;
+        if (opcode == OP_JMP_W) {
+            target += LONG(ip);
+        }
+        else if (opcode == OP_FORPREP) {
+            target += SHORT(ip + 1);
+        }
+        else if (opcode == OP_FORPREP_W) {
+            target += LONG(ip + 1);
+        }
+        else if (opcode == OP_FORLOOP) {
+            target -= SHORT(ip + 1);
+        }
+        else if (opcode == OP_FORLOOP_W) {
+            target -= LONG(ip + 1);
+        }
+        else if (opcode == OP_LOOP) {
+            target -= SHORT(ip + 2);
+        }
+        else if (opcode == OP_LOOP_W) {
+            target -= LONG(ip + 2);
+        }
+        else if (opTable[opcode].kind == OK_BRANCH || opTable[opcode].kind == OK_JUMP) {
+            target += SHORT(ip);
+        }
+        as->labels[offset] = as->count;
+        offset += length;
+
+        if (emitInline(as, chunk, opcode, ip, target)) continue;
+
+        switch (opTable[opcode].kind) {
+            case OK_PLAIN:
+            case OK_FAIL:
+            case OK_BRANCH:
+                emitSlowPath(as, opTable[opcode].kind, opTable[opcode].helper, ip, target);
+                break;
+            case OK_CALL:
+                // r12 is kept as an offset into the stack over the call.
+                emitMem(as, 0x2B, R12, RBX, STACK_OFFSET);  // sub r12, [rbx + stack]
+                emitSlowPath(as, OK_FAIL, opTable[opcode].helper, ip, target);
+                emitMem(as, 0x03, R12, RBX, STACK_OFFSET);  // add r12, [rbx + stack]
+                break;
+            case OK_JUMP:
+                EMIT(as, 0xE9);                     // jmp target
+                emitRel32(as, target);
+                break;
+            case OK_TABLE:
+                emitJumpTable(as, &chunk->switches[SHORT(ip + 1)], opTable[opcode].helper, ip);
+                break;
+            case OK_TAIL: {
+                emitHelper(as, opTable[opcode].helper, ip);
+                EMIT(as, 0x85, 0xC0);               // test eax, eax
+                emitJcc(as, CC_S, ERROR_LABEL);
+                int done = emitLocalJcc(as, CC_E);
+                EMIT(as, 0xB8, TAIL_CALLED, 0, 0, 0); // mov eax, TAIL_CALLED
+                emitEpilogue(as);
+                patchHere(as, done);
+                break;
+            }
+            case OK_RET:
+                emitHelper(as, opTable[opcode].helper, ip);
+                EMIT(as, 0x31, 0xC0);               // xor eax, eax
+                emitEpilogue(as);
+                break;
+        }
+    }
+
+    int error = as->count;
+    as->labels[chunk->count] = error;
+    EMIT(as, 0xB8, VM_RUNTIME_ERROR, 0, 0, 0);      // mov eax, VM_RUNTIME_ERROR
+    emitEpilogue(as);
+
+    for (int i = 0; i < as->fixupCount; i++) {
+        fixup_t *fixup = &as->fixups[i];
+        int label = fixup->target == ERROR_LABEL ? error : as->labels[fixup->target];
+        int32_t rel = label - fixup->base;
+        memcpy(as->code + fixup->at, &rel, sizeof(rel));
+    }
+
+    return true;
+}
+
+static void *allocExec(const uint8_t *code, size_t size)
+{
+#ifdef _WIN32
+    void *mem = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    DWORD old;
+
+    if (mem == NULL) return NULL;
+    memcpy(mem, code, size);
+    if (!VirtualProtect(mem, size, PAGE_EXECUTE_READ, &old)) {
+        VirtualFree(mem, 0, MEM_RELEASE);
+        return NULL;
+    }
+#else
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mem == MAP_FAILED) return NULL;
+    memcpy(mem, code, size);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        return NULL;
+    }
+#endif
+    return mem;
+}
+
+bool jit_compile(vm_t *vm, fun_t *function)
+{
+    chunk_t *chunk = &function->chunk;
+    asm_t as;
+
+    memset(&as, '\0', sizeof(as));
+    as.labels = malloc((chunk->count + 1) * sizeof(int));
+
+    bool ok = translate(&as, chunk);
+    if (ok) {
+        function->jit = allocExec(as.code, as.count);
+        function->jitSize = as.count;
+        ok = function->jit != NULL;
+    }
+
+    free(as.code);
+    free(as.labels);
+    free(as.fixups);
+    return ok;
+}
+
+int jit_enter(vm_t *vm)
+{
+    for (;;) {
+        frame_t *frame = FRAME();
+        int (*native)(vm_t *, val_t *) = (int (*)(vm_t *, val_t *))frame->function->jit;
+        int result = native(vm, frame->slots);
+
+        // The callee of a tail call starts over in the same frame.
+        if (result != TAIL_CALLED) return result;
+        if (FRAME()->function->jit == NULL) return vm_execute(vm);
+    }
+}
+
+void jit_free(fun_t *function)
+{
+    if (function->jit == NULL) return;
+
+#ifdef _WIN32
+    VirtualFree(function->jit, 0, MEM_RELEASE);
+#else
+    munmap(function->jit, function->jitSize);
+#endif
+    function->jit = NULL;
+}
+
+#endif
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+
+#ifdef JIT
+
+// Compile (function) to native x86-64 code. Returns false and leaves the
+// function to the interpreter if it uses an opcode the JIT can not handle.
+bool jit_compile(vm_t *vm, fun_t *function);
+
+// Run the compiled function in the frame on top of the VM stack. Returns
+// when that frame returns, the result is left on the stack as after RET.
+int jit_enter(vm_t *vm);
+
+void jit_free(fun_t *function);
+
+#endif
@@ -183,7 +183,9 @@ static toktype_t identifierType(lexer_t *L)
             if (LENGTH() > 1) switch (START(1)) {
                 case 'a': return checkKeyword(L, 2, 2, "se", TOKEN_CASE);
                 case 'l': return checkKeyword(L, 2, 3, "ass", TOKEN_CLASS);
-                case 'o': return checkKeyword(L, 2, 3, "nst", TOKEN_CONST);
+                case 'o':
+                    if (LENGTH() == 12) return checkKeyword(L, 2, 10, "ntinueloop", TOKEN_CONTINUELOOP);
+                    return checkKeyword(L, 2, 3, "nst", TOKEN_CONST);
             }
             break;
         case 'd':
@@ -200,11 +202,13 @@ static toktype_t identifierType(lexer_t *L)
                 case 4:
                     if (START(1) == 'l')
                         return checkKeyword(L, 1, 3, "lse", TOKEN_ELSE);
-                    else if (START(3) == 'n')
+                    else if (START(1) == 'n')
                         return checkKeyword(L, 1, 3, "num", TOKEN_ENUM);
                     break;
                 case 5:
                     return checkKeyword(L, 1, 4, "ndif", TOKEN_ENDIF);
+                case 8:
+                    return checkKeyword(L, 1, 7, "xitloop", TOKEN_EXITLOOP);
                 case 7: 
                     if (START(3) == 'f')
                         return checkKeyword(L, 1, 6, "ndfunc", TOKEN_ENDFUNC);
@@ -273,9 +277,11 @@ static toktype_t identifierType(lexer_t *L)
                     }
                     break;
                 case 'r': return checkKeyword(L, 2, 2, "ue", TOKEN_TRUE);
-                case 'o': return checkKeyword(L, 2, 2, "", TOKEN_TO);
+                case 'o': return checkKeyword(L, 2, 0, "", TOKEN_TO);
             }       
             break;
+        case 'u':
+            return checkKeyword(L, 1, 4, "ntil", TOKEN_UNTIL);
         case 'v':
             if (LENGTH() > 1) switch (START(1)) {
                 case 'a': return checkKeyword(L, 2, 1, "r", TOKEN_VAR);
@@ -5,10 +5,15 @@
 #include "vm.h"
 #include "object.h"
 
+static double absolute(double number)
+{
+    return (number < 0) ? (-number) : number;
+}
+
 static val_t math_abs(vm_t *vm, int argc, val_t *args)
 {
     double number = AS_NUM(args[0]);
-    double result = (number < 0) ? (-number) : number;
+    double result = absolute(number);
 
     return VAL_NUM(result);
 }
@@ -78,19 +83,30 @@ static val_t math_sqrt(vm_t *vm, int argc, val_t *args)
     return VAL_NUM(result);
 }
 
+// Each takes numbers only, which the VM checks before the call, and has
+// no side effects.
+static const struct {
+    const char *name;
+    native_t native;
+} functions[] = {
+    { "abs",    { math_abs,     1, 0x1, true, { .unary = absolute } } },
+    { "ceil",   { math_ceil,    1, 0x1, true, { .unary = ceil } } },
+    { "cos",    { math_cos,     1, 0x1, true, { .unary = cos } } },
+    { "floor",  { math_floor,   1, 0x1, true, { .unary = floor } } },
+    { "log",    { math_log,     1, 0x1, true, { .unary = log } } },
+    { "log10",  { math_log10,   1, 0x1, true, { .unary = log10 } } },
+    { "pow",    { math_pow,     2, 0x3, true, { .binary = pow } } },
+    { "sin",    { math_sin,     1, 0x1, true, { .unary = sin } } },
+    { "sqrt",   { math_sqrt,    1, 0x1, true, { .unary = sqrt } } },
+};
+
 void load_libmath(vm_t *vm)
 {
     map_t *math = map_new(vm);
 
-    map_set(vm, math, "abs", VAL_CFN(math_abs));
-    map_set(vm, math, "ceil", VAL_CFN(math_ceil));
-    map_set(vm, math, "cos", VAL_CFN(math_cos));
-    map_set(vm, math, "floor", VAL_CFN(math_floor));
-    map_set(vm, math, "log", VAL_CFN(math_log));
-    map_set(vm, math, "log10", VAL_CFN(math_log10));
-    map_set(vm, math, "pow", VAL_CFN(math_pow));
-    map_set(vm, math, "sin", VAL_CFN(math_sin));
-    map_set(vm, math, "sqrt", VAL_CFN(math_sqrt));
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        map_set(vm, math, functions[i].name, VAL_CFN(&functions[i].native));
+    }
 
     set_global(vm, "math", VAL_OBJ(math));
 }
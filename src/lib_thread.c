@@ -141,22 +141,34 @@ static val_t thread_close(vm_t *vm, int argc, val_t *args)
 #else
 #endif
 
+    hash_free(&thread->vm->stores);
+    free(thread->vm->stack);
+    free(thread->vm->frames);
     free(thread->vm);
     free(thread);
     return VAL_NULL;
 }
 
+static const struct {
+    const char *name;
+    native_t native;
+} functions[] = {
+    { "sleep",  { thread_sleep,     1, 0x1 } },
+    { "create", { thread_create,    1 } },
+    { "exit",   { thread_exit,      -1 } },
+    { "start",  { thread_start,     -1 } },
+    { "join",   { thread_join,      1 } },
+    { "cancel", { thread_cancel,    1 } },
+    { "close",  { thread_close,     1 } },
+};
+
 void load_libthread(vm_t *vm)
 {
     map_t *thread = map_new(vm);
 
-    map_set(vm, thread, "sleep", VAL_CFN(thread_sleep));
-    map_set(vm, thread, "create", VAL_CFN(thread_create));
-    map_set(vm, thread, "exit", VAL_CFN(thread_exit));
-    map_set(vm, thread, "start", VAL_CFN(thread_start));
-    map_set(vm, thread, "join", VAL_CFN(thread_join));
-    map_set(vm, thread, "cancel", VAL_CFN(thread_cancel));
-    map_set(vm, thread, "close", VAL_CFN(thread_close));
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        map_set(vm, thread, functions[i].name, VAL_CFN(&functions[i].native));
+    }
 
     set_global(vm, "thread", VAL_OBJ(thread));
 }
@@ -1,12 +1,14 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "vm.h"
 #include "libs.h"
+#include "emit.h"
 
 int main(int argc, char **argv)
 {
     if (argc < 2) {
-        printf("usage: au3 [file]\n");
+        printf("usage: au3 [--emit-c] [file]\n");
         return 0;
     }
 
@@ -16,7 +18,12 @@ int main(int argc, char **argv)
     if (vm != NULL) {
         load_libmath(vm);
         load_libthread(vm);
-        ret = vm_dofile(vm, argv[argc - 1]);
+        if (argc > 2 && strcmp(argv[1], "--emit-c") == 0) {
+            ret = emit_file(vm, argv[argc - 1], stdout);
+        }
+        else {
+            ret = vm_dofile(vm, argv[argc - 1]);
+        }
         vm_close(vm);
     }
 
@@ -6,6 +6,7 @@
 #include "object.h"
 #include "vm.h"
 #include "gc.h"
+#include "jit.h"
 
 #define ALLOC(gc, size) \
     gc_realloc(gc, NULL, 0, size)
@@ -71,27 +72,150 @@ fun_t *fun_new(vm_t *vm, src_t *source)
     fun_t *function = ALLOC_OBJ(vm->gc, fun_t, OT_FUN);
 
     function->arity = 0;
+    function->upvalueCount = 0;
+    function->upvalues = NULL;
+    function->captures = NULL;
+    function->proto = NULL;
+    function->outer = NULL;
     function->name = NULL;
+    function->calls = 0;
+    function->jit = NULL;
+    function->jitSize = 0;
+    function->body = -1;
+    function->bodyLine = 0;
+    function->bodyConsts = 0;
     chunk_init(&function->chunk, source);
     return function;
 }
 
+// A closure shares the code of its prototype and owns only the array
+// of upvalues, which the caller fills in.
+fun_t *fun_closure(vm_t *vm, fun_t *proto)
+{
+    fun_t *closure = ALLOC_OBJ(vm->gc, fun_t, OT_FUN);
+    obj_t header = closure->obj;
+
+    *closure = *proto;
+    closure->obj = header;
+    closure->upvalues = calloc(proto->upvalueCount, sizeof(upv_t *));
+    closure->captures = NULL;
+    closure->proto = proto;
+    return closure;
+}
+
+upv_t *upv_new(vm_t *vm, val_t *location)
+{
+    upv_t *upvalue = ALLOC_OBJ(vm->gc, upv_t, OT_UPV);
+
+    upvalue->next = NULL;
+    upvalue->location = location;
+    upvalue->closed = VAL_NULL;
+    return upvalue;
+}
+
+shp_t *shp_new(vm_t *vm, shp_t *parent, str_t *key)
+{
+    shp_t *shape = ALLOC_OBJ(vm->gc, shp_t, OT_SHP);
+
+    shape->parent = parent;
+    shape->key = key;
+    shape->count = parent == NULL ? 0 : parent->count + 1;
+    tab_init(&shape->transitions);
+    return shape;
+}
+
+int shp_slot(shp_t *shape, str_t *key)
+{
+    for (; shape->key != NULL; shape = shape->parent) {
+        if (shape->key == key) return shape->count - 1;
+    }
+
+    return -1;
+}
+
+static shp_t *shapeAdd(vm_t *vm, shp_t *shape, str_t *key)
+{
+    val_t next;
+    if (tab_get(&shape->transitions, key, &next)) {
+        return (shp_t *)AS_OBJ(next);
+    }
+
+    shp_t *child = shp_new(vm, shape, key);
+    tab_set(&shape->transitions, key, VAL_OBJ(child));
+    return child;
+}
+
+static void mapToDictionary(map_t *map)
+{
+    for (shp_t *shape = map->shape; shape->key != NULL; shape = shape->parent) {
+        tab_set(&map->table, shape->key, map->fields[shape->count - 1]);
+    }
+
+    free(map->fields);
+    map->fields = NULL;
+    map->capacity = 0;
+    map->shape = NULL;
+}
+
 map_t *map_new(vm_t *vm)
 {
     map_t *map = ALLOC_OBJ(vm->gc, map_t, OT_MAP);
 
     hash_init(&map->hash);
     tab_init(&map->table);
+    map->shape = vm->emptyShape;
+    map->fields = NULL;
+    map->capacity = 0;
     return map;
 }
 
+bool map_get(map_t *map, str_t *key, val_t *value)
+{
+    if (map->shape == NULL) {
+        return tab_get(&map->table, key, value);
+    }
+
+    int slot = shp_slot(map->shape, key);
+    if (slot < 0) return false;
+
+    *value = map->fields[slot];
+    return true;
+}
+
+void map_put(vm_t *vm, map_t *map, str_t *key, val_t value)
+{
+    if (map->shape != NULL) {
+        int slot = shp_slot(map->shape, key);
+        if (slot >= 0) {
+            map->fields[slot] = value;
+            return;
+        }
+
+        if (map->shape->count < SHAPE_MAX_FIELDS) {
+            shp_t *shape = shapeAdd(vm, map->shape, key);
+            if (shape->count > map->capacity) {
+                map->capacity = GROW_CAP(map->capacity);
+                map->fields = realloc(map->fields, map->capacity * sizeof(val_t));
+            }
+
+            map->fields[shape->count - 1] = value;
+            map->shape = shape;
+            return;
+        }
+
+        mapToDictionary(map);
+    }
+
+    tab_set(&map->table, key, value);
+}
+
 void map_set(vm_t *vm, map_t *map, const char *key, val_t value)
 {
     str_t *field = str_copy(vm, key, (int)strlen(key), false);
 
     vm_push(vm, value);
     vm_push(vm, VAL_OBJ(field));
-    tab_set(&map->table, field, value);
+    map_put(vm, map, field, value);
 
     vm_pop(vm);
     vm_pop(vm);
@@ -145,16 +269,33 @@ void obj_free(gc_t *gc, obj_t *object)
         }
         case OT_FUN: {
             fun_t *function = (fun_t *)object;
-            chunk_free(&function->chunk);
+            free(function->upvalues);
+            if (function->proto == NULL) {
+#ifdef JIT
+                jit_free(function);
+#endif
+                chunk_free(&function->chunk);
+                free(function->captures);
+            }
             FREE(gc, fun_t, function);
             break;
         }
+        case OT_UPV:
+            FREE(gc, upv_t, object);
+            break;
         case OT_MAP: {
             map_t *map = (map_t *)object;
             hash_free(&map->hash);
             tab_free(&map->table);
+            free(map->fields);
             FREE(gc, map_t, map);
             break;
         }
+        case OT_SHP: {
+            shp_t *shape = (shp_t *)object;
+            tab_free(&shape->transitions);
+            FREE(gc, shp_t, shape);
+            break;
+        }
     }
 }
@@ -29,15 +29,42 @@ struct _fun {
     obj_t obj;
     int arity;
     int upvalueCount;
-    upv_t **upvalues;
+    upv_t **upvalues;       // of a closure, filled by OP_CLOSURE
+    uint8_t *captures;      // of a prototype, (local, index) per upvalue
+    fun_t *proto;           // the prototype of a closure, else NULL
+    fun_t *outer;           // the function it is declared in, if any
     str_t *name;
     chunk_t chunk;
+    int calls;              // counts up to JIT_THRESHOLD
+    void *jit;              // native code, NULL until compiled
+    size_t jitSize;
+    // A stub from LAZY_COMPILE has only its arity and name until the
+    // first call compiles the body found at (body) in the source.
+    int body;               // offset of the name, -1 once compiled
+    int bodyLine;
+    int bodyConsts;         // top-level Consts declared before it
 };
 
+// A shape (hidden class) describes the string-keyed fields of a map as
+// a chain of transitions from the empty root shape. Maps that share a
+// sequence of field insertions share the same shape pointer.
+struct _shp {
+    obj_t obj;
+    shp_t *parent;
+    str_t *key;
+    int count;
+    tab_t transitions;
+};
+
+#define SHAPE_MAX_FIELDS    32
+
 struct _map {
     obj_t obj;
     hash_t hash;
-    tab_t table;
+    shp_t *shape;       // NULL once the map falls back to dictionary mode
+    val_t *fields;
+    int capacity;
+    tab_t table;        // string keys in dictionary mode
 };
 
 #define AS_STR(v)       ((str_t *)AS_OBJ(v))
@@ -51,6 +78,11 @@ static inline bool obj_is(val_t value, otype_t type) {
     return IS_OBJ(value) && OBJ_TYPE(value) == type;
 }
 
+// The function whose code (function) runs: its prototype, for a closure.
+static inline fun_t *fun_code(fun_t *function) {
+    return function->proto != NULL ? function->proto : function;
+}
+
 #define IS_STR(v)       (obj_is(v, OT_STR))
 #define IS_FUN(v)       (obj_is(v, OT_FUN))
 #define IS_MAP(v)       (obj_is(v, OT_MAP))
@@ -59,8 +91,15 @@ str_t *str_take(vm_t *vm, char *chars, int length);
 str_t *str_copy(vm_t *vm, const char *chars, int length, bool ignorecase);
 
 fun_t *fun_new(vm_t *vm, src_t *source);
+fun_t *fun_closure(vm_t *vm, fun_t *proto);
+upv_t *upv_new(vm_t *vm, val_t *location);
+
+shp_t *shp_new(vm_t *vm, shp_t *parent, str_t *key);
+int shp_slot(shp_t *shape, str_t *key);
 
 map_t *map_new(vm_t *vm);
+bool map_get(map_t *map, str_t *key, val_t *value);
+void map_put(vm_t *vm, map_t *map, str_t *key, val_t value);
 void map_set(vm_t *vm, map_t *map, const char *key, val_t value);
 
 const char *obj_typeof(obj_t *object);
@@ -4,7 +4,9 @@
 #include <string.h>
 
 #include "code.h"
+#include "include.h"
 #include "object.h"
+#include "vm.h"
 
 typedef struct _parser   parser_t;
 typedef struct _compiler compiler_t;
@@ -14,6 +16,12 @@ struct _parser {
     chunk_t *compilingChunk;
     lexer_t *lexer;
     src_t *source;
+    graph_t *graph;
+    unit_t *unit;           // file being compiled, NULL for a lazy body
+    int includes;           // '#include "file"' lines met so far
+    bool shared;            // other units are compiled at the same time
+    bool inlining;          // calls may be inlined, see INLINE_CALLS
+    int nesting;            // compiles for inlining around this one
     compiler_t *compiler;
     tok_t current;
     tok_t previous;
@@ -49,13 +57,48 @@ typedef struct {
 typedef struct {
     tok_t name;
     int depth;
+    int map;            // slot of the map a hoisted field was read from, else -1
+    bool captured;      // an escaping closure holds it as an upvalue
 } local_t;
 
+// Where a closure finds one of its upvalues when it is made: a local of
+// the enclosing function or an upvalue of the enclosing closure.
+typedef struct {
+    uint8_t index;
+    bool isLocal;
+} upvalue_t;
+
+// A Const or Enum name. Uses are replaced by (value) when it was known
+// at compile time; the variable itself is still defined for code that
+// was compiled before the declaration.
+typedef struct {
+    tok_t name;
+    val_t value;
+    bool known;
+    int depth;
+    int local;          // slot of the variable, -1 for a global
+} const_t;
+
 typedef enum {
     TYPE_FUNCTION,
     TYPE_SCRIPT
 } funtype_t;
 
+// An enclosing loop, for ExitLoop and ContinueLoop. Their jumps are
+// patched when the loop is finished.
+typedef struct _loop {
+    struct _loop *enclosing;
+    int start;          // header ContinueLoop jumps back to, -1 to jump forward
+    int counter;        // hotness counter of the header, see OP_LOOP
+    int localCount;     // locals live when the body starts
+    int exits[UINT8_COUNT];
+    int exitCount;
+    int continues[UINT8_COUNT];
+    int continueCount;
+} loop_t;
+
+#define OP_HISTORY  4
+
 struct _compiler
 {
     compiler_t *enclosing;
@@ -63,7 +106,17 @@ struct _compiler
     funtype_t type;
     local_t locals[UINT8_COUNT];
     int localCount;
+    const_t consts[UINT8_COUNT];
+    int constCount;
     int scopeDepth;
+    loop_t *loop;           // innermost loop being compiled
+    upvalue_t upvalues[UINT8_COUNT];
+    int upvalueCount;
+    bool escapes;           // may be called once the enclosing body returned
+    bool framed;            // functions declared in it read its frame in place
+    hash_t constIndex;      // constant value -> index in the chunk
+    int ops[OP_HISTORY];    // offsets of the most recent instructions
+    int lastTarget;         // highest offset a jump lands on
 };
 
 static chunk_t *currentChunk(parser_t *parser)
@@ -71,10 +124,43 @@ static chunk_t *currentChunk(parser_t *parser)
     return &parser->compiler->function->chunk;
 }
 
+// Units compiled in parallel share the VM: its heap, string table and
+// global slots are only touched under the include lock.
+static void lockVm(parser_t *parser)
+{
+    if (parser->shared) include_lock();
+}
+
+static void unlockVm(parser_t *parser)
+{
+    if (parser->shared) include_unlock();
+}
+
+static str_t *copyString(parser_t *parser, const char *chars, int length, bool ignorecase)
+{
+    lockVm(parser);
+    str_t *string = str_copy(parser->vm, chars, length, ignorecase);
+    unlockVm(parser);
+    return string;
+}
+
+static fun_t *newFunction(parser_t *parser)
+{
+    lockVm(parser);
+    fun_t *function = fun_new(parser->vm, parser->source);
+    unlockVm(parser);
+    return function;
+}
+
 static void errorAt(parser_t *parser, tok_t *token, const char *message)
 {
     if (parser->panicMode) return;
     parser->panicMode = true;
+    parser->hadError = true;
+
+    // A body compiled to be inlined leaves its errors to its first call.
+    if (parser->nesting > 0) return;
+    lockVm(parser);
 
     int length = token->start - token->currentLine + token->length;
     const char *line = token->currentLine;
@@ -98,7 +184,7 @@ static void errorAt(parser_t *parser, tok_t *token, const char *message)
 
     fprintf(stderr, "\n");
     fflush(stderr);
-    parser->hadError = true;
+    unlockVm(parser);
 }
 
 static void error(parser_t *parser, const char *message)
@@ -144,11 +230,6 @@ static void consumes(parser_t *parser, toktype_t type1, toktype_t type2, const c
     errorAtCurrent(parser, message);
 }
 
-static bool checkPrev(parser_t *parser, toktype_t type)
-{
-    return parser->previous.type == type;
-}
-
 static bool check(parser_t *parser, toktype_t type)
 {
     return parser->current.type == type;
@@ -167,10 +248,82 @@ static void emitByte(parser_t *parser, uint8_t byte)
         parser->previous.line, parser->previous.column);
 }
 
-static void emitBytes(parser_t *parser, uint8_t byte1, uint8_t byte2)
+static void emitOp(parser_t *parser, uint8_t op)
+{
+    compiler_t *current = parser->compiler;
+
+    memmove(&current->ops[1], &current->ops[0], (OP_HISTORY - 1) * sizeof(int));
+    current->ops[0] = currentChunk(parser)->count;
+    emitByte(parser, op);
+}
+
+static void emitBytes(parser_t *parser, uint8_t op, uint8_t byte)
+{
+    emitOp(parser, op);
+    emitByte(parser, byte);
+}
+
+static void emitShort(parser_t *parser, uint16_t value)
+{
+    emitByte(parser, (value >> 8) & 0xff);
+    emitByte(parser, value & 0xff);
+}
+
+// Offset of the (n)th most recent instruction, or -1 if it is unknown or
+// a jump lands after its start, in which case it must not be fused with
+// anything that follows it.
+static int recentOp(parser_t *parser, int n)
+{
+    compiler_t *current = parser->compiler;
+    int offset = current->ops[n];
+
+    if (offset < 0 || offset < current->lastTarget) return -1;
+    return offset;
+}
+
+static uint8_t recentCode(parser_t *parser, int n)
+{
+    int offset = recentOp(parser, n);
+    return offset < 0 ? MAX_OPCODES : currentChunk(parser)->code[offset];
+}
+
+// Remove the last (n) instructions so a fused form can replace them.
+static void dropOps(parser_t *parser, int n)
+{
+    compiler_t *current = parser->compiler;
+
+    currentChunk(parser)->count = current->ops[n - 1];
+    memmove(&current->ops[0], &current->ops[n], (OP_HISTORY - n) * sizeof(int));
+    for (int i = OP_HISTORY - n; i < OP_HISTORY; i++) current->ops[i] = -1;
+}
+
+// Throw away the code emitted since (mark), the start of a statement or
+// operand that is known never to run.
+static void discardCode(parser_t *parser, int mark)
 {
-    emitByte(parser, byte1);
-    emitByte(parser, byte2);
+    compiler_t *current = parser->compiler;
+    int n = 0;
+
+    while (n < OP_HISTORY && current->ops[n] >= mark) n++;
+    memmove(&current->ops[0], &current->ops[n], (OP_HISTORY - n) * sizeof(int));
+    for (int i = OP_HISTORY - n; i < OP_HISTORY; i++) current->ops[i] = -1;
+
+    currentChunk(parser)->count = mark;
+    if (current->lastTarget > mark) current->lastTarget = mark;
+
+    // Forget far jumps in the code thrown away.
+    chunk_t *chunk = currentChunk(parser);
+    int kept = 0;
+    for (int i = 0; i < chunk->farCount; i++) {
+        if (chunk->farJumps[i].from < mark) chunk->farJumps[kept++] = chunk->farJumps[i];
+    }
+    chunk->farCount = kept;
+
+    // Forget ExitLoop and ContinueLoop jumps that were thrown away.
+    for (loop_t *loop = current->loop; loop != NULL; loop = loop->enclosing) {
+        while (loop->exitCount > 0 && loop->exits[loop->exitCount - 1] >= mark) loop->exitCount--;
+        while (loop->continueCount > 0 && loop->continues[loop->continueCount - 1] >= mark) loop->continueCount--;
+    }
 }
 
 static void emitNBytes(parser_t *parser, void *bytes, size_t size)
@@ -183,51 +336,261 @@ static void emitNBytes(parser_t *parser, void *bytes, size_t size)
 
 static int emitJump(parser_t *parser, uint8_t instruction)
 {
-    emitByte(parser, instruction);
-    emitBytes(parser, 0, 0);
+    emitOp(parser, instruction);
+    emitShort(parser, 0);
     return currentChunk(parser)->count - 2;
 }
 
+// Jump back to a loop header at (start), counting the pass in (counter).
+static void emitLoop(parser_t *parser, int start, int counter)
+{
+    emitOp(parser, OP_LOOP);
+    emitShort(parser, (uint16_t)counter);
+
+    // Too far for the operand, the jump is re-encoded as LOOP_W when the
+    // function is finished.
+    int jump = currentChunk(parser)->count + 2 - start;
+    if (jump > UINT16_MAX) {
+        chunk_farjump(currentChunk(parser), currentChunk(parser)->count - 3, start);
+        jump = 0;
+    }
+    emitShort(parser, (uint16_t)jump);
+}
+
 static void emitReturn(parser_t *parser)
 {
-    emitByte(parser, OP_NIL);
-    emitByte(parser, OP_RET);
+    emitOp(parser, OP_NIL);
+    emitOp(parser, OP_RET);
 }
 
-static uint8_t makeConstant(parser_t *parser, val_t value)
+// Key of (value) in the constant index. The bits are mixed since the
+// index buckets by the low bits, which are zero for most doubles. Keys
+// may collide, a hit is only reused if the constant is really equal.
+static int makeConstant(parser_t *parser, val_t value)
 {
-    int constant = arr_add(&currentChunk(parser)->constants, value, false);
-    if (constant > UINT8_MAX) {
+    arr_t *constants = &currentChunk(parser)->constants;
+    hash_t *index = &parser->compiler->constIndex;
+    uint64_t key = hash_value(value);
+    val_t found;
+
+    if (hash_get(index, key, &found)) {
+        val_t constant = constants->values[AS_INT(found)];
+        if (AS_TYPE(constant) == AS_TYPE(value) && val_equal(constant, value)) {
+            return AS_INT(found);
+        }
+    }
+
+    int constant = arr_add(constants, value, true);
+    if (constant > UINT16_MAX) {
         error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    hash_set(index, key, VAL_NUM(constant));
+    return constant;
 }
 
+// Emit (op) with a byte operand, or its wide form with a 16-bit one.
 static void emitSmart(parser_t *parser, uint8_t op, int arg)
 {
-    emitBytes(parser, op, (uint8_t)arg);
+    if (arg <= UINT8_MAX) {
+        emitBytes(parser, op, (uint8_t)arg);
+        return;
+    }
+
+    switch (op) {
+        case OP_CONST:  op = OP_CONST_W; break;
+        case OP_DEF:    op = OP_DEF_W; break;
+        case OP_GLD:    op = OP_GLD_W; break;
+        case OP_GST:    op = OP_GST_W; break;
+    }
+
+    emitOp(parser, op);
+    emitShort(parser, (uint16_t)arg);
 }
 
 static void emitConstant(parser_t *parser, val_t value)
 {
-    uint8_t constant = makeConstant(parser, value);
+    int constant = makeConstant(parser, value);
     emitSmart(parser, OP_CONST, constant);
 }
 
+static void emitValue(parser_t *parser, val_t value)
+{
+    if (IS_NULL(value)) emitOp(parser, OP_NIL);
+    else if (IS_BOOL(value)) emitOp(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else emitConstant(parser, value);
+}
+
+// The value pushed by the instruction at (offset) if it is a constant.
+static bool constantAt(parser_t *parser, int offset, val_t *value)
+{
+    chunk_t *chunk = currentChunk(parser);
+
+    if (offset < 0) return false;
+
+    switch (chunk->code[offset]) {
+        case OP_NIL:    *value = VAL_NULL; return true;
+        case OP_TRUE:   *value = VAL_TRUE; return true;
+        case OP_FALSE:  *value = VAL_FALSE; return true;
+        case OP_CONST:  *value = chunk->constants.values[chunk->code[offset + 1]]; return true;
+        case OP_CONST_W:
+            *value = chunk->constants.values[chunk->code[offset + 1] << 8 | chunk->code[offset + 2]];
+            return true;
+        default:        return false;
+    }
+}
+
+// Whether the expression compiled from (start) is a single constant.
+static bool constantExpr(parser_t *parser, int start, val_t *value)
+{
+    return recentOp(parser, 0) == start && constantAt(parser, start, value);
+}
+
+// Evaluate (op) now if its operand is a constant. Operations that fail
+// are left to the VM so the error is reported at run time.
+static bool foldUnary(parser_t *parser, uint8_t op)
+{
+    val_t a;
+
+    if (!constantAt(parser, recentOp(parser, 0), &a)) return false;
+
+    switch (op) {
+        case OP_NOT:
+            a = VAL_BOOL(IS_FALSEY(a));
+            break;
+        case OP_NEG:
+            if (IS_NUM(a)) a = VAL_NUM(-AS_NUM(a));
+            else if (IS_BOOL(a)) a = VAL_NUM(-(char)AS_BOOL(a));
+            else return false;
+            break;
+        default:
+            return false;
+    }
+
+    dropOps(parser, 1);
+    emitValue(parser, a);
+    return true;
+}
+
+// As foldUnary, for a binary (op) whose left operand ends at (lhs).
+static bool foldBinary(parser_t *parser, int lhs, uint8_t op)
+{
+    val_t a, b, result;
+    double x, y;
+
+    if (lhs < 0 || recentOp(parser, 1) != lhs ||
+        !constantAt(parser, lhs, &a) || !constantAt(parser, recentOp(parser, 0), &b)) {
+        return false;
+    }
+
+    if (op == OP_EQ) {
+        result = VAL_BOOL(val_equal(a, b));
+    }
+    else if (op == OP_ADD && IS_STR(a) && IS_STR(b)) {
+        str_t *sa = AS_STR(a), *sb = AS_STR(b);
+        int length = sa->length + sb->length;
+        char *chars = malloc(length + 1);
+
+        memcpy(chars, sa->chars, sa->length);
+        memcpy(chars + sa->length, sb->chars, sb->length);
+        chars[length] = '\0';
+        lockVm(parser);
+        result = VAL_OBJ(str_take(parser->vm, chars, length));
+        unlockVm(parser);
+    }
+    else if (val_tonums(a, b, &x, &y)) {
+        switch (op) {
+            case OP_ADD:    result = VAL_NUM(x + y); break;
+            case OP_SUB:    result = VAL_NUM(x - y); break;
+            case OP_MUL:    result = VAL_NUM(x * y); break;
+            case OP_DIV:    result = VAL_NUM(x / y); break;
+            case OP_LT:     result = VAL_BOOL(x < y); break;
+            case OP_LE:     result = VAL_BOOL(x <= y); break;
+            default:        return false;
+        }
+    }
+    else {
+        return false;
+    }
+
+    dropOps(parser, 2);
+    emitValue(parser, result);
+    return true;
+}
+
+static void emitUnary(parser_t *parser, uint8_t op)
+{
+    if (!foldUnary(parser, op)) emitOp(parser, op);
+}
+
+static void emitBinary(parser_t *parser, int lhs, uint8_t op)
+{
+    if (!foldBinary(parser, lhs, op)) emitOp(parser, op);
+}
+
 static void patchJump(parser_t *parser, int offset)
 {
     // -2 to adjust for the bytecode for the jump offset itself.
     int jump = currentChunk(parser)->count - offset - 2;
 
+    // Too far for the operand, the jump is re-encoded when the
+    // function is finished.
     if (jump > UINT16_MAX) {
-        error(parser, "Too much code to jump over.");
+        chunk_farjump(currentChunk(parser), offset - 1, currentChunk(parser)->count);
+        jump = 0;
     }
 
     currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
     currentChunk(parser)->code[offset + 1] = jump & 0xff;
+    parser->compiler->lastTarget = currentChunk(parser)->count;
+}
+
+#ifdef INLINE_CALLS
+// Count a store to the global (name). The definition of a name in the
+// top-level code of a file runs once and weighs 1, any other store may
+// run again and weighs more. A name that weighs 1 holds its value for
+// good once defined.
+static void noteStore(parser_t *parser, tok_t *name, int weight)
+{
+    uint64_t key = hash_string(name->start, name->length, true);
+    val_t stores = VAL_NUM(0);
+
+    lockVm(parser);
+    hash_get(&parser->vm->stores, key, &stores);
+    hash_set(&parser->vm->stores, key, VAL_NUM(AS_NUM(stores) + weight));
+    unlockVm(parser);
+}
+
+// Callees compiled to be inlined may compile theirs, this deep.
+#define INLINE_NESTING  4
+
+static bool lazyCompile(vm_t *vm, fun_t *function, int nesting);
+
+// The function in global (slot), if it is only ever defined under its
+// own name and compiles. A function still being compiled, as when it
+// calls itself, is not inlined.
+static fun_t *stableCallee(void *context, int slot, int argCount)
+{
+    parser_t *parser = context;
+    vm_t *vm = parser->vm;
+    val_t value = vm->globalValues->values[slot];
+    val_t found;
+
+    if (!IS_FUN(value)) return NULL;
+    fun_t *function = AS_FUN(value);
+
+    if (function->arity != argCount || function->name == NULL) return NULL;
+    if (!tab_get(vm->globals, function->name, &found) || AS_INT(found) != slot) return NULL;
+    if (!hash_get(&vm->stores, function->name->hash, &found) || AS_NUM(found) != 1) return NULL;
+
+    if (function->body >= 0) {
+        if (parser->nesting == INLINE_NESTING) return NULL;
+        if (!lazyCompile(vm, function, parser->nesting + 1)) return NULL;
+    }
+    return function->chunk.count > 0 ? function : NULL;
 }
+#endif
 
 static void initCompiler(parser_t *parser, compiler_t *compiler, funtype_t type)
 {
@@ -235,16 +598,28 @@ static void initCompiler(parser_t *parser, compiler_t *compiler, funtype_t type)
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
+    compiler->constCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = fun_new(parser->vm, parser->source);
-
-    if (type != TYPE_SCRIPT) {
-        compiler->function->name = str_copy(parser->vm, parser->previous.start,
+    compiler->loop = NULL;
+    compiler->upvalueCount = 0;
+    compiler->escapes = true;
+    compiler->framed = false;
+    compiler->lastTarget = 0;
+    hash_init(&compiler->constIndex);
+    for (int i = 0; i < OP_HISTORY; i++) compiler->ops[i] = -1;
+    if (type == TYPE_SCRIPT) {
+        compiler->function = parser->unit->function;
+    }
+    else {
+        compiler->function = newFunction(parser);
+        compiler->function->name = copyString(parser, parser->previous.start,
             parser->previous.length, true);
     }
 
     local_t *local = &compiler->locals[compiler->localCount++];
     local->depth = 0;
+    local->map = -1;
+    local->captured = false;
     local->name.start = "";
     local->name.length = 0;
 
@@ -256,6 +631,32 @@ static fun_t *endCompiler(parser_t *parser)
     emitReturn(parser);
     fun_t *function = parser->compiler->function;
 
+    hash_free(&parser->compiler->constIndex);
+
+#ifdef PEEPHOLE
+    if (!parser->hadError) {
+        peep_t saved = { 0, 0 };
+        inliner_t *inliner = NULL;
+#ifdef INLINE_CALLS
+        inliner_t calls = { stableCallee, parser, function->arity };
+        if (parser->inlining) inliner = &calls;
+#endif
+        chunk_optimize(currentChunk(parser), &saved, inliner);
+#ifdef DEBUG_PEEPHOLE
+        fprintf(stderr, "peephole: %s saved %d bytes, %d dispatches\n",
+            function->name != NULL ? function->name->chars : "<script>",
+            saved.bytes, saved.dispatches);
+#endif
+    }
+#else
+    // Jumps too far for their operand are only encoded by the pass.
+    if (!parser->hadError && currentChunk(parser)->farCount > 0) {
+        chunk_optimize(currentChunk(parser), NULL, NULL);
+    }
+#endif
+
+    chunk_finish(currentChunk(parser));
+
 #ifdef DEBUG_PRINT_CODE                      
     if (!parser->hadError) {
         //disassembleChunk(currentChunk(parser), "code");
@@ -280,9 +681,14 @@ static void endScope(parser_t *parser)
     while (current->localCount > 0 &&
         current->locals[current->localCount - 1].depth >
         current->scopeDepth) {
-        emitByte(parser, OP_POP);
+        emitOp(parser, current->locals[current->localCount - 1].captured ? OP_CLOSE : OP_POP);
         current->localCount--;
     }
+
+    while (current->constCount > 0 &&
+        current->consts[current->constCount - 1].depth > current->scopeDepth) {
+        current->constCount--;
+    }
 }
 
 static void expression(parser_t *parser);
@@ -291,12 +697,26 @@ static void declaration(parser_t *parser);
 static rule_t *getRule(toktype_t type);
 static void parsePrecedence(parser_t *parser, prec_t precedence);
 
-static uint8_t identifierConstant(parser_t *parser, tok_t *name)
+static int identifierConstant(parser_t *parser, tok_t *name)
 {
-    str_t *id = str_copy(parser->vm, name->start, name->length, true);
+    str_t *id = copyString(parser, name->start, name->length, true);
     return makeConstant(parser, VAL_OBJ(id));
 }
 
+static int globalSlot(parser_t *parser, tok_t *name)
+{
+    lockVm(parser);
+    str_t *id = str_copy(parser->vm, name->start, name->length, true);
+    int slot = vm_global(parser->vm, id);
+    unlockVm(parser);
+    if (slot > UINT16_MAX) {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+
+    return slot;
+}
+
 static bool identifiersEqual(tok_t *a, tok_t *b)
 {
     if (a->length != b->length) return false;
@@ -307,7 +727,7 @@ static int resolveLocal(parser_t *parser, compiler_t *compiler, tok_t *name)
 {
     for (int i = compiler->localCount - 1; i >= 0; i--) {
         local_t *local = &compiler->locals[i];
-        if (identifiersEqual(name, &local->name)) {
+        if (local->map < 0 && identifiersEqual(name, &local->name)) {
             if (local->depth == -1) {
                 error(parser, "Cannot read local variable in its own initializer.");
             }
@@ -318,6 +738,120 @@ static int resolveLocal(parser_t *parser, compiler_t *compiler, tok_t *name)
     return -1;
 }
 
+static int addUpvalue(parser_t *parser, compiler_t *compiler, uint8_t index, bool isLocal)
+{
+    for (int i = 0; i < compiler->upvalueCount; i++) {
+        upvalue_t *upvalue = &compiler->upvalues[i];
+        if (upvalue->index == index && upvalue->isLocal == isLocal) return i;
+    }
+
+    if (compiler->upvalueCount == UINT8_COUNT) {
+        error(parser, "Too many closure variables in function.");
+        return 0;
+    }
+
+    compiler->upvalues[compiler->upvalueCount].index = index;
+    compiler->upvalues[compiler->upvalueCount].isLocal = isLocal;
+    return compiler->upvalueCount++;
+}
+
+static int resolveUpvalue(parser_t *parser, compiler_t *compiler, tok_t *name)
+{
+    if (compiler->enclosing == NULL) return -1;
+
+    int local = resolveLocal(parser, compiler->enclosing, name);
+    if (local != -1) {
+        compiler->enclosing->locals[local].captured = true;
+        return addUpvalue(parser, compiler, (uint8_t)local, true);
+    }
+
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
+    if (upvalue != -1) return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
+    return -1;
+}
+
+// Find (name) among the locals of the functions the current one is
+// declared in. While none of the functions in between can escape, the
+// frame that holds it is still below and the slot is returned, with
+// (*level) set to how many functions out it is; those functions then
+// make no tail calls. Otherwise it is captured as an upvalue and its
+// index returned, with (*level) 0. Returns -1 if no function has it.
+static int resolveOuter(parser_t *parser, tok_t *name, int *level)
+{
+    bool direct = true;
+    int depth = 0;
+
+    for (compiler_t *compiler = parser->compiler; compiler->enclosing != NULL; compiler = compiler->enclosing) {
+        direct = direct && !compiler->escapes;
+        depth++;
+
+        int local = resolveLocal(parser, compiler->enclosing, name);
+        if (local == -1) continue;
+        if (!direct) break;
+
+        for (compiler_t *frame = parser->compiler->enclosing; frame != compiler->enclosing; frame = frame->enclosing) {
+            frame->framed = true;
+        }
+        compiler->enclosing->framed = true;
+        *level = depth;
+        return local;
+    }
+
+    *level = 0;
+    return resolveUpvalue(parser, parser->compiler, name);
+}
+
+// Find a Const visible from the current function: its own, or one
+// declared at the top level of the script.
+static const_t *resolveConstant(parser_t *parser, tok_t *name)
+{
+    for (compiler_t *compiler = parser->compiler; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->constCount - 1; i >= 0; i--) {
+            const_t *constant = &compiler->consts[i];
+            if (compiler != parser->compiler && constant->local != -1) continue;
+            if (identifiersEqual(name, &constant->name)) return constant;
+        }
+    }
+
+    return NULL;
+}
+
+// Record the variable just named by parseVariable() as a constant with
+// the value of the expression compiled from (start), if it has one.
+static void addConstant(parser_t *parser, tok_t name, int start)
+{
+    compiler_t *current = parser->compiler;
+
+    if (current->constCount == UINT8_COUNT) {
+        error(parser, "Too many constants in scope.");
+        return;
+    }
+
+    const_t *constant = &current->consts[current->constCount++];
+    constant->name = name;
+    constant->known = constantExpr(parser, start, &constant->value);
+    constant->depth = current->scopeDepth;
+    constant->local = current->scopeDepth > 0 ? current->localCount - 1 : -1;
+
+#ifdef LAZY_COMPILE
+    // Functions compiled later still see the top-level ones.
+    if (current->type == TYPE_SCRIPT && current->scopeDepth == 0) {
+        src_t *source = parser->source;
+
+        if (source->constCount == source->constCapacity) {
+            source->constCapacity = GROW_CAP(source->constCapacity);
+            source->consts = realloc(source->consts, source->constCapacity * sizeof(srcconst_t));
+        }
+
+        srcconst_t *saved = &source->consts[source->constCount++];
+        saved->start = (int)(name.start - source->buffer);
+        saved->length = name.length;
+        saved->value = constant->value;
+        saved->known = constant->known;
+    }
+#endif
+}
+
 static void addLocal(parser_t *parser, tok_t name)
 {
     compiler_t *current = parser->compiler;
@@ -330,6 +864,8 @@ static void addLocal(parser_t *parser, tok_t name)
     local_t *local = &current->locals[current->localCount++];
     local->name = name;
     local->depth = -1;
+    local->map = -1;
+    local->captured = false;
 }
 
 static void declareVariable(parser_t *parser)
@@ -354,14 +890,29 @@ static void declareVariable(parser_t *parser)
     addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(parser_t *parser, const char *errorMessage)
+static int parseVariable(parser_t *parser, const char *errorMessage)
 {
     consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable(parser);
     if (parser->compiler->scopeDepth > 0) return 0;
 
-    return identifierConstant(parser, &parser->previous);
+#ifdef INLINE_CALLS
+    noteStore(parser, &parser->previous, 1);
+#endif
+    return globalSlot(parser, &parser->previous);
+}
+
+// A Global declares a global at any depth. Within a function or a block
+// the definition may run again, and weighs like any other store.
+static int parseGlobal(parser_t *parser)
+{
+    consume(parser, TOKEN_IDENTIFIER, "Expect variable name.");
+
+#ifdef INLINE_CALLS
+    noteStore(parser, &parser->previous, parser->compiler->scopeDepth > 0 ? 2 : 1);
+#endif
+    return globalSlot(parser, &parser->previous);
 }
 
 static void markInitialized(parser_t *parser)
@@ -373,7 +924,7 @@ static void markInitialized(parser_t *parser)
         current->scopeDepth;
 }
 
-static void defineVariable(parser_t *parser, uint8_t global)
+static void defineVariable(parser_t *parser, int global)
 {
     if (parser->compiler->scopeDepth > 0) {
         markInitialized(parser);
@@ -402,18 +953,55 @@ static uint8_t argumentList(parser_t *parser)
 
 static void and_(parser_t *parser, bool canAssign)
 {
+    val_t a;
+
+    if (constantAt(parser, recentOp(parser, 0), &a)) {
+        int mark = currentChunk(parser)->count;
+
+        if (!IS_FALSEY(a)) dropOps(parser, 1);
+        parsePrecedence(parser, PREC_AND);
+        if (IS_FALSEY(a)) discardCode(parser, mark);
+        return;
+    }
+
     int endJump = emitJump(parser, OP_JMPF);
 
-    emitByte(parser, OP_POP);
+    emitOp(parser, OP_POP);
     parsePrecedence(parser, PREC_AND);
 
     patchJump(parser, endJump);
 }
 
+// Fold 'LD a, LD b, ADD' and 'x, CONST k, ADD/SUB' into one dispatch.
+static bool emitFusedArith(parser_t *parser, int lhs, toktype_t operatorType)
+{
+    chunk_t *chunk = currentChunk(parser);
+
+    if (recentCode(parser, 0) == OP_CONST) {
+        uint8_t constant = chunk->code[recentOp(parser, 0) + 1];
+        dropOps(parser, 1);
+        emitBytes(parser, operatorType == TOKEN_PLUS ? OP_ADDK : OP_SUBK, constant);
+        return true;
+    }
+
+    if (operatorType == TOKEN_PLUS && lhs >= 0 && recentOp(parser, 1) == lhs &&
+        recentCode(parser, 1) == OP_LD && recentCode(parser, 0) == OP_LD) {
+        uint8_t a = chunk->code[lhs + 1];
+        uint8_t b = chunk->code[recentOp(parser, 0) + 1];
+        dropOps(parser, 2);
+        emitBytes(parser, OP_LD_LD_ADD, a);
+        emitByte(parser, b);
+        return true;
+    }
+
+    return false;
+}
+
 static void binary(parser_t *parser, bool canAssign)
 {
     // Remember the operator.                                
     toktype_t operatorType = parser->previous.type;
+    int lhs = recentOp(parser, 0);
 
     // Compile the right operand.                            
     rule_t *rule = getRule(operatorType);
@@ -421,33 +1009,99 @@ static void binary(parser_t *parser, bool canAssign)
 
     // Emit the operator instruction.                        
     switch (operatorType) {
-        case TOKEN_EQUAL_EQUAL:   emitByte(parser, OP_EQ); break;
-        case TOKEN_LESS:          emitByte(parser, OP_LT); break;
-        case TOKEN_LESS_EQUAL:    emitByte(parser, OP_LE); break;
-
-        case TOKEN_BANG_EQUAL:    emitBytes(parser, OP_EQ, OP_NOT); break;
-        case TOKEN_GREATER:       emitBytes(parser, OP_LE, OP_NOT); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LT, OP_NOT); break;
-
-        case TOKEN_PLUS:          emitByte(parser, OP_ADD); break;
-        case TOKEN_MINUS:         emitByte(parser, OP_SUB); break;
-        case TOKEN_STAR:          emitByte(parser, OP_MUL); break;
-        case TOKEN_SLASH:         emitByte(parser, OP_DIV); break;
+        case TOKEN_EQUAL_EQUAL:   emitBinary(parser, lhs, OP_EQ); break;
+        case TOKEN_LESS:          emitBinary(parser, lhs, OP_LT); break;
+        case TOKEN_LESS_EQUAL:    emitBinary(parser, lhs, OP_LE); break;
+
+        case TOKEN_BANG_EQUAL:    emitBinary(parser, lhs, OP_EQ); emitUnary(parser, OP_NOT); break;
+        case TOKEN_GREATER:       emitBinary(parser, lhs, OP_LE); emitUnary(parser, OP_NOT); break;
+        case TOKEN_GREATER_EQUAL: emitBinary(parser, lhs, OP_LT); emitUnary(parser, OP_NOT); break;
+
+        case TOKEN_PLUS:
+        case TOKEN_MINUS: {
+            uint8_t op = operatorType == TOKEN_PLUS ? OP_ADD : OP_SUB;
+            if (!foldBinary(parser, lhs, op) && !emitFusedArith(parser, lhs, operatorType)) {
+                emitOp(parser, op);
+            }
+            break;
+        }
+        case TOKEN_STAR:          emitBinary(parser, lhs, OP_MUL); break;
+        case TOKEN_SLASH:         emitBinary(parser, lhs, OP_DIV); break;
         default:
             return; // Unreachable.                              
     }
 }
 
+#ifdef HOIST_LOADS
+static bool foldNative(parser_t *parser, int argCount);
+#endif
+
+static void emitCall(parser_t *parser, uint8_t argCount)
+{
+    int site = chunk_call(currentChunk(parser));
+    if (site > UINT16_MAX) {
+        error(parser, "Too many calls in one chunk.");
+    }
+
+    emitBytes(parser, OP_CALL, argCount);
+    emitShort(parser, (uint16_t)site);
+}
+
 static void call(parser_t *parser, bool canAssign)
 {
     uint8_t argCount = argumentList(parser);
-    emitBytes(parser, OP_CALL, argCount);
+
+#ifdef HOIST_LOADS
+    if (foldNative(parser, argCount)) return;
+#endif
+    emitCall(parser, argCount);
+}
+
+#ifdef HOIST_LOADS
+// The hidden local a loop loaded field (name) of the map in (slot) into.
+static int hoistedField(parser_t *parser, int slot, tok_t *name)
+{
+    compiler_t *current = parser->compiler;
+
+    for (int i = current->localCount - 1; i >= 0; i--) {
+        local_t *local = &current->locals[i];
+        if (local->map == slot && identifiersEqual(name, &local->name)) return i;
+    }
+
+    return -1;
 }
+#endif
 
 static void dot(parser_t *parser, bool canAssign)
 {
     consume(parser, TOKEN_IDENTIFIER, "Expect member name.");
-    uint8_t name = identifierConstant(parser, &parser->previous);
+
+#ifdef HOIST_LOADS
+    if (recentCode(parser, 0) == OP_LD && !(canAssign && check(parser, TOKEN_EQUAL))) {
+        int field = hoistedField(parser, currentChunk(parser)->code[recentOp(parser, 0) + 1], &parser->previous);
+        if (field >= 0) {
+            dropOps(parser, 1);
+            emitBytes(parser, OP_LD, (uint8_t)field);
+            return;
+        }
+    }
+#endif
+
+    int name = identifierConstant(parser, &parser->previous);
+
+    // GET/SET take a byte operand; past that the name is looked up as
+    // a string key instead.
+    if (name > UINT8_MAX) {
+        emitSmart(parser, OP_CONST, name);
+        if (canAssign && match(parser, TOKEN_EQUAL)) {
+            expression(parser);
+            emitOp(parser, OP_SETI);
+        }
+        else {
+            emitOp(parser, OP_GETI);
+        }
+        return;
+    }
 
     if (canAssign && match(parser, TOKEN_EQUAL)) {
         expression(parser);
@@ -456,6 +1110,13 @@ static void dot(parser_t *parser, bool canAssign)
     else {
         emitBytes(parser, OP_GET, (uint8_t)name);
     }
+
+    int cache = chunk_cache(currentChunk(parser));
+    if (cache > UINT16_MAX) {
+        error(parser, "Too many field accesses in one chunk.");
+    }
+
+    emitShort(parser, (uint16_t)cache);
 }
 
 static void index_(parser_t *parser, bool canAssign)
@@ -465,21 +1126,21 @@ static void index_(parser_t *parser, bool canAssign)
 
     if (canAssign && match(parser, TOKEN_EQUAL)) {
         expression(parser);
-        emitByte(parser, OP_SETI);
+        emitOp(parser, OP_SETI);
 
         parser->hadAssign = true;
     }
     else {
-        emitByte(parser, OP_GETI);
+        emitOp(parser, OP_GETI);
     }
 }
 
 static void literal(parser_t *parser, bool canAssign)
 {
     switch (parser->previous.type) {
-        case TOKEN_FALSE:   emitByte(parser, OP_FALSE); break;
-        case TOKEN_NULL:    emitByte(parser, OP_NIL); break;
-        case TOKEN_TRUE:    emitByte(parser, OP_TRUE); break;
+        case TOKEN_FALSE:   emitOp(parser, OP_FALSE); break;
+        case TOKEN_NULL:    emitOp(parser, OP_NIL); break;
+        case TOKEN_TRUE:    emitOp(parser, OP_TRUE); break;
         case TOKEN_FUNC:    emitBytes(parser, OP_LD, 0); break;
         default:
             return; // Unreachable.                   
@@ -500,7 +1161,7 @@ static void number(parser_t *parser, bool canAssign)
 
 static void string(parser_t *parser, bool canAssign)
 {
-    str_t *s = str_copy(parser->vm,
+    str_t *s = copyString(parser,
         parser->previous.start + 1, parser->previous.length - 2, false);
 
     emitConstant(parser, VAL_OBJ(s));
@@ -521,29 +1182,66 @@ static void map(parser_t *parser, bool canAssign)
     emitBytes(parser, OP_MAP, count);
 }
 
+// A load or store of variable (arg), in a frame (level) functions out
+// if that is above 0.
+static void emitVariable(parser_t *parser, uint8_t op, int level, int arg)
+{
+    if (level > 0) {
+        emitBytes(parser, op, (uint8_t)level);
+        emitByte(parser, (uint8_t)arg);
+        return;
+    }
+    emitSmart(parser, op, arg);
+}
+
 static void namedVariable(parser_t *parser, tok_t name, bool canAssign)
 {
     uint8_t getOp, setOp;
     int arg = resolveLocal(parser, parser->compiler, &name);
+    int level = -1;
+
+    if (arg == -1) arg = resolveOuter(parser, &name, &level);
+    const_t *constant = arg == -1 || level < 0 ? resolveConstant(parser, &name) : NULL;
+
+    if (constant != NULL && constant->local == arg) {
+        if (canAssign && check(parser, TOKEN_EQUAL)) {
+            error(parser, "Cannot assign to a constant.");
+        }
+        else if (constant->known) {
+            emitValue(parser, constant->value);
+            return;
+        }
+    }
 
-    if (arg != -1) {
+    if (arg != -1 && level > 0) {
+        getOp = OP_OLD;
+        setOp = OP_OST;
+    }
+    else if (arg != -1 && level == 0) {
+        getOp = OP_ULD;
+        setOp = OP_UST;
+    }
+    else if (arg != -1) {
         getOp = OP_LD;
         setOp = OP_ST;
     }
     else {
-        arg = identifierConstant(parser, &name);
+        arg = globalSlot(parser, &name);
         getOp = OP_GLD;
         setOp = OP_GST;
     }
 
     if (canAssign && match(parser, TOKEN_EQUAL)) {
         expression(parser);
-        emitSmart(parser, setOp, arg);
+        emitVariable(parser, setOp, level, arg);
+#ifdef INLINE_CALLS
+        if (setOp == OP_GST) noteStore(parser, &name, 2);
+#endif
 
         parser->hadAssign = true;
     }
     else {
-        emitSmart(parser, getOp, arg);
+        emitVariable(parser, getOp, level, arg);
     }
 }
 
@@ -554,13 +1252,22 @@ static void variable(parser_t *parser, bool canAssign)
 
 static void or_(parser_t *parser, bool canAssign)
 {
-    int elseJump = emitJump(parser, OP_JMPF);
-    int endJump = emitJump(parser, OP_JMP);
+    val_t a;
 
-    patchJump(parser, elseJump);
-    emitByte(parser, OP_POP);
+    if (constantAt(parser, recentOp(parser, 0), &a)) {
+        int mark = currentChunk(parser)->count;
+
+        if (IS_FALSEY(a)) dropOps(parser, 1);
+        parsePrecedence(parser, PREC_OR);
+        if (!IS_FALSEY(a)) discardCode(parser, mark);
+        return;
+    }
 
+    int endJump = emitJump(parser, OP_JMPT);
+
+    emitOp(parser, OP_POP);
     parsePrecedence(parser, PREC_OR);
+
     patchJump(parser, endJump);
 }
 
@@ -574,8 +1281,8 @@ static void unary(parser_t *parser, bool canAssign)
     // Emit the operator instruction.              
     switch (operatorType) {
         case TOKEN_NOT:
-        case TOKEN_BANG:    emitByte(parser, OP_NOT); break;
-        case TOKEN_MINUS:   emitByte(parser, OP_NEG); break;
+        case TOKEN_BANG:    emitUnary(parser, OP_NOT); break;
+        case TOKEN_MINUS:   emitUnary(parser, OP_NEG); break;
         default:
             return; // Unreachable.                    
     }
@@ -685,16 +1392,202 @@ static void inlineBlock(parser_t *parser)
         return;
     }
 
-    while (!check(parser, TOKEN_ELSE) &&
-        !check(parser, TOKEN_EOF)) {
+    while (!check(parser, TOKEN_ELSE) && !check(parser, TOKEN_ENDIF) &&
+        !check(parser, TOKEN_END) && !check(parser, TOKEN_EOF)) {
         declaration(parser);
     }
 }
 
-static void function(parser_t *parser, funtype_t type)
+// The token that closes a block or bracket opened by (type), or
+// TOKEN_EOF. An If is closed by its Then, which opens the body.
+static toktype_t closerOf(toktype_t type)
+{
+    switch (type) {
+        case TOKEN_IF:          return TOKEN_THEN;
+        case TOKEN_WHILE:       return TOKEN_WEND;
+        case TOKEN_DO:          return TOKEN_UNTIL;
+        case TOKEN_FOR:         return TOKEN_NEXT;
+        case TOKEN_SWITCH:      return TOKEN_ENDSWITCH;
+        case TOKEN_SELECT:      return TOKEN_ENDSELECT;
+        case TOKEN_FUNC:        return TOKEN_ENDFUNC;
+        case TOKEN_LPAREN:      return TOKEN_RPAREN;
+        case TOKEN_LBRACKET:    return TOKEN_RBRACKET;
+        case TOKEN_LBRACE:      return TOKEN_RBRACE;
+        default:                return TOKEN_EOF;
+    }
+}
+
+static bool isCloser(toktype_t type)
+{
+    switch (type) {
+        case TOKEN_THEN: case TOKEN_WEND: case TOKEN_UNTIL: case TOKEN_NEXT:
+        case TOKEN_ENDSWITCH: case TOKEN_ENDSELECT: case TOKEN_ENDFUNC: case TOKEN_END:
+        case TOKEN_ENDIF: case TOKEN_RPAREN: case TOKEN_RBRACKET: case TOKEN_RBRACE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether the function just named, being declared in the body of
+// another, may be called once that body has returned. It can not while
+// its name, up to the end of the block declaring it, is only ever
+// called, and called from no other function declared there; its own
+// calls to itself do not count. Unbalanced code counts as escaping, its
+// errors come later.
+static bool escapes(parser_t *parser)
+{
+    lexer_t lexer = *parser->lexer;
+    toktype_t open[UINT8_COUNT];
+    int depth = 1, inner = 0;
+    bool own = true;
+
+    tok_t name = parser->previous;
+    tok_t before = name;
+    tok_t token = parser->current;
+    tok_t next = lexer_scan(&lexer);
+    open[0] = TOKEN_ENDFUNC;
+
+    while (token.type != TOKEN_EOF && token.type != TOKEN_ERROR) {
+        toktype_t type = token.type;
+
+        // The block declaring it ends, and its scope with it.
+        if (depth == 0 && isCloser(type)) return false;
+
+        if (isCloser(type)) {
+            toktype_t expected = open[depth - 1];
+            if (type != expected && (type != TOKEN_END ||
+                (expected != TOKEN_ENDIF && expected != TOKEN_ENDFUNC))) {
+                return true;
+            }
+
+            if (expected == TOKEN_ENDFUNC) {
+                if (depth == 1 && own) own = false;
+                else inner--;
+            }
+            depth--;
+
+            // A Then followed by more on its line is an inline If.
+            if (type == TOKEN_THEN && next.line != token.line) open[depth++] = TOKEN_ENDIF;
+        }
+        else if (closerOf(type) != TOKEN_EOF) {
+            if (depth == UINT8_COUNT) return true;
+            if (type == TOKEN_FUNC) inner++;
+            open[depth++] = closerOf(type);
+        }
+        else if (type == TOKEN_IDENTIFIER && before.type != TOKEN_DOT && identifiersEqual(&token, &name)) {
+            if (next.type != TOKEN_LPAREN || inner > 0) return true;
+        }
+
+        before = token;
+        token = next;
+        next = lexer_scan(&lexer);
+    }
+
+    return false;
+}
+
+#ifdef LAZY_COMPILE
+// Skip a function body up to its End or EndFunc, checking only that
+// its blocks and brackets nest.
+static void skimBody(parser_t *parser)
+{
+    toktype_t open[UINT8_COUNT];
+    int depth = 0;
+    int globalLine = -1;
+
+    while (!check(parser, TOKEN_EOF)) {
+        toktype_t type = parser->current.type;
+
+        if (depth == 0 && (type == TOKEN_END || type == TOKEN_ENDFUNC)) return;
+
+        if (type == TOKEN_PREPROCESSOR) {
+            errorAtCurrent(parser, "Directives must be at the top level of a file.");
+            return;
+        }
+
+        if (isCloser(type)) {
+            toktype_t expected = depth > 0 ? open[depth - 1] : TOKEN_EOF;
+            bool matches = type == expected || (type == TOKEN_END &&
+                (expected == TOKEN_ENDIF || expected == TOKEN_ENDFUNC));
+
+            if (!matches) {
+                errorAtCurrent(parser, "Unbalanced block in function body.");
+                return;
+            }
+
+            depth--;
+            advance(parser);
+
+            // A Then followed by more on its line is an inline If.
+            if (type == TOKEN_THEN && parser->current.line != parser->previous.line) {
+                open[depth++] = TOKEN_ENDIF;
+            }
+            continue;
+        }
+
+        if (closerOf(type) != TOKEN_EOF) {
+            if (depth == UINT8_COUNT) {
+                errorAtCurrent(parser, "Blocks nested too deeply.");
+                return;
+            }
+            open[depth++] = closerOf(type);
+        }
+
+        advance(parser);
+#ifdef INLINE_CALLS
+        // Stores in the body count before it is compiled, and so does
+        // every name on a Global line, which is more careful than needed.
+        if (type == TOKEN_GLOBAL) globalLine = parser->previous.line;
+        if (type == TOKEN_IDENTIFIER && (check(parser, TOKEN_EQUAL) || parser->previous.line == globalLine)) {
+            noteStore(parser, &parser->previous, 2);
+        }
+#endif
+    }
+}
+
+// Leave a stub for a top-level function: its parameters are counted and
+// its body skimmed, and compile_lazy() compiles it on the first call.
+static void lazyFunction(parser_t *parser)
+{
+    tok_t name = parser->previous;
+    tok_t params[32];
+
+    fun_t *function = newFunction(parser);
+    function->name = copyString(parser, name.start, name.length, true);
+    function->body = (int)(name.start - parser->source->buffer);
+    function->bodyLine = name.line;
+    function->bodyConsts = parser->source->constCount;
+
+    consume(parser, TOKEN_LPAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RPAREN)) {
+        do {
+            if (++function->arity > 32) {
+                errorAtCurrent(parser, "Cannot have more than 32 parameters.");
+            }
+            consume(parser, TOKEN_IDENTIFIER, "Expect parameter name.");
+
+            for (int i = 0; i < function->arity - 1 && i < 32; i++) {
+                if (identifiersEqual(&parser->previous, &params[i])) {
+                    error(parser, "Variable with this name already declared in this scope.");
+                }
+            }
+            if (function->arity <= 32) params[function->arity - 1] = parser->previous;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RPAREN, "Expect ')' after parameters.");
+
+    skimBody(parser);
+    consumes(parser, TOKEN_END, TOKEN_ENDFUNC, "Expect 'End' or 'EndFunc' after function body.");
+
+    emitSmart(parser, OP_CONST, makeConstant(parser, VAL_OBJ(function)));
+}
+#endif
+
+// Compile a parameter list and body into the function of a compiler
+// just set up by initCompiler().
+static fun_t *functionBody(parser_t *parser)
 {
-    compiler_t compiler;
-    initCompiler(parser, &compiler, type);
     beginScope(parser);
 
     // Compile the parameter list.                                
@@ -705,7 +1598,7 @@ static void function(parser_t *parser, funtype_t type)
             if (arity > 32) {
                 errorAtCurrent(parser, "Cannot have more than 32 parameters.");
             }
-            uint8_t paramConstant = parseVariable(parser, "Expect parameter name.");
+            int paramConstant = parseVariable(parser, "Expect parameter name.");
             defineVariable(parser, paramConstant);
         } while (match(parser, TOKEN_COMMA));
     }
@@ -718,16 +1611,50 @@ static void function(parser_t *parser, funtype_t type)
     }
     consumes(parser, TOKEN_END, TOKEN_ENDFUNC, "Expect 'End' or 'EndFunc' after function body.");
 
+    return endCompiler(parser);
+}
+
+static void function(parser_t *parser, funtype_t type)
+{
+#ifdef LAZY_COMPILE
+    if (parser->compiler->type == TYPE_SCRIPT && parser->compiler->scopeDepth == 0) {
+        lazyFunction(parser);
+        return;
+    }
+#endif
+
+    // Only functions declared in a body can capture its locals.
+    compiler_t *enclosing = parser->compiler;
+    bool escaping = enclosing->scopeDepth == 0 || escapes(parser);
+
+    compiler_t compiler;
+    initCompiler(parser, &compiler, type);
+    compiler.escapes = escaping;
+
     // Create the function object.                                
-    fun_t *function = endCompiler(parser);
-    uint8_t constant = makeConstant(parser, VAL_OBJ(function));
+    fun_t *function = functionBody(parser);
+    function->outer = enclosing->function;
+    int constant = makeConstant(parser, VAL_OBJ(function));
 
-    emitSmart(parser, OP_CONST, constant);
+    if (compiler.upvalueCount == 0) {
+        emitSmart(parser, OP_CONST, constant);
+        return;
+    }
+
+    function->upvalueCount = compiler.upvalueCount;
+    function->captures = malloc(compiler.upvalueCount * 2);
+    for (int i = 0; i < compiler.upvalueCount; i++) {
+        function->captures[i * 2] = compiler.upvalues[i].isLocal;
+        function->captures[i * 2 + 1] = compiler.upvalues[i].index;
+    }
+
+    emitOp(parser, OP_CLOSURE);
+    emitShort(parser, (uint16_t)constant);
 }
 
 static void funDeclaration(parser_t *parser)
 {
-    uint8_t global = parseVariable(parser, "Expect function name.");
+    int global = parseVariable(parser, "Expect function name.");
     markInitialized(parser);
     function(parser, TYPE_FUNCTION);
     defineVariable(parser, global);
@@ -735,28 +1662,103 @@ static void funDeclaration(parser_t *parser)
 
 static void varDeclaration(parser_t *parser)
 {
-    uint8_t global = parseVariable(parser, "Expect variable name.");
+    int global = parseVariable(parser, "Expect variable name.");
 
     if (match(parser, TOKEN_EQUAL)) {
         expression(parser);
     }
     else {
-        emitByte(parser, OP_NIL);
+        emitOp(parser, OP_NIL);
     }
 
     defineVariable(parser, global);
 }
 
+static void constDeclaration(parser_t *parser)
+{
+    do {
+        int global = parseVariable(parser, "Expect constant name.");
+        tok_t name = parser->previous;
+        int start = currentChunk(parser)->count;
+
+        consume(parser, TOKEN_EQUAL, "Expect '=' after constant name.");
+        expression(parser);
+
+        addConstant(parser, name, start);
+        defineVariable(parser, global);
+    } while (match(parser, TOKEN_COMMA));
+}
+
+// 'Enum [Step [+|-|*]n] $a [= n], ...' numbers its names from 0, or 1
+// for a multiplying step, each one stepping from the one before.
+static void enumDeclaration(parser_t *parser)
+{
+    char stepOp = '+';
+    double step = 1, value = 0;
+
+    if (match(parser, TOKEN_STEP)) {
+        if (match(parser, TOKEN_STAR)) stepOp = '*';
+        else if (match(parser, TOKEN_MINUS)) stepOp = '-';
+        else match(parser, TOKEN_PLUS);
+
+        consume(parser, TOKEN_NUMBER, "Expect a number after 'Step'.");
+        step = strtod(parser->previous.start, NULL);
+        if (stepOp == '*') value = 1;
+    }
+
+    bool first = true;
+    do {
+        int global = parseVariable(parser, "Expect enum name.");
+        tok_t name = parser->previous;
+        int start = currentChunk(parser)->count;
+        val_t given;
+
+        if (!first) {
+            switch (stepOp) {
+                case '+': value += step; break;
+                case '-': value -= step; break;
+                case '*': value *= step; break;
+            }
+        }
+
+        if (match(parser, TOKEN_EQUAL)) {
+            expression(parser);
+            if (constantExpr(parser, start, &given) && IS_NUM(given)) {
+                value = AS_NUM(given);
+            }
+            else {
+                error(parser, "Enum value must be a constant number.");
+            }
+        }
+        else {
+            emitConstant(parser, VAL_NUM(value));
+        }
+
+        addConstant(parser, name, start);
+        defineVariable(parser, global);
+        first = false;
+    } while (match(parser, TOKEN_COMMA));
+}
+
 static void globalDeclaration(parser_t *parser)
 {
+    if (match(parser, TOKEN_CONST)) {
+        constDeclaration(parser);
+        return;
+    }
+    if (match(parser, TOKEN_ENUM)) {
+        enumDeclaration(parser);
+        return;
+    }
+
     do {
-        uint8_t global = parseVariable(parser, "Expect variable name.");
+        int global = parseGlobal(parser);
 
         if (match(parser, TOKEN_EQUAL)) {
             expression(parser);
         }
         else {
-            emitByte(parser, OP_NIL);
+            emitOp(parser, OP_NIL);
         }
 
         emitSmart(parser, OP_DEF, global);
@@ -764,6 +1766,76 @@ static void globalDeclaration(parser_t *parser)
     } while (match(parser, TOKEN_COMMA));
 }
 
+#ifdef REGISTER_OPS
+static void emitRegisterOp(parser_t *parser, uint8_t op, uint8_t dst, uint8_t a, uint8_t b)
+{
+    emitBytes(parser, op, dst);
+    emitByte(parser, a);
+    emitByte(parser, b);
+}
+
+// Rewrite a statement that only stores into a local, 'LD a, LD/CONST b,
+// op, ST dst, POP', as one three-address instruction over frame slots.
+static bool emitRegisterStore(parser_t *parser)
+{
+    static const uint8_t slotOps[]  = { [OP_ADD] = OP_ADDR,  [OP_SUB] = OP_SUBR,  [OP_MUL] = OP_MULR,  [OP_DIV] = OP_DIVR };
+    static const uint8_t constOps[] = { [OP_ADD] = OP_ADDRK, [OP_SUB] = OP_SUBRK, [OP_MUL] = OP_MULRK, [OP_DIV] = OP_DIVRK };
+
+    uint8_t *code = currentChunk(parser)->code;
+    int store = recentOp(parser, 0);
+    int value = recentOp(parser, 1);
+
+    if (store < 0 || value < 0 || code[store] != OP_ST) return false;
+    uint8_t dst = code[store + 1];
+
+    switch (code[value]) {
+        case OP_LD: {
+            uint8_t a = code[value + 1];
+            dropOps(parser, 2);
+            emitBytes(parser, OP_MOVE, dst);
+            emitByte(parser, a);
+            return true;
+        }
+        case OP_CONST: {
+            uint8_t k = code[value + 1];
+            dropOps(parser, 2);
+            emitBytes(parser, OP_LOADK, dst);
+            emitByte(parser, k);
+            return true;
+        }
+        case OP_LD_LD_ADD: {
+            uint8_t a = code[value + 1], b = code[value + 2];
+            dropOps(parser, 2);
+            emitRegisterOp(parser, OP_ADDR, dst, a, b);
+            return true;
+        }
+        case OP_ADDK:
+        case OP_SUBK: {
+            if (recentCode(parser, 2) != OP_LD) return false;
+            uint8_t op = code[value] == OP_ADDK ? OP_ADDRK : OP_SUBRK;
+            uint8_t a = code[recentOp(parser, 2) + 1], k = code[value + 1];
+            dropOps(parser, 3);
+            emitRegisterOp(parser, op, dst, a, k);
+            return true;
+        }
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV: {
+            uint8_t rhs = recentCode(parser, 2);
+            if (recentCode(parser, 3) != OP_LD || (rhs != OP_LD && rhs != OP_CONST)) return false;
+            uint8_t op = (rhs == OP_LD ? slotOps : constOps)[code[value]];
+            uint8_t a = code[recentOp(parser, 3) + 1], b = code[recentOp(parser, 2) + 1];
+            dropOps(parser, 4);
+            emitRegisterOp(parser, op, dst, a, b);
+            return true;
+        }
+    }
+
+    return false;
+}
+#endif
+
 static void expressionStatement(parser_t *parser)
 {
     parser->hadCall = false;
@@ -771,7 +1843,10 @@ static void expressionStatement(parser_t *parser)
     parser->subExprs = 0;
 
     expression(parser);
-    emitByte(parser, OP_POP);
+#ifdef REGISTER_OPS
+    if (!emitRegisterStore(parser))
+#endif
+    emitOp(parser, OP_POP);
 
     if ((parser->subExprs <= 1) && !parser->hadCall && !parser->hadAssign) {
         error(parser, "Unexpected expression syntax.");
@@ -779,22 +1854,83 @@ static void expressionStatement(parser_t *parser)
     }
 }
 
+// Emit a jump taken when the condition just compiled is false, popping
+// it. A trailing comparison is fused into a compare-and-branch.
+static int emitConditionJump(parser_t *parser)
+{
+    uint8_t op = OP_JMPF_POP;
+    int drop = 0;
+
+    switch (recentCode(parser, 0)) {
+        case OP_LT: op = OP_JLT; drop = 1; break;
+        case OP_LE: op = OP_JLE; drop = 1; break;
+        case OP_EQ: op = OP_JEQ; drop = 1; break;
+        case OP_NOT:
+            switch (recentCode(parser, 1)) {
+                case OP_LT: op = OP_JGE; drop = 2; break;
+                case OP_LE: op = OP_JGT; drop = 2; break;
+                case OP_EQ: op = OP_JNE; drop = 2; break;
+            }
+            break;
+    }
+
+    if (drop > 0) dropOps(parser, drop);
+    return emitJump(parser, op);
+}
+
+// An If with a constant condition compiles both branches, for their
+// errors, but keeps only the one that can run.
+static void constantIf(parser_t *parser, bool taken, bool isInline)
+{
+    int mark = currentChunk(parser)->count;
+
+    beginScope(parser);
+    inlineBlock(parser);
+    endScope(parser);
+    if (!taken) discardCode(parser, mark);
+
+    if (match(parser, TOKEN_ELSE)) {
+        mark = currentChunk(parser)->count;
+        beginScope(parser);
+        inlineBlock(parser);
+        endScope(parser);
+        if (taken) discardCode(parser, mark);
+    }
+
+    if (!isInline) {
+        consumes(parser, TOKEN_END, TOKEN_ENDIF, "Expect 'End' or 'EndIf' after block.");
+    }
+}
+
 static void ifStatement(parser_t *parser)
 {
+    int start = currentChunk(parser)->count;
+    val_t condition;
+
     expression(parser);
     consume(parser, TOKEN_THEN, "Expect 'Then' after condition.");
     bool isInline = parser->current.line == parser->previous.line;
 
-    int thenJump = emitJump(parser, OP_JMPF);
-    emitByte(parser, OP_POP);
-    statement(parser);
+    if (constantExpr(parser, start, &condition)) {
+        dropOps(parser, 1);
+        constantIf(parser, !IS_FALSEY(condition), isInline);
+        return;
+    }
+
+    int thenJump = emitConditionJump(parser);
+    beginScope(parser);
+    inlineBlock(parser);
+    endScope(parser);
 
     int elseJump = emitJump(parser, OP_JMP);
 
     patchJump(parser, thenJump);
-    emitByte(parser, OP_POP);
 
-    if (match(parser, TOKEN_ELSE)) statement(parser);
+    if (match(parser, TOKEN_ELSE)) {
+        beginScope(parser);
+        inlineBlock(parser);
+        endScope(parser);
+    }
     patchJump(parser, elseJump);
 
     if (!isInline) {
@@ -803,6 +1939,703 @@ static void ifStatement(parser_t *parser)
     }
 }
 
+static void beginLoop(parser_t *parser, loop_t *loop, int start, int counter)
+{
+    compiler_t *current = parser->compiler;
+
+    loop->enclosing = current->loop;
+    loop->start = start;
+    loop->counter = counter;
+    loop->localCount = current->localCount;
+    loop->exitCount = 0;
+    loop->continueCount = 0;
+    current->loop = loop;
+}
+
+static void patchContinues(parser_t *parser, loop_t *loop)
+{
+    for (int i = 0; i < loop->continueCount; i++) patchJump(parser, loop->continues[i]);
+    loop->continueCount = 0;
+}
+
+static void endLoop(parser_t *parser, loop_t *loop)
+{
+    for (int i = 0; i < loop->exitCount; i++) patchJump(parser, loop->exits[i]);
+    parser->compiler->loop = loop->enclosing;
+}
+
+static void loopBody(parser_t *parser, toktype_t end, const char *message)
+{
+    beginScope(parser);
+    while (!check(parser, end) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
+    }
+    endScope(parser);
+    consume(parser, end, message);
+}
+
+#ifdef HOIST_LOADS
+// The value of global (name) if it can not change while a loop runs:
+// nothing in the sources stores to it, or, in a body compiled once the
+// script runs, only its definition at the top level does.
+static bool stableGlobal(parser_t *parser, tok_t *name, val_t *value)
+{
+    vm_t *vm = parser->vm;
+    uint32_t hash = hash_string(name->start, name->length, true);
+    val_t found;
+
+    for (compiler_t *compiler = parser->compiler; compiler != NULL; compiler = compiler->enclosing) {
+        if (resolveLocal(parser, compiler, name) != -1) return false;
+    }
+    if (resolveConstant(parser, name) != NULL) return false;
+
+    lockVm(parser);
+    str_t *id = str_copy(vm, name->start, name->length, true);
+    bool stable = tab_get(vm->globals, id, &found);
+    if (stable) {
+        *value = vm->globalValues->values[AS_INT(found)];
+        stable = !IS_UNDEF(*value) && !hash_get(&vm->stores, STORED_NAME(hash), &found);
+#ifdef INLINE_CALLS
+        if (!IS_UNDEF(*value) && !stable && parser->unit == NULL) {
+            stable = !hash_get(&vm->stores, hash, &found) || AS_NUM(found) <= 1;
+        }
+#endif
+    }
+    unlockVm(parser);
+    return stable;
+}
+
+// A field nothing in the sources stores to, by name or by index.
+static bool stableField(parser_t *parser, tok_t *name)
+{
+    uint32_t hash = hash_string(name->start, name->length, true);
+    val_t found;
+
+    lockVm(parser);
+    bool stable = !hash_get(&parser->vm->stores, STORED_FIELD(hash), &found) &&
+        !hash_get(&parser->vm->stores, STORED_INDEX, &found);
+    unlockVm(parser);
+    return stable;
+}
+
+// The value global (name) has now.
+static bool globalValue(parser_t *parser, tok_t *name, val_t *value)
+{
+    vm_t *vm = parser->vm;
+    val_t found;
+
+    lockVm(parser);
+    str_t *id = str_copy(vm, name->start, name->length, true);
+    bool defined = tab_get(vm->globals, id, &found);
+    if (defined) *value = vm->globalValues->values[AS_INT(found)];
+    unlockVm(parser);
+    return defined && !IS_UNDEF(*value);
+}
+
+// The native a call is about to make, if its callee, compiled in the
+// (*ops) instructions before the (argCount) arguments, is a stable field
+// of a stable global map, as 'math.sqrt' is: loaded by name, or from the
+// hidden local a loop hoisted it into.
+static const native_t *stableNative(parser_t *parser, int argCount, int *ops)
+{
+    compiler_t *current = parser->compiler;
+    chunk_t *chunk = currentChunk(parser);
+    int at = recentOp(parser, argCount);
+    tok_t owner = { 0 }, field = { 0 };
+    val_t map, callee;
+
+    if (at < 0) return NULL;
+
+    if (chunk->code[at] == OP_LD && current->locals[chunk->code[at + 1]].map >= 0) {
+        local_t *local = &current->locals[chunk->code[at + 1]];
+        field = local->name;
+        owner = current->locals[local->map].name;
+        if (!globalValue(parser, &owner, &map)) return NULL;
+        *ops = 1;
+    }
+    else if (chunk->code[at] == OP_GET && argCount + 1 < OP_HISTORY) {
+        int load = recentOp(parser, argCount + 1);
+        if (load < 0 || (chunk->code[load] != OP_GLD && chunk->code[load] != OP_GLD_W)) return NULL;
+
+        int slot = chunk->code[load] == OP_GLD ? chunk->code[load + 1] :
+            chunk->code[load + 1] << 8 | chunk->code[load + 2];
+        lockVm(parser);
+        str_t *name = vm_global_name(parser->vm, slot);
+        unlockVm(parser);
+        if (name == NULL) return NULL;
+
+        str_t *key = AS_STR(chunk->constants.values[chunk->code[at + 1]]);
+        owner.start = name->chars;
+        owner.length = name->length;
+        field.start = key->chars;
+        field.length = key->length;
+        if (!stableGlobal(parser, &owner, &map) || !stableField(parser, &field)) return NULL;
+        *ops = 2;
+    }
+    else {
+        return NULL;
+    }
+
+    if (!IS_MAP(map)) return NULL;
+
+    lockVm(parser);
+    str_t *key = str_copy(parser->vm, field.start, field.length, true);
+    bool found = map_get(AS_MAP(map), key, &callee);
+    unlockVm(parser);
+    return found && IS_CFN(callee) ? AS_CFN(callee) : NULL;
+}
+
+// Call a pure native now if its callee is stable and its arguments are
+// constants. Calls it would refuse are left to fail at run time.
+static bool foldNative(parser_t *parser, int argCount)
+{
+    val_t args[OP_HISTORY];
+    int ops;
+
+    if (argCount >= OP_HISTORY) return false;
+    for (int i = 0; i < argCount; i++) {
+        if (!constantAt(parser, recentOp(parser, argCount - 1 - i), &args[i])) return false;
+    }
+
+    const native_t *native = stableNative(parser, argCount, &ops);
+    if (native == NULL || !native->pure || native_check(native, argCount, args) != 0) return false;
+
+    lockVm(parser);
+    val_t result = native->function(parser->vm, argCount, args);
+    unlockVm(parser);
+
+    dropOps(parser, argCount + ops);
+    emitValue(parser, result);
+    return true;
+}
+
+static int findToken(tok_t *tokens, int count, tok_t *token)
+{
+    for (int i = 0; i < count; i++) {
+        if (identifiersEqual(&tokens[i], token)) return i;
+    }
+    return -1;
+}
+
+// Load the stable globals a loop reads, and the stable fields it reads
+// of those that hold maps, into hidden locals in front of it, in the
+// scope the caller opened. The loop is scanned ahead from the current
+// token to the (closer) of its (opener), through the line of an Until.
+// Names it stores to are left alone.
+static void hoistLoads(parser_t *parser, toktype_t opener, toktype_t closer)
+{
+    compiler_t *current = parser->compiler;
+    lexer_t lexer = *parser->lexer;
+    tok_t names[HOIST_MAX], fields[HOIST_MAX];
+    val_t values[HOIST_MAX];
+    int owners[HOIST_MAX], slots[HOIST_MAX];
+    int nameCount = 0, fieldCount = 0, depth = 0, untilLine = -1;
+
+    tok_t before = parser->previous;
+    tok_t token = parser->current;
+    tok_t next = lexer_scan(&lexer);
+    tok_t after = lexer_scan(&lexer);
+
+    while (token.type != TOKEN_EOF && token.type != TOKEN_ERROR) {
+        if (untilLine >= 0 && token.line != untilLine) break;
+
+        if (token.type == opener) {
+            depth++;
+        }
+        else if (token.type == closer && untilLine < 0 && depth-- == 0) {
+            if (closer != TOKEN_UNTIL) break;
+            untilLine = token.line;
+        }
+        else if (token.type == TOKEN_IDENTIFIER && before.type != TOKEN_DOT && next.type != TOKEN_EQUAL) {
+            int owner = findToken(names, nameCount, &token);
+
+            if (owner < 0 && nameCount < HOIST_MAX && stableGlobal(parser, &token, &values[nameCount])) {
+                owner = nameCount;
+                names[nameCount++] = token;
+            }
+
+            if (owner >= 0 && IS_MAP(values[owner]) && next.type == TOKEN_DOT &&
+                after.type == TOKEN_IDENTIFIER && fieldCount < HOIST_MAX &&
+                stableField(parser, &after)) {
+                bool seen = false;
+                for (int i = 0; i < fieldCount; i++) {
+                    seen |= owners[i] == owner && identifiersEqual(&fields[i], &after);
+                }
+                if (!seen) {
+                    owners[fieldCount] = owner;
+                    fields[fieldCount++] = after;
+                }
+            }
+        }
+
+        before = token;
+        token = next;
+        next = after;
+        after = lexer_scan(&lexer);
+    }
+
+    // Leave most of the frame to the loop's own locals.
+    if (current->localCount + nameCount + fieldCount > UINT8_COUNT / 2) return;
+
+    for (int i = 0; i < nameCount; i++) {
+        emitSmart(parser, OP_GLD, globalSlot(parser, &names[i]));
+        addLocal(parser, names[i]);
+        markInitialized(parser);
+        slots[i] = current->localCount - 1;
+    }
+
+    for (int i = 0; i < fieldCount; i++) {
+        int name = identifierConstant(parser, &fields[i]);
+        int cache = chunk_cache(currentChunk(parser));
+        if (name > UINT8_MAX || cache > UINT16_MAX) continue;
+
+        emitBytes(parser, OP_LD, (uint8_t)slots[owners[i]]);
+        emitBytes(parser, OP_GET, (uint8_t)name);
+        emitShort(parser, (uint16_t)cache);
+        addLocal(parser, fields[i]);
+        markInitialized(parser);
+        current->locals[current->localCount - 1].map = slots[owners[i]];
+    }
+}
+#endif
+
+static void whileStatement(parser_t *parser)
+{
+    beginScope(parser);
+#ifdef HOIST_LOADS
+    hoistLoads(parser, TOKEN_WHILE, TOKEN_WEND);
+#endif
+
+    int start = currentChunk(parser)->count;
+    int exitJump = -1;
+    val_t condition;
+    loop_t loop;
+
+    parser->compiler->lastTarget = start;
+    expression(parser);
+    if (constantExpr(parser, start, &condition) && !IS_FALSEY(condition)) {
+        dropOps(parser, 1);
+    }
+    else {
+        exitJump = emitConditionJump(parser);
+    }
+
+    beginLoop(parser, &loop, start, chunk_loop(currentChunk(parser)));
+    loopBody(parser, TOKEN_WEND, "Expect 'WEnd' after loop body.");
+    emitLoop(parser, start, loop.counter);
+
+    if (exitJump >= 0) patchJump(parser, exitJump);
+    endLoop(parser, &loop);
+    endScope(parser);
+}
+
+// 'Do ... Until condition'. ContinueLoop goes to the condition.
+static void doStatement(parser_t *parser)
+{
+    beginScope(parser);
+#ifdef HOIST_LOADS
+    hoistLoads(parser, TOKEN_DO, TOKEN_UNTIL);
+#endif
+
+    int start = currentChunk(parser)->count;
+    val_t condition;
+    loop_t loop;
+
+    parser->compiler->lastTarget = start;
+    beginLoop(parser, &loop, -1, chunk_loop(currentChunk(parser)));
+    loopBody(parser, TOKEN_UNTIL, "Expect 'Until' after loop body.");
+    patchContinues(parser, &loop);
+
+    int mark = currentChunk(parser)->count;
+    expression(parser);
+    if (constantExpr(parser, mark, &condition)) {
+        dropOps(parser, 1);
+        if (IS_FALSEY(condition)) emitLoop(parser, start, loop.counter);
+    }
+    else {
+        // The branch taken while the condition is false goes to the back
+        // edge, so a compare-and-branch still works here.
+        int again = emitConditionJump(parser);
+        int exitJump = emitJump(parser, OP_JMP);
+        patchJump(parser, again);
+        emitLoop(parser, start, loop.counter);
+        patchJump(parser, exitJump);
+    }
+
+    endLoop(parser, &loop);
+    endScope(parser);
+}
+
+// The loop an 'ExitLoop [level]' or 'ContinueLoop [level]' applies to,
+// after popping the locals of the loops it leaves.
+static loop_t *targetLoop(parser_t *parser)
+{
+    loop_t *loop = parser->compiler->loop;
+    int level = 1;
+
+    if (parser->current.line == parser->previous.line && match(parser, TOKEN_NUMBER)) {
+        level = (int)strtod(parser->previous.start, NULL);
+    }
+
+    for (int i = 1; i < level && loop != NULL; i++) loop = loop->enclosing;
+    if (loop == NULL || level < 1) {
+        error(parser, "No enclosing loop at this level.");
+        return NULL;
+    }
+
+    for (int i = parser->compiler->localCount; i > loop->localCount; i--) {
+        emitOp(parser, parser->compiler->locals[i - 1].captured ? OP_CLOSE : OP_POP);
+    }
+    return loop;
+}
+
+static void exitLoopStatement(parser_t *parser)
+{
+    loop_t *loop = targetLoop(parser);
+    if (loop == NULL) return;
+
+    if (loop->exitCount == UINT8_COUNT) {
+        error(parser, "Too many 'ExitLoop' in one loop.");
+        return;
+    }
+    loop->exits[loop->exitCount++] = emitJump(parser, OP_JMP);
+}
+
+static void continueLoopStatement(parser_t *parser)
+{
+    loop_t *loop = targetLoop(parser);
+    if (loop == NULL) return;
+
+    if (loop->start >= 0) {
+        emitLoop(parser, loop->start, loop->counter);
+        return;
+    }
+
+    if (loop->continueCount == UINT8_COUNT) {
+        error(parser, "Too many 'ContinueLoop' in one loop.");
+        return;
+    }
+    loop->continues[loop->continueCount++] = emitJump(parser, OP_JMP);
+}
+
+// 'For $i = start To limit [Step step] ... Next'. The counter, limit and
+// step live in three hidden locals below the loop variable, which is a
+// fresh local of the loop; FORPREP and FORLOOP do all the bookkeeping.
+static void forStatement(parser_t *parser)
+{
+    compiler_t *current = parser->compiler;
+    loop_t loop;
+
+    beginScope(parser);
+#ifdef HOIST_LOADS
+    hoistLoads(parser, TOKEN_FOR, TOKEN_NEXT);
+#endif
+    consume(parser, TOKEN_IDENTIFIER, "Expect loop variable name.");
+    tok_t name = parser->previous;
+    tok_t hidden = name;
+    hidden.start = "";
+    hidden.length = 0;
+    int base = current->localCount;
+
+    consume(parser, TOKEN_EQUAL, "Expect '=' after loop variable.");
+    expression(parser);
+    consume(parser, TOKEN_TO, "Expect 'To' after initial value.");
+    expression(parser);
+    if (match(parser, TOKEN_STEP)) {
+        expression(parser);
+    }
+    else {
+        emitConstant(parser, VAL_NUM(1));
+    }
+    emitOp(parser, OP_NIL);
+
+    for (int i = 0; i < 3; i++) {
+        addLocal(parser, hidden);
+        markInitialized(parser);
+    }
+    addLocal(parser, name);
+    markInitialized(parser);
+
+    emitBytes(parser, OP_FORPREP, (uint8_t)base);
+    emitShort(parser, 0);
+    int loopStart = currentChunk(parser)->count;
+    current->lastTarget = loopStart;
+
+    beginLoop(parser, &loop, -1, -1);
+    loopBody(parser, TOKEN_NEXT, "Expect 'Next' after loop body.");
+    patchContinues(parser, &loop);
+
+    emitBytes(parser, OP_FORLOOP, (uint8_t)base);
+    int jump = currentChunk(parser)->count + 2 - loopStart;
+
+    // Too far for the operands, both are re-encoded in their wide form
+    // when the function is finished.
+    if (jump > UINT16_MAX) {
+        chunk_farjump(currentChunk(parser), loopStart - 4, currentChunk(parser)->count + 2);
+        chunk_farjump(currentChunk(parser), currentChunk(parser)->count - 2, loopStart);
+        jump = 0;
+    }
+    emitShort(parser, (uint16_t)jump);
+
+    uint8_t *code = currentChunk(parser)->code;
+    code[loopStart - 2] = (jump >> 8) & 0xff;
+    code[loopStart - 1] = jump & 0xff;
+    current->lastTarget = currentChunk(parser)->count;
+
+    endLoop(parser, &loop);
+    endScope(parser);
+}
+
+// The cases of a Switch with only constant labels, from the one that
+// opened the run to the next case that has to be tested in place. One
+// OP_JTABLE, or OP_JHASH if there are strings, dispatches them all.
+typedef struct {
+    int table;          // -1 while no run is open
+    int dispatch;       // offset of the dispatch instruction
+    int caseCount;
+    bool strings;
+} swrun_t;
+
+static bool switchable(val_t value)
+{
+    return IS_NUM(value) || IS_BOOL(value) || IS_STR(value);
+}
+
+static void openRun(parser_t *parser, swrun_t *run, int subject)
+{
+    chunk_t *chunk = currentChunk(parser);
+
+    run->table = chunk_switch(chunk);
+    run->dispatch = chunk->count;
+    run->caseCount = 0;
+    run->strings = false;
+
+    if (run->table > UINT16_MAX) {
+        error(parser, "Too many 'Switch' cases in one chunk.");
+    }
+    emitBytes(parser, OP_JTABLE, (uint8_t)subject);
+    emitShort(parser, (uint16_t)run->table);
+}
+
+// Finish the open run, if any, with the cases that matched nothing
+// going on to (miss).
+static void closeRun(parser_t *parser, swrun_t *run, int miss)
+{
+    if (run->table < 0) return;
+
+    chunk_t *chunk = currentChunk(parser);
+    switch_t *table = &chunk->switches[run->table];
+
+    table->caseCount = run->caseCount;
+    table->targets = realloc(table->targets, (run->caseCount + 1) * sizeof(int));
+    table->targets[run->caseCount] = miss;
+    switch_build(table);
+
+    if (run->strings) chunk->code[run->dispatch] = OP_JHASH;
+    run->table = -1;
+}
+
+// Test the subject in local (subject) against the constant label (low ..
+// high), jumping to the body when it matches.
+static int emitLabelTest(parser_t *parser, int subject, val_t low, val_t high)
+{
+    if (AS_RAW(low) == AS_RAW(high)) {
+        emitValue(parser, low);
+        emitBytes(parser, OP_LD, (uint8_t)subject);
+        return emitJump(parser, OP_JNE);
+    }
+
+    emitValue(parser, low);
+    emitBytes(parser, OP_LD, (uint8_t)subject);
+    emitOp(parser, OP_LE);
+    int next = emitJump(parser, OP_JMPF_POP);
+    emitBytes(parser, OP_LD, (uint8_t)subject);
+    emitValue(parser, high);
+    emitOp(parser, OP_LE);
+    int body = emitJump(parser, OP_JMPT_POP);
+    patchJump(parser, next);
+    return body;
+}
+
+// Compile the labels of a Case starting at (mark). When they are all
+// constants the case joins the open run. Otherwise the run ends here
+// and the labels are tested in place; the jump over the body taken when
+// none matches is returned, for the caller to patch after the body.
+static int caseLabels(parser_t *parser, swrun_t *run, int subject, int mark)
+{
+    val_t lows[UINT8_COUNT], highs[UINT8_COUNT];
+    int bodies[UINT8_COUNT];
+    int labelCount = 0, bodyCount = 0;
+
+    do {
+        int start = currentChunk(parser)->count;
+        val_t low, high;
+
+        if (labelCount == UINT8_COUNT) {
+            error(parser, "Too many values in one 'Case'.");
+            return -1;
+        }
+
+        expression(parser);
+        bool known = constantExpr(parser, start, &low) && switchable(low);
+
+        if (match(parser, TOKEN_TO)) {
+            emitBytes(parser, OP_LD, (uint8_t)subject);
+            emitOp(parser, OP_LE);
+            int next = emitJump(parser, OP_JMPF_POP);
+            emitBytes(parser, OP_LD, (uint8_t)subject);
+            int upper = currentChunk(parser)->count;
+            expression(parser);
+
+            if (known && constantExpr(parser, upper, &high) && switchable(high) &&
+                IS_STR(low) == IS_STR(high)) {
+                discardCode(parser, start);
+                lows[labelCount] = low;
+                highs[labelCount++] = high;
+                continue;
+            }
+
+            emitOp(parser, OP_LE);
+            bodies[bodyCount++] = emitJump(parser, OP_JMPT_POP);
+            patchJump(parser, next);
+        }
+        else if (known) {
+            dropOps(parser, 1);
+            lows[labelCount] = highs[labelCount] = low;
+            labelCount++;
+        }
+        else {
+            emitBytes(parser, OP_LD, (uint8_t)subject);
+            bodies[bodyCount++] = emitJump(parser, OP_JNE);
+        }
+    } while (match(parser, TOKEN_COMMA));
+
+    if (bodyCount == 0) {
+        if (run->table < 0) openRun(parser, run, subject);
+
+        int index = run->caseCount++;
+        switch_t *table = &currentChunk(parser)->switches[run->table];
+
+        for (int i = 0; i < labelCount; i++) {
+            switch_label(table, lows[i], highs[i], index);
+            if (IS_STR(lows[i])) run->strings = true;
+        }
+        table->targets = realloc(table->targets, (index + 1) * sizeof(int));
+        table->targets[index] = currentChunk(parser)->count;
+        parser->compiler->lastTarget = currentChunk(parser)->count;
+        return -1;
+    }
+
+    closeRun(parser, run, mark);
+    for (int i = 0; i < labelCount; i++) {
+        if (bodyCount == UINT8_COUNT) {
+            error(parser, "Too many values in one 'Case'.");
+            return -1;
+        }
+        bodies[bodyCount++] = emitLabelTest(parser, subject, lows[i], highs[i]);
+    }
+
+    int skip = emitJump(parser, OP_JMP);
+    for (int i = 0; i < bodyCount; i++) patchJump(parser, bodies[i]);
+    return skip;
+}
+
+static void caseBody(parser_t *parser, toktype_t end)
+{
+    beginScope(parser);
+    while (!check(parser, TOKEN_CASE) && !check(parser, end) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
+    }
+    endScope(parser);
+}
+
+// 'Switch expr / Case value [To value][, ...] / Case Else / EndSwitch'.
+// The subject lives in a hidden local. Each run of cases with constant
+// labels is dispatched through a table, see swrun_t; other cases are
+// tested in order, so the first case that matches still wins.
+static void switchStatement(parser_t *parser)
+{
+    compiler_t *current = parser->compiler;
+    swrun_t run = { -1, 0, 0, false };
+    int *ends = NULL;
+    int endCount = 0;
+    bool hasElse = false;
+
+    beginScope(parser);
+    tok_t hidden = parser->previous;
+    hidden.start = "";
+    hidden.length = 0;
+
+    expression(parser);
+    addLocal(parser, hidden);
+    markInitialized(parser);
+    int subject = current->localCount - 1;
+
+    while (match(parser, TOKEN_CASE)) {
+        int mark = currentChunk(parser)->count;
+        int skip = -1;
+
+        if (hasElse) {
+            error(parser, "'Case Else' must be the last case.");
+        }
+
+        if (match(parser, TOKEN_ELSE)) {
+            closeRun(parser, &run, mark);
+            current->lastTarget = mark;
+            hasElse = true;
+        }
+        else {
+            skip = caseLabels(parser, &run, subject, mark);
+        }
+
+        caseBody(parser, TOKEN_ENDSWITCH);
+        ends = realloc(ends, (endCount + 1) * sizeof(int));
+        ends[endCount++] = emitJump(parser, OP_JMP);
+        if (skip >= 0) patchJump(parser, skip);
+    }
+    consume(parser, TOKEN_ENDSWITCH, "Expect 'EndSwitch' after cases.");
+
+    closeRun(parser, &run, currentChunk(parser)->count);
+    for (int i = 0; i < endCount; i++) patchJump(parser, ends[i]);
+    current->lastTarget = currentChunk(parser)->count;
+    free(ends);
+
+    endScope(parser);
+}
+
+// 'Select / Case condition / Case Else / EndSelect', an If chain.
+static void selectStatement(parser_t *parser)
+{
+    int *ends = NULL;
+    int endCount = 0;
+    bool hasElse = false;
+
+    while (match(parser, TOKEN_CASE)) {
+        int next = -1;
+
+        if (hasElse) {
+            error(parser, "'Case Else' must be the last case.");
+        }
+
+        if (match(parser, TOKEN_ELSE)) {
+            hasElse = true;
+        }
+        else {
+            expression(parser);
+            next = emitConditionJump(parser);
+        }
+
+        caseBody(parser, TOKEN_ENDSELECT);
+        ends = realloc(ends, (endCount + 1) * sizeof(int));
+        ends[endCount++] = emitJump(parser, OP_JMP);
+        if (next >= 0) patchJump(parser, next);
+    }
+    consume(parser, TOKEN_ENDSELECT, "Expect 'EndSelect' after cases.");
+
+    for (int i = 0; i < endCount; i++) patchJump(parser, ends[i]);
+    free(ends);
+}
+
 static void printStatement(parser_t *parser)
 {
     int count = 0;
@@ -834,7 +2667,13 @@ static void returnStatement(parser_t *parser)
     }
     else {
         expression(parser);
-        emitByte(parser, OP_RET);
+
+        // 'Return f(...)' hands the frame over to f, unless functions
+        // declared here would then miss it.
+        if (recentCode(parser, 0) == OP_CALL && !parser->compiler->framed) {
+            currentChunk(parser)->code[recentOp(parser, 0)] = OP_TAILCALL;
+        }
+        emitOp(parser, OP_RET);
     }
 }
 
@@ -847,11 +2686,52 @@ static void exitStatement(parser_t *parser)
         expression(parser);
     }
     else {
-        emitByte(parser, OP_NIL);
+        emitOp(parser, OP_NIL);
     }
 
     if (hadParen) consume(parser, TOKEN_RPAREN, "Expected ')' closing.");
-    //emitByte(parser, OP_EXIT);
+    //emitOp(parser, OP_EXIT);
+}
+
+// '#include "file"' runs the top-level code of (file), compiled on its
+// own, where the script first reaches it; later ones for the same file
+// do nothing. '#include-once' is accepted and implied.
+static void directive(parser_t *parser)
+{
+    tok_t name = parser->previous;
+
+    if (parser->unit == NULL || parser->compiler->type != TYPE_SCRIPT ||
+        parser->compiler->scopeDepth > 0) {
+        error(parser, "Directives must be at the top level of a file.");
+        return;
+    }
+
+    if (name.length != 8 || !equal_str(name.start, "#include", 8)) {
+        error(parser, "Unknown directive.");
+        return;
+    }
+
+    if (match(parser, TOKEN_MINUS)) {
+        consume(parser, TOKEN_IDENTIFIER, "Expect 'once' after '#include-'.");
+        return;
+    }
+
+    consume(parser, TOKEN_STRING, "Expect file name after '#include'.");
+    if (parser->includes >= parser->unit->includeCount) return;
+
+    incl_t *include = &parser->unit->includes[parser->includes++];
+    unit_t *target = &parser->graph->units[include->unit];
+
+    if (target->source == NULL) {
+        error(parser, "Cannot open include file.");
+        return;
+    }
+
+    if (include->runs) {
+        emitSmart(parser, OP_CONST, makeConstant(parser, VAL_OBJ(target->function)));
+        emitCall(parser, 0);
+        emitOp(parser, OP_POP);
+    }
 }
 
 static void synchronize(parser_t *parser)
@@ -889,6 +2769,12 @@ static void declaration(parser_t *parser)
     else if (match(parser, TOKEN_GLOBAL)) {
         globalDeclaration(parser);
     }
+    else if (match(parser, TOKEN_CONST)) {
+        constDeclaration(parser);
+    }
+    else if (match(parser, TOKEN_ENUM)) {
+        enumDeclaration(parser);
+    }
     else {
         statement(parser);
     }
@@ -904,48 +2790,69 @@ static void statement(parser_t *parser)
     else if (match(parser, TOKEN_IF)) {
         ifStatement(parser);
     }
+    else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);
+    }
+    else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
+    }
+    else if (match(parser, TOKEN_DO)) {
+        doStatement(parser);
+    }
+    else if (match(parser, TOKEN_SWITCH)) {
+        switchStatement(parser);
+    }
+    else if (match(parser, TOKEN_SELECT)) {
+        selectStatement(parser);
+    }
+    else if (match(parser, TOKEN_EXITLOOP)) {
+        exitLoopStatement(parser);
+    }
+    else if (match(parser, TOKEN_CONTINUELOOP)) {
+        continueLoopStatement(parser);
+    }
     else if (match(parser, TOKEN_RETURN)) {
         returnStatement(parser);
     }
     else if (match(parser, TOKEN_EXIT)) {
         exitStatement(parser);
     }
+    else if (match(parser, TOKEN_PREPROCESSOR)) {
+        directive(parser);
+    }
     else if (match(parser, TOKEN_LBRACE)) {
         beginScope(parser);
         block(parser);
         endScope(parser);
     }
-    else if (checkPrev(parser, TOKEN_THEN)) {
-        beginScope(parser);
-        inlineBlock(parser);
-        endScope(parser);
-    }
-    else if (checkPrev(parser, TOKEN_ELSE)) {
-        beginScope(parser);
-        while (!check(parser, TOKEN_ENDIF) && !check(parser, TOKEN_EOF)) {
-            declaration(parser);
-        }
-        endScope(parser);
-    }
     else {
         expressionStatement(parser);
     }
 }
 
-fun_t *compile(vm_t *vm, src_t *source)
+static void compileUnit(graph_t *graph, unit_t *unit)
 {
     lexer_t lexer;
     parser_t parser;
     compiler_t compiler;
 
-    parser.vm = vm;
-    parser.source = source;
+    // A file that can not be read is reported where it is included.
+    if (unit->source == NULL) return;
+
+    parser.vm = graph->vm;
+    parser.source = unit->source;
+    parser.graph = graph;
+    parser.unit = unit;
+    parser.includes = 0;
+    parser.shared = graph->count > 1;
+    parser.inlining = false;
+    parser.nesting = 0;
     parser.lexer = &lexer;
     parser.compiler = NULL;
     parser.hadError = false;
     parser.panicMode = false;
 
-    lexer_init(&lexer, source->buffer);
+    lexer_init(&lexer, unit->source->buffer);
     initCompiler(&parser, &compiler, TYPE_SCRIPT);
     
     advance(&parser);
@@ -953,6 +2860,106 @@ fun_t *compile(vm_t *vm, src_t *source)
         declaration(&parser);
     }
 
-    fun_t *function = endCompiler(&parser);
-    return parser.hadError ? NULL : function;
+    endCompiler(&parser);
+    unit->hadError = parser.hadError;
+}
+
+fun_t *compile(vm_t *vm, src_t *source)
+{
+    graph_t graph;
+    bool hadError = false;
+
+    // The files of a script do not depend on each other to compile.
+    include_scan(vm, source, &graph);
+    include_parallel(&graph, compileUnit);
+
+    fun_t *function = graph.units[0].function;
+    for (int i = 0; i < graph.count; i++) hadError |= graph.units[i].hadError;
+
+    include_free(&graph);
+    return hadError ? NULL : function;
+}
+
+static bool lazyCompile(vm_t *vm, fun_t *function, int nesting)
+{
+    src_t *source = function->chunk.source;
+    int body = function->body;
+    lexer_t lexer;
+    parser_t parser;
+    compiler_t script;
+    compiler_t compiler;
+
+    parser.vm = vm;
+    parser.source = source;
+    parser.graph = NULL;
+    parser.unit = NULL;
+    parser.includes = 0;
+    parser.shared = false;
+    parser.inlining = true;
+    parser.nesting = nesting;
+    parser.lexer = &lexer;
+    parser.compiler = NULL;
+    parser.hadError = false;
+    parser.panicMode = false;
+
+    // Resume the lexer at the name, which initCompiler() reads.
+    lexer_init(&lexer, source->buffer);
+    lexer.start = lexer.current = source->buffer + body;
+    lexer.line = function->bodyLine;
+    lexer.currentLine = lexer.current;
+    while (lexer.currentLine > source->buffer && lexer.currentLine[-1] != '\n') lexer.currentLine--;
+    lexer.position = (int)(lexer.current - lexer.currentLine) + 1;
+
+    advance(&parser);
+    advance(&parser);
+
+    // The top-level Consts it could see where it was declared.
+    script.enclosing = NULL;
+    script.function = NULL;
+    script.type = TYPE_SCRIPT;
+    script.localCount = 0;
+    script.constCount = 0;
+    script.scopeDepth = 0;
+    script.loop = NULL;
+    script.upvalueCount = 0;
+    script.escapes = true;
+    script.framed = false;
+    for (int i = 0; i < function->bodyConsts && i < UINT8_COUNT; i++) {
+        srcconst_t *saved = &source->consts[i];
+        const_t *constant = &script.consts[script.constCount++];
+
+        constant->name.start = source->buffer + saved->start;
+        constant->name.length = saved->length;
+        constant->value = saved->value;
+        constant->known = saved->known;
+        constant->depth = 0;
+        constant->local = -1;
+    }
+    parser.compiler = &script;
+
+    // Its empty chunk keeps it from being inlined into itself.
+    function->body = -1;
+    initCompiler(&parser, &compiler, TYPE_FUNCTION);
+    fun_t *compiled = functionBody(&parser);
+    if (parser.hadError) {
+        function->body = body;
+        return false;
+    }
+
+    function->arity = compiled->arity;
+    function->chunk = compiled->chunk;
+    chunk_init(&compiled->chunk, source);
+
+    // Functions declared in it find its frame by the stub.
+    arr_t *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        val_t value = constants->values[i];
+        if (IS_FUN(value) && AS_FUN(value)->outer == compiled) AS_FUN(value)->outer = function;
+    }
+    return true;
+}
+
+bool compile_lazy(vm_t *vm, fun_t *function)
+{
+    return lazyCompile(vm, function, 0);
 }
@@ -0,0 +1,970 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "code.h"
+#include "object.h"
+
+// Peephole and jump-threading pass over a finished chunk. Instructions
+// are decoded into a list, rewritten and deleted there until nothing
+// changes, then the chunk is re-encoded with jumps and the position
+// table following the surviving instructions. Jumps that no longer fit
+// their 16-bit operand are re-encoded in a long form around JMP_W, or
+// as FORPREP_W, FORLOOP_W and LOOP_W.
+// The case targets of a Switch table are followed like jump targets.
+// With INLINE_CALLS, calls are replaced by small callees before that.
+
+#define NO_TARGET   -1
+
+typedef struct {
+    int offset;
+    int pos;            // offset of the position it keeps
+    uint8_t opcode;
+    int target;         // instruction index of a jump target
+    int table;          // Switch table of OP_JTABLE and OP_JHASH, or -1
+    bool dead;
+    bool reached;
+    bool isTarget;
+    bool far;           // encoded in the long form
+} insn_t;
+
+typedef struct {
+    insn_t *insns;
+    int count;
+    int dispatches;     // saved by threading, per execution of the jump
+    int tableCount;
+    int **cases;        // instruction index of each target of a table
+    int caseCount;      // over all tables
+} peephole_t;
+
+static bool isJump(uint8_t opcode)
+{
+    switch (opcode) {
+        case OP_JMP: case OP_JMPF: case OP_JMPT: case OP_JMPF_POP: case OP_JMPT_POP:
+        case OP_JLT: case OP_JLE: case OP_JGT: case OP_JGE: case OP_JEQ: case OP_JNE:
+        case OP_FORPREP: case OP_FORLOOP: case OP_LOOP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Position of the jump operand. FORLOOP and LOOP jump backwards.
+static int jumpOperand(uint8_t opcode)
+{
+    switch (opcode) {
+        case OP_FORPREP: case OP_FORLOOP: return 2;
+        case OP_LOOP: return 3;
+        default: return 1;
+    }
+}
+
+static int jumpSign(uint8_t opcode)
+{
+    return opcode == OP_FORLOOP || opcode == OP_LOOP ? -1 : 1;
+}
+
+// The short form of a jump in long form. Jumps are decoded to it and
+// layout() picks their form again.
+static uint8_t shortForm(uint8_t opcode)
+{
+    switch (opcode) {
+        case OP_JMP_W: return OP_JMP;
+        case OP_FORPREP_W: return OP_FORPREP;
+        case OP_FORLOOP_W: return OP_FORLOOP;
+        case OP_LOOP_W: return OP_LOOP;
+        default: return opcode;
+    }
+}
+
+// First live instruction at or after (index); (count) is the end.
+static int live(peephole_t *p, int index)
+{
+    while (index < p->count && p->insns[index].dead) index++;
+    return index;
+}
+
+static int next(peephole_t *p, int index)
+{
+    return live(p, index + 1);
+}
+
+// Whether control can enter (b) other than from (a). Instructions deleted
+// between them in this round still carry their flag and forward to (b).
+static bool entered(peephole_t *p, int a, int b)
+{
+    for (int i = a + 1; i <= b; i++) {
+        if (p->insns[i].isTarget) return true;
+    }
+
+    return false;
+}
+
+static void decode(peephole_t *p, chunk_t *chunk)
+{
+    int *index = malloc((chunk->count + 1) * sizeof(int));
+
+    p->insns = malloc((chunk->count + 1) * sizeof(insn_t));
+    p->count = 0;
+    p->dispatches = 0;
+    for (int i = 0; i <= chunk->count; i++) index[i] = NO_TARGET;
+
+    for (int offset = 0; offset < chunk->count; offset += opcode_length(chunk->code[offset])) {
+        insn_t *insn = &p->insns[p->count];
+        insn->offset = offset;
+        insn->pos = offset;
+        insn->opcode = chunk->code[offset];
+        insn->target = NO_TARGET;
+        insn->table = -1;
+        insn->dead = false;
+        insn->far = false;
+        index[offset] = p->count++;
+    }
+    index[chunk->count] = p->count;
+
+    for (int i = 0; i < p->count; i++) {
+        insn_t *insn = &p->insns[i];
+        uint8_t *ip = &chunk->code[insn->offset];
+
+        if (shortForm(insn->opcode) != insn->opcode) {
+            int at = jumpOperand(shortForm(insn->opcode));
+            int32_t jump = (int32_t)((uint32_t)ip[at] << 24 | ip[at + 1] << 16 | ip[at + 2] << 8 | ip[at + 3]);
+            insn->opcode = shortForm(insn->opcode);
+            insn->target = index[insn->offset + opcode_length(*ip) + jump * jumpSign(insn->opcode)];
+        }
+        else if (isJump(insn->opcode)) {
+            int at = jumpOperand(insn->opcode);
+            int jump = (ip[at] << 8 | ip[at + 1]) * jumpSign(insn->opcode);
+            insn->target = index[insn->offset + opcode_length(insn->opcode) + jump];
+        }
+        else if (insn->opcode == OP_JTABLE || insn->opcode == OP_JHASH) {
+            insn->table = ip[2] << 8 | ip[3];
+        }
+    }
+
+    // Tables of code that the compiler threw away are left unused.
+    p->tableCount = chunk->switchCount;
+    p->cases = malloc((chunk->switchCount + 1) * sizeof(int *));
+    p->caseCount = 0;
+
+    for (int t = 0; t < chunk->switchCount; t++) {
+        switch_t *table = &chunk->switches[t];
+        p->cases[t] = malloc((table->caseCount + 1) * sizeof(int));
+        p->caseCount += table->caseCount + 1;
+
+        for (int j = 0; j <= table->caseCount; j++) {
+            int offset = table->targets[j];
+            p->cases[t][j] = offset >= 0 && offset <= chunk->count ? index[offset] : NO_TARGET;
+        }
+    }
+
+    // Jumps the compiler could not patch record their target here.
+    for (int i = 0; i < chunk->farCount; i++) {
+        insn_t *insn = &p->insns[index[chunk->farJumps[i].from]];
+        insn->target = index[chunk->farJumps[i].to];
+    }
+
+    free(index);
+}
+
+static int caseCount(peephole_t *p, chunk_t *chunk, insn_t *insn)
+{
+    return insn->table < 0 ? 0 : chunk->switches[insn->table].caseCount + 1;
+}
+
+static void markTargets(peephole_t *p, chunk_t *chunk)
+{
+    for (int i = 0; i < p->count; i++) p->insns[i].isTarget = false;
+
+    for (int i = 0; i < p->count; i++) {
+        insn_t *insn = &p->insns[i];
+        if (insn->dead) continue;
+
+        if (insn->target != NO_TARGET) {
+            insn->target = live(p, insn->target);
+            if (insn->target < p->count) p->insns[insn->target].isTarget = true;
+        }
+
+        for (int j = 0; j < caseCount(p, chunk, insn); j++) {
+            int *target = &p->cases[insn->table][j];
+            if (*target == NO_TARGET) continue;
+            *target = live(p, *target);
+            if (*target < p->count) p->insns[*target].isTarget = true;
+        }
+    }
+}
+
+// Follow a jump that lands on another jump. A conditional jump that
+// keeps its value lands on one that tests the same value, so its
+// outcome there is already known.
+static bool threadJump(peephole_t *p, insn_t *insn)
+{
+    insn->target = live(p, insn->target);
+    if (insn->target >= p->count) return false;
+
+    insn_t *to = &p->insns[insn->target];
+    int target = NO_TARGET;
+
+    // A back edge stays on its loop header.
+    if (to == insn || jumpSign(insn->opcode) < 0) return false;
+
+    switch (to->opcode) {
+        case OP_JMP:
+            target = to->target;
+            break;
+        case OP_JMPF:
+            if (insn->opcode == OP_JMPF) target = to->target;
+            if (insn->opcode == OP_JMPT) target = next(p, insn->target);
+            break;
+        case OP_JMPT:
+            if (insn->opcode == OP_JMPT) target = to->target;
+            if (insn->opcode == OP_JMPF) target = next(p, insn->target);
+            break;
+    }
+
+    if (target == NO_TARGET || target == insn->target) return false;
+
+    insn->target = target;
+    p->dispatches++;
+    return true;
+}
+
+// 'JMPF L; POP' where L pops the same value and branches on it again,
+// as in 'If $a And $b Then', becomes a single popping branch.
+static bool threadPop(peephole_t *p, int i)
+{
+    insn_t *insn = &p->insns[i];
+    int pop = next(p, i);
+
+    insn->target = live(p, insn->target);
+    if (insn->target >= p->count || pop >= p->count) return false;
+    if (p->insns[pop].opcode != OP_POP || entered(p, i, pop)) return false;
+
+    insn_t *to = &p->insns[insn->target];
+    bool falsey = insn->opcode == OP_JMPF;
+    int target;
+
+    if (to->opcode == OP_JMPF_POP) target = falsey ? to->target : next(p, insn->target);
+    else if (to->opcode == OP_JMPT_POP) target = falsey ? next(p, insn->target) : to->target;
+    else return false;
+
+    insn->opcode = falsey ? OP_JMPF_POP : OP_JMPT_POP;
+    insn->target = target;
+    p->insns[pop].dead = true;
+    p->dispatches++;
+    return true;
+}
+
+static bool isPushOnly(uint8_t opcode)
+{
+    switch (opcode) {
+        case OP_NIL: case OP_TRUE: case OP_FALSE: case OP_CONST: case OP_CONST_W: case OP_LD:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool rewritePair(peephole_t *p, int i)
+{
+    insn_t *a = &p->insns[i];
+    int j = next(p, i);
+
+    if (a->target != NO_TARGET && live(p, a->target) == j &&
+        (a->opcode == OP_JMP || a->opcode == OP_JMPF || a->opcode == OP_JMPT)) {
+        a->dead = true;
+        return true;
+    }
+
+    if (j >= p->count || entered(p, i, j)) return false;
+    insn_t *b = &p->insns[j];
+
+    if (a->opcode == OP_NOT && (b->opcode == OP_JMPF_POP || b->opcode == OP_JMPT_POP)) {
+        b->opcode = b->opcode == OP_JMPF_POP ? OP_JMPT_POP : OP_JMPF_POP;
+        a->dead = true;
+        return true;
+    }
+
+    if (isPushOnly(a->opcode) && b->opcode == OP_POP) {
+        a->dead = true;
+        b->dead = true;
+        return true;
+    }
+
+    return false;
+}
+
+static bool fallsThrough(insn_t *insn)
+{
+    return insn->opcode != OP_JMP && insn->opcode != OP_LOOP && insn->opcode != OP_RET &&
+        insn->table < 0;
+}
+
+static bool removeUnreachable(peephole_t *p, chunk_t *chunk)
+{
+    int *work = malloc(((p->count + 1) * 2 + p->caseCount) * sizeof(int));
+    int count = 0;
+    bool changed = false;
+
+    for (int i = 0; i < p->count; i++) p->insns[i].reached = false;
+
+    work[count++] = live(p, 0);
+    while (count > 0) {
+        int i = work[--count];
+        if (i >= p->count || p->insns[i].reached) continue;
+
+        insn_t *insn = &p->insns[i];
+        insn->reached = true;
+
+        if (insn->target != NO_TARGET) work[count++] = live(p, insn->target);
+        for (int j = 0; j < caseCount(p, chunk, insn); j++) {
+            if (p->cases[insn->table][j] != NO_TARGET) work[count++] = live(p, p->cases[insn->table][j]);
+        }
+        if (fallsThrough(insn)) work[count++] = next(p, i);
+    }
+
+    for (int i = 0; i < p->count; i++) {
+        if (!p->insns[i].dead && !p->insns[i].reached) {
+            p->insns[i].dead = true;
+            changed = true;
+        }
+    }
+
+    free(work);
+    return changed;
+}
+
+static void release(peephole_t *p)
+{
+    for (int t = 0; t < p->tableCount; t++) free(p->cases[t]);
+    free(p->cases);
+    free(p->insns);
+}
+
+#ifdef INLINE_CALLS
+// A call through a global that always holds the same small function is
+// replaced by the body of the function. The callee is no longer loaded,
+// so its arguments sit one slot lower than in its frame: slot (s) of
+// the body is slot (base + s - 1) of the caller, (base) being the depth
+// the callee was loaded at. A return drops what the body left below its
+// result and jumps past the body.
+
+// Offsets of the operands that name frame slots.
+static int slotOperands(uint8_t opcode, int *at)
+{
+    switch (opcode) {
+        case OP_LD: case OP_ST: case OP_LOADK:
+        case OP_FORPREP: case OP_FORLOOP: case OP_JTABLE: case OP_JHASH:
+            at[0] = 1;
+            return 1;
+        case OP_LD_LD_ADD: case OP_MOVE:
+        case OP_ADDRK: case OP_SUBRK: case OP_MULRK: case OP_DIVRK:
+            at[0] = 1;
+            at[1] = 2;
+            return 2;
+        case OP_ADDR: case OP_SUBR: case OP_MULR: case OP_DIVR:
+            at[0] = 1;
+            at[1] = 2;
+            at[2] = 3;
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+// Offset of the constant operand, 0 if there is none.
+static int constOperand(uint8_t opcode)
+{
+    switch (opcode) {
+        case OP_CONST: case OP_CONST_W: case OP_ADDK: case OP_SUBK: case OP_GET: case OP_SET:
+            return 1;
+        case OP_LOADK:
+            return 2;
+        case OP_ADDRK: case OP_SUBRK: case OP_MULRK: case OP_DIVRK:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+static bool reach(peephole_t *p, int *depths, int *work, int *count, int index, int depth)
+{
+    if (index >= p->count) return true;
+
+    if (depths[index] < 0) {
+        depths[index] = depth;
+        work[(*count)++] = index;
+        return true;
+    }
+
+    return depths[index] == depth;
+}
+
+// Stack depth before each instruction, starting with (entry) values on
+// the stack, or -1 where it is not reached. NULL if paths disagree.
+static int *stackDepths(peephole_t *p, chunk_t *chunk, int entry)
+{
+    int *depths = malloc((p->count + 1) * sizeof(int));
+    int *work = malloc((p->count + 1) * sizeof(int));
+    int count = 0;
+
+    for (int i = 0; i <= p->count; i++) depths[i] = -1;
+    bool ok = reach(p, depths, work, &count, live(p, 0), entry);
+
+    while (ok && count > 0) {
+        int i = work[--count];
+        insn_t *insn = &p->insns[i];
+        int pops, pushes;
+
+        opcode_effect(&chunk->code[insn->offset], &pops, &pushes);
+        int depth = depths[i] - pops + pushes;
+        if (depths[i] < pops) ok = false;
+
+        if (insn->target != NO_TARGET) {
+            ok &= reach(p, depths, work, &count, live(p, insn->target), depth);
+        }
+        for (int j = 0; j < caseCount(p, chunk, insn); j++) {
+            int target = p->cases[insn->table][j];
+            if (target != NO_TARGET) ok &= reach(p, depths, work, &count, live(p, target), depth);
+        }
+        if (fallsThrough(insn)) ok &= reach(p, depths, work, &count, next(p, i), depth);
+    }
+
+    free(work);
+    if (ok) return depths;
+
+    free(depths);
+    return NULL;
+}
+
+// The GLD that loaded the callee of the CALL at (call) at depth (base),
+// if nothing between them uses its slot or jumps in or out. -1 if there
+// is none.
+static int calleeLoad(peephole_t *p, chunk_t *chunk, int *depths, int call, int base)
+{
+    int load = call - 1;
+    int at[3];
+
+    while (load >= 0 && (p->insns[load].dead || depths[load] > base)) load--;
+    if (load < 0 || depths[load] != base) return -1;
+    if (p->insns[load].opcode != OP_GLD && p->insns[load].opcode != OP_GLD_W) return -1;
+
+    for (int i = 0; i < p->count; i++) {
+        insn_t *insn = &p->insns[i];
+        bool inside = i > load && i < call;
+        if (insn->dead) continue;
+
+        if (inside) {
+            for (int k = slotOperands(insn->opcode, at) - 1; k >= 0; k--) {
+                if (chunk->code[insn->offset + at[k]] == base) return -1;
+            }
+        }
+
+        if (insn->target != NO_TARGET) {
+            int target = live(p, insn->target);
+            if ((target > load && target <= call) != inside) return -1;
+        }
+        for (int j = 0; j < caseCount(p, chunk, insn); j++) {
+            int target = p->cases[insn->table][j];
+            if (target == NO_TARGET) continue;
+            target = live(p, target);
+            if ((target > load && target <= call) != inside) return -1;
+        }
+    }
+
+    return load;
+}
+
+static int findConstant(arr_t *constants, val_t value)
+{
+    for (int i = 0; i < constants->count; i++) {
+        val_t constant = constants->values[i];
+        if (AS_TYPE(constant) == AS_TYPE(value) && val_equal(constant, value)) return i;
+    }
+
+    return -1;
+}
+
+// Room for (size) more bytes past the code, where the instructions added
+// to the list are encoded from.
+static int appendCode(chunk_t *chunk, int size)
+{
+    int offset = chunk->count;
+
+    if (chunk->count + size > chunk->capacity) {
+        chunk->capacity = chunk->count + size;
+        chunk->code = realloc(chunk->code, chunk->capacity);
+    }
+
+    chunk->count += size;
+    return offset;
+}
+
+static insn_t *addInsn(insn_t *insns, int index, int offset, int pos, uint8_t opcode)
+{
+    insn_t *insn = &insns[index];
+
+    insn->offset = offset;
+    insn->pos = pos;
+    insn->opcode = opcode;
+    insn->target = NO_TARGET;
+    insn->table = -1;
+    insn->dead = false;
+    insn->far = false;
+    return insn;
+}
+
+// Replace the instructions from the callee load at (load) to the CALL at
+// (call) by the body of (callee). False if the body does not qualify: it
+// must be short, make no calls, have no loops, Switch tables or closures,
+// and its slots and constants must fit the operands of the caller.
+static bool inlineBody(peephole_t *p, chunk_t *chunk, int load, int call, int base, fun_t *callee)
+{
+    chunk_t *body = &callee->chunk;
+    arr_t *constants = &chunk->constants;
+    peephole_t q;
+    int at[3];
+
+    if (body->count > INLINE_MAX || body->farCount > 0 || body->switchCount > 0) return false;
+
+    decode(&q, body);
+    int *depths = stackDepths(&q, body, callee->arity + 1);
+    int *consts = malloc((body->constants.count + 1) * sizeof(int));
+    int *added = malloc((body->constants.count + 1) * sizeof(int));
+    int addCount = 0, caches = 0, count = 0, size = 0;
+    int last = q.count - 1;
+    bool ok = depths != NULL;
+
+    for (int k = 0; k < body->constants.count; k++) consts[k] = -1;
+    while (ok && last >= 0 && depths[last] < 0) last--;
+
+    // Check the body and size it up.
+    for (int k = 0; ok && k < q.count; k++) {
+        insn_t *insn = &q.insns[k];
+        uint8_t *ip = &body->code[insn->offset];
+        int length = opcode_length(insn->opcode);
+        int c = constOperand(insn->opcode);
+
+        if (depths[k] < 0) {
+            insn->dead = true;
+            continue;
+        }
+
+        switch (insn->opcode) {
+            case OP_CALL: case OP_TAILCALL: case OP_CALL_NUM: case OP_LOOP: case OP_FORPREP:
+            case OP_FORLOOP: case OP_JTABLE: case OP_JHASH: case OP_CLOSURE: case OP_CLOSE:
+            case OP_ULD: case OP_UST: case OP_OLD: case OP_OST:
+                ok = false;
+                continue;
+            case OP_RET:
+                // At least the callee and the result are on the stack.
+                if (depths[k] < 2) ok = false;
+                if (depths[k] > 2) {
+                    count++;
+                    size += opcode_length(OP_DROP);
+                }
+                if (k != last) {
+                    count++;
+                    size += opcode_length(OP_JMP);
+                }
+                continue;
+            case OP_GET: case OP_SET:
+                caches++;
+                break;
+        }
+
+        for (int n = slotOperands(insn->opcode, at) - 1; n >= 0; n--) {
+            if (ip[at[n]] == 0 || base + ip[at[n]] - 1 > UINT8_MAX) ok = false;
+        }
+
+        if (c > 0) {
+            int index = insn->opcode == OP_CONST_W ? ip[1] << 8 | ip[2] : ip[c];
+
+            if (consts[index] < 0) consts[index] = findConstant(constants, body->constants.values[index]);
+            if (consts[index] < 0) {
+                consts[index] = constants->count + addCount;
+                added[addCount++] = index;
+            }
+
+            if (consts[index] > UINT16_MAX) ok = false;
+            else if (consts[index] > UINT8_MAX && insn->opcode == OP_CONST) length = 3;
+            else if (consts[index] > UINT8_MAX && insn->opcode != OP_CONST_W) ok = false;
+        }
+
+        count++;
+        size += length;
+    }
+
+    if (chunk->cacheCount + caches > UINT16_MAX + 1) ok = false;
+    if (!ok) {
+        release(&q);
+        free(depths);
+        free(consts);
+        free(added);
+        return false;
+    }
+
+    for (int k = 0; k < addCount; k++) arr_add(constants, body->constants.values[added[k]], true);
+
+    // Slots above the callee, used by bodies inlined into the arguments,
+    // move down with the arguments.
+    for (int i = load + 1; i < call; i++) {
+        uint8_t *ip = &chunk->code[p->insns[i].offset];
+        if (p->insns[i].dead) continue;
+
+        for (int k = slotOperands(p->insns[i].opcode, at) - 1; k >= 0; k--) {
+            if (ip[at[k]] > base) ip[at[k]]--;
+        }
+    }
+
+    // The body goes between the CALL and what follows it, so jumps to the
+    // CALL land on the body, once the load and the CALL are deleted.
+    int first = call + 1;
+    int after = first + count;
+    int pos = p->insns[call].pos;
+    int offset = appendCode(chunk, size);
+    int *map = malloc((q.count + 1) * sizeof(int));
+    insn_t *insns = malloc((p->count + count + 1) * sizeof(insn_t));
+
+    memcpy(insns, p->insns, first * sizeof(insn_t));
+    memcpy(&insns[after], &p->insns[first], (p->count - first) * sizeof(insn_t));
+
+    for (int i = 0; i < p->count + count; i++) {
+        bool moved = i < first || i >= after;
+        if (moved && insns[i].target > call) insns[i].target += count;
+    }
+    for (int t = 0; t < p->tableCount; t++) {
+        for (int j = 0; j <= chunk->switches[t].caseCount; j++) {
+            if (p->cases[t][j] > call) p->cases[t][j] += count;
+        }
+    }
+
+    int n = first;
+    for (int k = 0; k < q.count; k++) {
+        insn_t *from = &q.insns[k];
+        uint8_t *ip = &body->code[from->offset];
+        uint8_t *code = &chunk->code[offset];
+        int c = constOperand(from->opcode);
+
+        map[k] = n;
+        if (from->dead) continue;
+
+        if (from->opcode == OP_RET) {
+            if (depths[k] > 2) {
+                code[0] = OP_DROP;
+                code[1] = (uint8_t)(depths[k] - 2);
+                addInsn(insns, n++, offset, pos, OP_DROP);
+                offset += opcode_length(OP_DROP);
+                code += opcode_length(OP_DROP);
+            }
+            if (k != last) {
+                code[0] = OP_JMP;
+                addInsn(insns, n++, offset, pos, OP_JMP)->target = after;
+                offset += opcode_length(OP_JMP);
+            }
+            continue;
+        }
+
+        uint8_t opcode = from->opcode;
+        int length = opcode_length(opcode);
+        memcpy(code, ip, length);
+
+        for (int i = slotOperands(opcode, at) - 1; i >= 0; i--) {
+            code[at[i]] = (uint8_t)(base + ip[at[i]] - 1);
+        }
+
+        if (c > 0) {
+            int index = consts[opcode == OP_CONST_W ? ip[1] << 8 | ip[2] : ip[c]];
+
+            if (opcode == OP_CONST && index > UINT8_MAX) {
+                opcode = OP_CONST_W;
+                length = 3;
+            }
+            if (opcode == OP_CONST_W) {
+                code[1] = (index >> 8) & 0xff;
+                code[2] = index & 0xff;
+            }
+            else {
+                code[c] = (uint8_t)index;
+            }
+            code[0] = opcode;
+        }
+
+        if (opcode == OP_GET || opcode == OP_SET) {
+            int cache = chunk_cache(chunk);
+            code[2] = (cache >> 8) & 0xff;
+            code[3] = cache & 0xff;
+        }
+
+        addInsn(insns, n++, offset, pos, opcode);
+        offset += length;
+    }
+    map[q.count] = after;
+
+    for (int k = 0; k < q.count; k++) {
+        if (!q.insns[k].dead && q.insns[k].target != NO_TARGET) {
+            insns[map[k]].target = map[q.insns[k].target];
+        }
+    }
+
+    insns[load].dead = true;
+    insns[call].dead = true;
+    free(p->insns);
+    p->insns = insns;
+    p->count += count;
+
+    release(&q);
+    free(depths);
+    free(consts);
+    free(added);
+    free(map);
+    return true;
+}
+
+static void inlineCalls(peephole_t *p, chunk_t *chunk, inliner_t *inliner)
+{
+    int *depths = stackDepths(p, chunk, inliner->arity + 1);
+
+    for (int i = 0; depths != NULL && i < p->count; i++) {
+        insn_t *insn = &p->insns[i];
+        bool call = insn->opcode == OP_CALL || insn->opcode == OP_TAILCALL;
+        if (insn->dead || !call || depths[i] < 0) continue;
+
+        int argCount = chunk->code[insn->offset + 1];
+        int base = depths[i] - argCount - 1;
+        int load = base > 0 ? calleeLoad(p, chunk, depths, i, base) : -1;
+        if (load < 0) continue;
+
+        uint8_t *ip = &chunk->code[p->insns[load].offset];
+        int slot = p->insns[load].opcode == OP_GLD_W ? ip[1] << 8 | ip[2] : ip[1];
+        fun_t *callee = inliner->callee(inliner->context, slot, argCount);
+
+        if (callee != NULL && inlineBody(p, chunk, load, i, base, callee)) {
+            free(depths);
+            depths = stackDepths(p, chunk, inliner->arity + 1);
+        }
+    }
+
+    free(depths);
+}
+#endif
+
+// The long form of a jump: the test it needs, if any, a branch of the
+// opposite sense over the JMP_W and the JMP_W itself. The loop
+// instructions have wide forms of their own.
+static int farLength(uint8_t opcode)
+{
+    switch (opcode) {
+        case OP_JMP:
+            return 5;
+        case OP_FORPREP:
+            return opcode_length(OP_FORPREP_W);
+        case OP_FORLOOP:
+            return opcode_length(OP_FORLOOP_W);
+        case OP_LOOP:
+            return opcode_length(OP_LOOP_W);
+        case OP_JLT: case OP_JLE: case OP_JGT: case OP_JGE:
+            return 9;
+        default:
+            return 8;
+    }
+}
+
+static int length(insn_t *insn)
+{
+    return insn->far ? farLength(insn->opcode) : opcode_length(insn->opcode);
+}
+
+static void encodeLong(uint8_t *code, int32_t value)
+{
+    code[0] = ((uint32_t)value >> 24) & 0xff;
+    code[1] = (value >> 16) & 0xff;
+    code[2] = (value >> 8) & 0xff;
+    code[3] = value & 0xff;
+}
+
+// The long form of the jump at (ip) by (jump) bytes.
+static int encodeFar(uint8_t *code, const uint8_t *ip, uint8_t opcode, int jump)
+{
+    int at = 0;
+
+    if (opcode == OP_FORPREP || opcode == OP_FORLOOP) {
+        code[0] = opcode == OP_FORPREP ? OP_FORPREP_W : OP_FORLOOP_W;
+        code[1] = ip[1];
+        encodeLong(&code[2], jump * jumpSign(opcode));
+        return farLength(opcode);
+    }
+
+    if (opcode == OP_LOOP) {
+        code[0] = OP_LOOP_W;
+        code[1] = ip[1];
+        code[2] = ip[2];
+        encodeLong(&code[3], -jump);
+        return farLength(opcode);
+    }
+
+    switch (opcode) {
+        case OP_JMP:      break;
+        case OP_JMPF:     code[at++] = OP_JMPT; break;
+        case OP_JMPT:     code[at++] = OP_JMPF; break;
+        case OP_JMPF_POP: code[at++] = OP_JMPT_POP; break;
+        case OP_JMPT_POP: code[at++] = OP_JMPF_POP; break;
+        case OP_JEQ:      code[at++] = OP_JNE; break;
+        case OP_JNE:      code[at++] = OP_JEQ; break;
+        case OP_JLT:      code[at++] = OP_LT; code[at++] = OP_JMPT_POP; break;
+        case OP_JLE:      code[at++] = OP_LE; code[at++] = OP_JMPT_POP; break;
+        case OP_JGT:      code[at++] = OP_LE; code[at++] = OP_JMPF_POP; break;
+        case OP_JGE:      code[at++] = OP_LT; code[at++] = OP_JMPF_POP; break;
+    }
+
+    if (opcode != OP_JMP) {
+        code[at++] = 0;
+        code[at++] = 5;
+    }
+
+    code[at++] = OP_JMP_W;
+    encodeLong(&code[at], jump);
+    return at + 4;
+}
+
+// Lay out the live instructions, moving jumps that are out of range to
+// the long form until every jump fits. Jumps only ever grow, so this
+// settles after a few rounds.
+static int layout(peephole_t *p, int *offsets)
+{
+    bool changed = true;
+    int count = 0;
+
+    while (changed) {
+        changed = false;
+        count = 0;
+        for (int i = 0; i < p->count; i++) {
+            offsets[i] = count;
+            if (!p->insns[i].dead) count += length(&p->insns[i]);
+        }
+        offsets[p->count] = count;
+
+        for (int i = 0; i < p->count; i++) {
+            insn_t *insn = &p->insns[i];
+            if (insn->dead || insn->far || insn->target == NO_TARGET) continue;
+            int jump = (offsets[insn->target] - (offsets[i] + length(insn))) * jumpSign(insn->opcode);
+            if (jump < 0 || jump > UINT16_MAX) {
+                insn->far = true;
+                changed = true;
+            }
+        }
+    }
+
+    return count;
+}
+
+static void encode(peephole_t *p, chunk_t *chunk)
+{
+    int *offsets = malloc((p->count + 1) * sizeof(int));
+    int count = layout(p, offsets);
+    uint8_t *code = malloc(count + 1);
+    pos_t *positions = malloc((p->count + 1) * sizeof(pos_t));
+    int posCount = 0;
+    int from = 0;
+
+    for (int i = 0; i < p->count; i++) {
+        insn_t *insn = &p->insns[i];
+        int size = length(insn);
+        int at = offsets[i];
+
+        if (insn->dead) continue;
+
+        // Each instruction keeps the position of its first byte.
+        while (from + 1 < chunk->posCount && chunk->positions[from + 1].offset <= insn->pos) from++;
+        if (from < chunk->posCount) {
+            pos_t pos = chunk->positions[from];
+            if (posCount == 0 || positions[posCount - 1].line != pos.line ||
+                positions[posCount - 1].column != pos.column) {
+                pos.offset = at;
+                positions[posCount++] = pos;
+            }
+        }
+
+        if (insn->far) {
+            encodeFar(&code[at], &chunk->code[insn->offset], insn->opcode, offsets[insn->target] - (at + size));
+            continue;
+        }
+
+        memcpy(&code[at], &chunk->code[insn->offset], size);
+        code[at] = insn->opcode;
+
+        if (insn->target != NO_TARGET) {
+            int jump = (offsets[insn->target] - (at + size)) * jumpSign(insn->opcode);
+            code[at + jumpOperand(insn->opcode)] = (jump >> 8) & 0xff;
+            code[at + jumpOperand(insn->opcode) + 1] = jump & 0xff;
+        }
+
+        for (int j = 0; j < caseCount(p, chunk, insn); j++) {
+            int target = p->cases[insn->table][j];
+            chunk->switches[insn->table].targets[j] = target == NO_TARGET ? 0 : offsets[live(p, target)];
+        }
+    }
+
+    free(chunk->farJumps);
+    chunk->farJumps = NULL;
+    chunk->farCount = 0;
+
+    free(chunk->code);
+    free(chunk->positions);
+    chunk->code = code;
+    chunk->positions = positions;
+    chunk->posCount = posCount;
+    chunk->posCapacity = p->count + 1;
+    chunk->count = chunk->capacity = count;
+    free(offsets);
+}
+
+void chunk_optimize(chunk_t *chunk, peep_t *saved, inliner_t *inliner)
+{
+    peephole_t peephole;
+    peephole_t *p = &peephole;
+    bool changed = true;
+    int before = chunk->count;
+
+    if (chunk->count == 0) return;
+    decode(p, chunk);
+
+#ifdef INLINE_CALLS
+    if (inliner != NULL) inlineCalls(p, chunk, inliner);
+#endif
+
+#ifndef PEEPHOLE
+    changed = false;
+#endif
+    while (changed) {
+        changed = false;
+        markTargets(p, chunk);
+
+        for (int i = 0; i < p->count; i++) {
+            insn_t *insn = &p->insns[i];
+            if (insn->dead) continue;
+
+            if (insn->target != NO_TARGET) {
+                changed |= threadJump(p, insn);
+                if (insn->opcode == OP_JMPF || insn->opcode == OP_JMPT) {
+                    changed |= threadPop(p, i);
+                }
+            }
+            changed |= rewritePair(p, i);
+        }
+
+        markTargets(p, chunk);
+        changed |= removeUnreachable(p, chunk);
+    }
+
+    int removed = 0;
+    for (int i = 0; i < p->count; i++) removed += p->insns[i].dead;
+
+    encode(p, chunk);
+
+    if (saved != NULL) {
+        saved->bytes += before - chunk->count;
+        saved->dispatches += removed + p->dispatches;
+    }
+
+    release(p);
+}
@@ -74,6 +74,18 @@ bool val_equal(val_t a, val_t b)
     }
 }
 
+int native_check(const native_t *native, int argCount, val_t *args)
+{
+    if (native->arity >= 0 && argCount != native->arity) return -1;
+
+    uint32_t numbers = native->numbers;
+    for (int i = 0; numbers != 0 && i < argCount; i++, numbers >>= 1) {
+        if ((numbers & 1) && !IS_NUM(args[i])) return i + 1;
+    }
+
+    return 0;
+}
+
 void arr_init(arr_t *array)
 {
     array->count = 0;
@@ -113,7 +125,7 @@ str_t cast_string(tab_t *pool, val_t value)
 
 val_t cast_num(val_t value)
 {
-    switch (value.type) {
+    switch (AS_TYPE(value)) {
         case VT_BOOL:
             return VAL_NUM((char)AS_BOOL(value));
         case VT_NUM:
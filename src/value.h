@@ -7,6 +7,21 @@ typedef struct _str str_t;
 typedef struct _fun fun_t;
 typedef struct _upv upv_t;
 typedef struct _map map_t;
+typedef struct _shp shp_t;
+
+// What a native function promises about itself. VAL_CFN values point at
+// one, so a call can check the arguments before the native runs, and
+// call it over unboxed numbers if it has that form.
+typedef struct {
+    cfn_t function;
+    int arity;              // -1 for any number of arguments
+    uint32_t numbers;       // bit i set if argument i must be a number
+    bool pure;              // no side effects, the result depends only on the arguments
+    union {
+        double (*unary)(double);
+        double (*binary)(double, double);
+    } direct;               // picked by (arity), NULL if there is none
+} native_t;
 
 typedef enum {
     VT_NULL_,
@@ -25,6 +40,7 @@ typedef enum {
     OT_FUN,
     OT_UPV,
     OT_MAP,
+    OT_SHP,
 } otype_t;
 
 enum {
@@ -52,28 +68,105 @@ enum {
     VT_PTR_PTR      = CMB_BYTES(VT_PTR, VT_PTR)
 };
 
+#ifdef NAN_BOXING
+
+// Doubles are stored as-is, everything else lives in the payload of a
+// quiet NaN. Objects, natives and raw pointers set the sign bit and use
+// bits 48-49 as a sub-tag; null and booleans are small singletons.
+#define SIGN_BIT        ((uint64_t)0x8000000000000000)
+#define QNAN            ((uint64_t)0x7ffc000000000000)
+#define TAG_CFN         ((uint64_t)0x0001000000000000)
+#define TAG_PTR         ((uint64_t)0x0002000000000000)
+#define TAG_MASK        (SIGN_BIT | QNAN | TAG_CFN | TAG_PTR)
+#define PAYLOAD_MASK    ((uint64_t)0x0000ffffffffffff)
+
+#define RAW_NULL        (QNAN | 1)
+#define RAW_FALSE       (QNAN | 2)
+#define RAW_TRUE        (QNAN | 3)
+#define RAW_UNDEF       (QNAN | 4)
+#define RAW_OBJ         (SIGN_BIT | QNAN)
+#define RAW_CFN         (SIGN_BIT | QNAN | TAG_CFN)
+#define RAW_PTR         (SIGN_BIT | QNAN | TAG_PTR)
+
+struct _val {
+    union {
+        double Num;
+        uint64_t Raw;
+    };
+};
+
+static const val_t VAL_NULL = { .Raw = RAW_NULL };
+static const val_t VAL_TRUE = { .Raw = RAW_TRUE };
+static const val_t VAL_FALSE = { .Raw = RAW_FALSE };
+static const val_t VAL_NULLPTR = { .Raw = RAW_PTR };
+static const val_t VAL_UNDEF = { .Raw = RAW_UNDEF };
+
+#define VAL_RAW(r)      ((val_t){ .Raw = (r) })
+#define VAL_BOOL(b)     VAL_RAW((b) ? RAW_TRUE : RAW_FALSE)
+#define VAL_NUM(n)      ((val_t){ .Num = (n) })
+#define VAL_OBJ(o)      VAL_RAW(RAW_OBJ | (uint64_t)(uintptr_t)(o))
+#define VAL_CFN(c)      VAL_RAW(RAW_CFN | (uint64_t)(uintptr_t)(c))
+#define VAL_PTR(p)      VAL_RAW(RAW_PTR | (uint64_t)(uintptr_t)(p))
+
+#define AS_BOOL(v)      (AS_RAW(v) == RAW_TRUE)
+#define AS_NUM(v)       ((v).Num)
+#define AS_OBJ(v)       ((obj_t *)(uintptr_t)(AS_RAW(v) & PAYLOAD_MASK))
+#define AS_CFN(v)       ((const native_t *)(uintptr_t)(AS_RAW(v) & PAYLOAD_MASK))
+#define AS_PTR(v)       ((void *)(uintptr_t)(AS_RAW(v) & PAYLOAD_MASK))
+
+#define IS_NULL(v)      (AS_RAW(v) == RAW_NULL)
+#define IS_BOOL(v)      ((AS_RAW(v) | 1) == RAW_TRUE)
+#define IS_NUM(v)       ((AS_RAW(v) & QNAN) != QNAN)
+#define IS_OBJ(v)       ((AS_RAW(v) & TAG_MASK) == RAW_OBJ)
+#define IS_CFN(v)       ((AS_RAW(v) & TAG_MASK) == RAW_CFN)
+#define IS_PTR(v)       ((AS_RAW(v) & TAG_MASK) == RAW_PTR)
+#define IS_UNDEF(v)     (AS_RAW(v) == RAW_UNDEF)
+
+#define AS_RAW(v)       ((v).Raw)
+#define AS_TYPE(v)      val_type(v)
+
+static inline vtype_t val_type(val_t value)
+{
+    uint64_t raw = AS_RAW(value);
+
+    if ((raw & QNAN) != QNAN) return VT_NUM;
+    switch (raw & TAG_MASK) {
+        case RAW_OBJ: return VT_OBJ;
+        case RAW_CFN: return VT_CFN;
+        case RAW_PTR: return VT_PTR;
+    }
+    return (raw | 1) == RAW_TRUE ? VT_BOOL : VT_NULL;
+}
+
+// Same truth table as the tagged layout: null, false, +0.0 and a null
+// raw pointer are falsey.
+static inline bool val_falsey(val_t value)
+{
+    uint64_t raw = AS_RAW(value);
+    return raw == 0 || raw == RAW_FALSE || raw == RAW_NULL || raw == RAW_PTR;
+}
+
+#define IS_FALSEY(v)    val_falsey(v)
+
+#else
+
 struct _val {
     vtype_t type;
     union {
         bool Bool : 1;
         double Num;
-        cfn_t CFn;
+        const native_t *CFn;
         obj_t *Obj;
         void *Ptr;
         uint64_t Raw;
     };
 };
 
-typedef struct {
-    int count;
-    int capacity;
-    val_t *values;
-} arr_t;
-
 static const val_t VAL_NULL = { .type = VT_NULL, .Raw = 0 };
 static const val_t VAL_TRUE = { .type = VT_BOOL, .Bool = true };
 static const val_t VAL_FALSE = { .type = VT_BOOL, .Bool = false };
 static const val_t VAL_NULLPTR = { .type = VT_PTR, .Ptr = NULL };
+static const val_t VAL_UNDEF = { .type = VT_NULL, .Raw = 1 };
 
 #define VAL_BOOL(b)     ((val_t){ .type = VT_BOOL, .Bool = (b) })
 #define VAL_NUM(n)      ((val_t){ .type = VT_NUM, .Num = (n) })
@@ -93,17 +186,45 @@ static const val_t VAL_NULLPTR = { .type = VT_PTR, .Ptr = NULL };
 #define IS_OBJ(v)       (AS_TYPE(v) == VT_OBJ)
 #define IS_CFN(v)       (AS_TYPE(v) == VT_CFN)
 #define IS_PTR(v)       (AS_TYPE(v) == VT_PTR)
+#define IS_UNDEF(v)     (IS_NULL(v) && AS_RAW(v) != 0)
 
-#define AS_INT(v)       ((int)AS_NUM(v))
-#define AS_INT64(v)     ((int64_t)AS_NUM(v))
 #define AS_RAW(v)       ((v).Raw)
 #define AS_TYPE(v)      ((v).type)
 
 #define IS_FALSEY(v)    (!(bool)AS_RAW(v))
 
+#endif
+
+#define AS_INT(v)       ((int)AS_NUM(v))
+#define AS_INT64(v)     ((int64_t)AS_NUM(v))
+
+// Read two number/boolean operands as doubles, false if either is not.
+static inline bool val_tonums(val_t a, val_t b, double *x, double *y)
+{
+    if (IS_NUM(a)) *x = AS_NUM(a);
+    else if (IS_BOOL(a)) *x = AS_BOOL(a);
+    else return false;
+
+    if (IS_NUM(b)) *y = AS_NUM(b);
+    else if (IS_BOOL(b)) *y = AS_BOOL(b);
+    else return false;
+
+    return true;
+}
+
+typedef struct {
+    int count;
+    int capacity;
+    val_t *values;
+} arr_t;
+
 void val_print(val_t value);
 bool val_equal(val_t a, val_t b);
 
+// 0 if (native) takes (args), -1 if their count is wrong, or 1 + the
+// index of the first that is not the number it asks for.
+int native_check(const native_t *native, int argCount, val_t *args);
+
 void arr_init(arr_t *array);
 void arr_free(arr_t *array);
 int arr_add(arr_t *array, val_t value, bool allowdup);
@@ -8,14 +8,91 @@
 #include "value.h"
 #include "code.h"
 #include "object.h"
+#include "jit.h"
+#include "cache.h"
+
+#ifdef PROFILE_OPCODES
+// Counts of adjacent opcode pairs, used to pick superinstructions.
+static uint64_t opcodePairs[MAX_OPCODES][MAX_OPCODES];
+static uint64_t opcodeTotal;
+static int lastOpcode = -1;
+
+static inline int profileOpcode(int opcode)
+{
+    opcodeTotal++;
+    if (lastOpcode >= 0) opcodePairs[lastOpcode][opcode]++;
+    lastOpcode = opcode;
+    return opcode;
+}
+
+static void dumpOpcodePairs()
+{
+    fprintf(stderr, "== %llu instructions, top opcode pairs ==\n",
+        (unsigned long long)opcodeTotal);
+
+    for (int n = 0; n < 20; n++) {
+        uint64_t best = 0;
+        int first = 0, second = 0;
+
+        for (int i = 0; i < MAX_OPCODES; i++) {
+            for (int j = 0; j < MAX_OPCODES; j++) {
+                if (opcodePairs[i][j] > best) {
+                    best = opcodePairs[i][j];
+                    first = i;
+                    second = j;
+                }
+            }
+        }
+
+        if (best == 0) break;
+        fprintf(stderr, "%-10s %-10s %llu\n", opcode_tostr(first),
+            opcode_tostr(second), (unsigned long long)best);
+        opcodePairs[first][second] = 0;
+    }
+}
+
+#define PROFILE(op)     profileOpcode(op)
+#else
+#define PROFILE(op)     (op)
+#endif
 
 static void resetStack(vm_t *vm)
 {
     vm->top = vm->stack;
     vm->frameCount = 0;
+    vm->openUpvalues = NULL;
+}
+
+static void initStack(vm_t *vm)
+{
+    vm->stackSize = FRAMES_MIN * UINT8_COUNT;
+    vm->stack = malloc(vm->stackSize * sizeof(val_t));
+    vm->frameCapacity = FRAMES_MIN;
+    vm->frames = malloc(vm->frameCapacity * sizeof(frame_t));
+    vm->maxFrames = FRAMES_MAX;
+    resetStack(vm);
+}
+
+static void traceFrame(frame_t *frame)
+{
+    fun_t *function = frame->function;
+    // -1 because the IP is sitting on the next instruction to be
+    // executed.                                                 
+    size_t instruction = frame->ip - function->chunk.code - 1;
+    chunk_t *chunk = &frame->function->chunk;
+    const char *fname = chunk->source->fname;
+    int line, column;
+    chunk_position(chunk, (int)instruction, &line, &column);
+    fprintf(stderr, "[%s:%d:%d] in ", fname, line, column);
+    if (function->name == NULL) {
+        fprintf(stderr, "script\n");
+    }
+    else {
+        fprintf(stderr, "%s()\n", function->name->chars);
+    }
 }
 
-static void runtimeError(vm_t *vm, const char *format, ...)
+void vm_error(vm_t *vm, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
@@ -25,22 +102,11 @@ static void runtimeError(vm_t *vm, const char *format, ...)
     fputs("\n", stderr);
 
     for (int i = vm->frameCount - 1; i >= 0; i--) {
-        frame_t *frame = &vm->frames[i];
-        fun_t *function = frame->function;
-        // -1 because the IP is sitting on the next instruction to be
-        // executed.                                                 
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        chunk_t *chunk = &frame->function->chunk;
-        const char *fname = chunk->source->fname;
-        int line = chunk->lines[instruction];
-        int column = chunk->columns[instruction];
-        fprintf(stderr, "[%s:%d:%d] in ", fname, line, column);
-        if (function->name == NULL) {
-            fprintf(stderr, "script\n");
-        }
-        else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+        if (i == vm->frameCount - 1 - TRACE_FRAMES && i > TRACE_FRAMES) {
+            fprintf(stderr, "... %d more frames\n", i + 1 - TRACE_FRAMES);
+            i = TRACE_FRAMES - 1;
         }
+        traceFrame(&vm->frames[i]);
     }
 
     fflush(stderr);
@@ -55,13 +121,17 @@ vm_t *vm_create()
     memset(vm, '\0', sizeof(vm_t));
     vm->gc = malloc(sizeof(gc_t));
     vm->globals = malloc(sizeof(tab_t));
+    vm->globalValues = malloc(sizeof(arr_t));
     vm->strings = malloc(sizeof(tab_t));
 
     gc_init(vm->gc);
     tab_init(vm->globals);
+    arr_init(vm->globalValues);
     tab_init(vm->strings);
+    hash_init(&vm->stores);
 
-    resetStack(vm);
+    initStack(vm);
+    vm->emptyShape = shp_new(vm, NULL, NULL);
     return vm;
 }
 
@@ -69,14 +139,23 @@ void vm_close(vm_t *vm)
 {
     if (vm == NULL) return;
 
+#ifdef PROFILE_OPCODES
+    dumpOpcodePairs();
+#endif
+
     tab_free(vm->globals);
+    arr_free(vm->globalValues);
     tab_free(vm->strings);
+    hash_free(&vm->stores);
     gc_free(vm->gc);
 
     free(vm->globals);
+    free(vm->globalValues);
     free(vm->strings);
     free(vm->gc);
 
+    free(vm->stack);
+    free(vm->frames);
     free(vm);
 }
 
@@ -88,10 +167,14 @@ vm_t *vm_clone(vm_t *from)
     memset(vm, '\0', sizeof(vm_t));
 
     vm->gc = from->gc;
+    vm->emptyShape = from->emptyShape;
     vm->globals = from->globals;
+    vm->globalValues = from->globalValues;
     vm->strings = from->strings;
+    hash_copy(&vm->stores, &from->stores);
 
-    resetStack(vm);
+    initStack(vm);
+    vm->maxFrames = from->maxFrames;
     return vm;
 }
 
@@ -100,16 +183,31 @@ vm_t *vm_clone(vm_t *from)
 #define POPN(n)     *((vm)->top -= (n))
 #define PEEK(i)     ((vm)->top[-1 - (i)])
 
-static void defineNative(vm_t *vm, const char *name, cfn_t function)
+static void defineNative(vm_t *vm, const char *name, const native_t *function)
 {
     val_t native = VAL_CFN(function);
     val_t gname = VAL_OBJ(str_copy(vm, name, (int)strlen(name), true));
 
     PUSH(gname);
-    tab_set(vm->globals, AS_STR(gname), native);
+    int slot = vm_global(vm, AS_STR(gname));
+    vm->globalValues->values[slot] = native;
     POP();
 }
 
+str_t *vm_global_name(vm_t *vm, int slot)
+{
+    tab_t *globals = vm->globals;
+
+    for (int i = 0; i < globals->capacity; i++) {
+        ent_t *entry = &globals->entries[i];
+        if (entry->key != NULL && AS_INT(entry->value) == slot) {
+            return entry->key;
+        }
+    }
+
+    return NULL;
+}
+
 static val_t clockNative(vm_t *vm, int argc, val_t *args)
 {
     return VAL_NUM((double)clock() / CLOCKS_PER_SEC);
@@ -130,27 +228,184 @@ static void concatenate(vm_t *vm)
     PUSH(VAL_OBJ(result));
 }
 
-static bool prepareCall(vm_t *vm, fun_t *function, int argCount)
+// Slow path of the fused additions: the two operands are on the stack.
+bool vm_add(vm_t *vm)
+{
+    double a, b;
+
+    if (IS_STR(PEEK(0)) && IS_STR(PEEK(1))) {
+        concatenate(vm);
+        return true;
+    }
+
+    if (!val_tonums(PEEK(1), PEEK(0), &a, &b)) return false;
+
+    vm->top -= 2;
+    PUSH(VAL_NUM(a + b));
+    return true;
+}
+
+static inline icway_t *cacheLookup(icache_t *cache, shp_t *shape)
+{
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->ways[i].shape == shape) return &cache->ways[i];
+    }
+
+    return NULL;
+}
+
+static void cacheUpdate(icache_t *cache, shp_t *shape, shp_t *target, int slot)
+{
+    // Sites that see more than IC_WAYS shapes stay on the slow path.
+    if (shape == NULL || cache->count == IC_WAYS) return;
+
+    icway_t *way = &cache->ways[cache->count++];
+    way->shape = shape;
+    way->target = target;
+    way->slot = slot;
+}
+
+// Field (name) of (map) through the inline cache of its OP_GET site.
+val_t vm_getfield(map_t *map, str_t *name, icache_t *cache)
+{
+    icway_t *way = cacheLookup(cache, map->shape);
+    val_t value = VAL_NULL;
+
+    if (way != NULL) {
+        value = map->fields[way->slot];
+    }
+    else if (map_get(map, name, &value) && map->shape != NULL) {
+        cacheUpdate(cache, map->shape, NULL, shp_slot(map->shape, name));
+    }
+    return value;
+}
+
+// Set field (name) of (map) through the inline cache of its OP_SET site.
+void vm_setfield(vm_t *vm, map_t *map, str_t *name, icache_t *cache, val_t value)
+{
+    icway_t *way = cacheLookup(cache, map->shape);
+
+    if (way != NULL && way->target == NULL) {
+        map->fields[way->slot] = value;
+    }
+    else if (way != NULL && way->target->count <= map->capacity) {
+        map->fields[way->slot] = value;
+        map->shape = way->target;
+    }
+    else {
+        shp_t *shape = map->shape;
+        map_put(vm, map, name, value);
+        if (way == NULL && map->shape != NULL) {
+            cacheUpdate(cache, shape, shape == map->shape ? NULL : map->shape,
+                shp_slot(map->shape, name));
+        }
+    }
+}
+
+// Make room for (count) more values over the top of the stack. Moving it
+// fixes up the pointers the VM keeps into it, the top, the frame slots
+// and the open upvalues; code holding any other reloads it after a call.
+bool vm_reserve(vm_t *vm, int count)
+{
+    int used = (int)(vm->top - vm->stack);
+    if (used + count <= vm->stackSize) return true;
+
+    int size = vm->stackSize;
+    while (size < used + count) size *= 2;
+
+    val_t *stack = malloc(size * sizeof(val_t));
+    if (stack == NULL) return false;
+    memcpy(stack, vm->stack, used * sizeof(val_t));
+
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+    for (upv_t *upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+
+    free(vm->stack);
+    vm->top = stack + used;
+    vm->stack = stack;
+    vm->stackSize = size;
+    return true;
+}
+
+// Room for one more frame and its slots.
+static bool reserveFrame(vm_t *vm)
+{
+    if (vm->frameCount == vm->frameCapacity) {
+        int capacity = GROW_CAP(vm->frameCapacity);
+        frame_t *frames = realloc(vm->frames, capacity * sizeof(frame_t));
+        if (frames == NULL) return false;
+
+        vm->frames = frames;
+        vm->frameCapacity = capacity;
+    }
+
+    return vm->top + UINT8_COUNT <= vm->stack + vm->stackSize || vm_reserve(vm, UINT8_COUNT);
+}
+
+// The work on the way into (function) that every call does, once the
+// checks in readyCall() passed: room for its frame, which a tail call
+// does not need, and the count of its calls.
+static bool enterCall(vm_t *vm, fun_t *function, bool tail)
+{
+    if (!tail && (vm->frameCount == vm->maxFrames || !reserveFrame(vm))) {
+        vm_error(vm, "Stack overflow.");
+        return false;
+    }
+
+#ifdef JIT
+    // Closures share the native code of their prototype.
+    fun_t *code = fun_code(function);
+    if (++code->calls == JIT_THRESHOLD && code->jit == NULL) jit_compile(vm, code);
+    function->jit = code->jit;
+#endif
+    return true;
+}
+
+// Checks a call into (function) has to pass, and the work on its way in.
+static bool readyCall(vm_t *vm, fun_t *function, int argCount, bool tail)
 {
     if (argCount != function->arity) {
-        runtimeError(vm, "Expected %d arguments but got %d.",
+        vm_error(vm, "Expected %d arguments but got %d.",
             function->arity, argCount);
         return false;
     }
 
-    if (vm->frameCount == FRAMES_MAX) {
-        runtimeError(vm, "Stack overflow.");
+    if (function->body >= 0 && !compile_lazy(vm, function)) {
+        vm_error(vm, "Function '%s' does not compile.", function->name->chars);
         return false;
     }
 
+    return enterCall(vm, function, tail);
+}
+
+static void pushFrame(vm_t *vm, fun_t *function, int argCount)
+{
     frame_t *frame = &vm->frames[vm->frameCount++];
     frame->function = function;
     frame->ip = function->chunk.code;
 
     frame->slots = vm->top - argCount - 1;
+}
+
+static bool prepareCall(vm_t *vm, fun_t *function, int argCount)
+{
+    if (!readyCall(vm, function, argCount, false)) return false;
+
+    pushFrame(vm, function, argCount);
     return true;
 }
 
+static void callNative(vm_t *vm, const native_t *native, int argCount)
+{
+    val_t result = native->function(vm, argCount, vm->top - argCount);
+    vm->top -= argCount + 1;
+    PUSH(result);
+}
+
 bool vm_call(vm_t *vm, val_t callee, int argCount)
 {
     if (IS_OBJ(callee)) {
@@ -164,24 +419,196 @@ bool vm_call(vm_t *vm, val_t callee, int argCount)
         }
     }
     else if (IS_CFN(callee)) {
-        cfn_t native = AS_CFN(callee);
-        val_t result = native(vm, argCount, vm->top - argCount);
-        vm->top -= argCount + 1;
-        PUSH(result);
+        const native_t *native = AS_CFN(callee);
+        int bad = native_check(native, argCount, vm->top - argCount);
+
+        if (bad < 0) {
+            vm_error(vm, "Expected %d arguments but got %d.", native->arity, argCount);
+            return false;
+        }
+        if (bad > 0) {
+            vm_error(vm, "Argument %d must be a number.", bad);
+            return false;
+        }
+
+        callNative(vm, native, argCount);
         return true;
     }
 
-    runtimeError(vm, "Can only call functions and classes.");
+    vm_error(vm, "Can only call functions and classes.");
     return false;
 }
 
+// vm_call() through the cache of an OP_CALL site. The callee the site saw
+// last goes straight to its frame or its native, past the checks it
+// passed then; a native over numbers still checks its arguments. Any
+// other callee makes a full call and takes its place, until the site
+// turns megamorphic and only makes full calls.
+bool vm_callsite(vm_t *vm, callsite_t *site, int argCount)
+{
+    val_t callee = PEEK(argCount);
+
+    switch (site->kind) {
+        case SITE_FUN:
+            if (IS_FUN(callee) && fun_code(AS_FUN(callee)) == site->target) {
+                if (!enterCall(vm, AS_FUN(callee), false)) return false;
+                pushFrame(vm, AS_FUN(callee), argCount);
+                return true;
+            }
+            break;
+        case SITE_NATIVE:
+            if (IS_CFN(callee) && AS_CFN(callee) == site->target && (AS_CFN(callee)->numbers == 0 ||
+                native_check(AS_CFN(callee), argCount, vm->top - argCount) == 0)) {
+                callNative(vm, AS_CFN(callee), argCount);
+                return true;
+            }
+            break;
+        case SITE_MEGA:
+            return vm_call(vm, callee, argCount);
+    }
+
+    if (!vm_call(vm, callee, argCount)) return false;
+
+    if (site->kind != SITE_EMPTY && ++site->misses == SITE_MISSES) {
+        site->kind = SITE_MEGA;
+    }
+    else if (IS_FUN(callee)) {
+        site->kind = SITE_FUN;
+        site->target = fun_code(AS_FUN(callee));
+    }
+    else {
+        site->kind = SITE_NATIVE;
+        site->target = AS_CFN(callee);
+    }
+    return true;
+}
+
+// Call the script function below the (argCount) arguments on top of the
+// stack in place of the function running in the top frame: the callee
+// and its arguments move down over that frame, which starts over in the
+// callee. Frames and stack stay the same size however deep tail calls go.
+bool vm_tailcall(vm_t *vm, int argCount)
+{
+    fun_t *function = AS_FUN(PEEK(argCount));
+    frame_t *frame = &vm->frames[vm->frameCount - 1];
+
+    if (!readyCall(vm, function, argCount, true)) return false;
+
+    vm_closeupvalues(vm, frame->slots);
+    memmove(frame->slots, vm->top - argCount - 1, (argCount + 1) * sizeof(val_t));
+    vm->top = frame->slots + argCount + 1;
+    frame->function = function;
+    frame->ip = function->chunk.code;
+    return true;
+}
+
+// The upvalue over (slot), shared by the closures that capture it while
+// it is open. The open ones are kept sorted from the top of the stack.
+static upv_t *captureUpvalue(vm_t *vm, val_t *slot)
+{
+    upv_t *previous = NULL;
+    upv_t *upvalue = vm->openUpvalues;
+
+    while (upvalue != NULL && upvalue->location > slot) {
+        previous = upvalue;
+        upvalue = upvalue->next;
+    }
+    if (upvalue != NULL && upvalue->location == slot) return upvalue;
+
+    upv_t *created = upv_new(vm, slot);
+    created->next = upvalue;
+    if (previous == NULL) vm->openUpvalues = created;
+    else previous->next = created;
+    return created;
+}
+
+// Close the upvalues over (last) and the slots above it: each takes the
+// value out of the stack before the slot goes away.
+void vm_closeupvalues(vm_t *vm, val_t *last)
+{
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        upv_t *upvalue = vm->openUpvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        vm->openUpvalues = upvalue->next;
+    }
+}
+
+// Push a closure of (proto) for the function running in the top frame,
+// capturing its locals and passing on its upvalues.
+void vm_closure(vm_t *vm, fun_t *proto)
+{
+    frame_t *frame = &vm->frames[vm->frameCount - 1];
+    fun_t *closure = fun_closure(vm, proto);
+
+    PUSH(VAL_OBJ(closure));
+    for (int i = 0; i < proto->upvalueCount; i++) {
+        uint8_t index = proto->captures[i * 2 + 1];
+
+        if (proto->captures[i * 2]) closure->upvalues[i] = captureUpvalue(vm, &frame->slots[index]);
+        else closure->upvalues[i] = frame->function->upvalues[index];
+    }
+}
+
+// Slot (slot) of the function declared (level) functions out of the one
+// in the top frame. That one can not escape them, so each is running in
+// the nearest frame below that runs it.
+val_t *vm_outer(vm_t *vm, int level, int slot)
+{
+    frame_t *frame = &vm->frames[vm->frameCount - 1];
+    fun_t *function = frame->function;
+
+    while (level-- > 0) {
+        fun_t *outer = function->outer;
+        do frame--; while (frame->function != outer && frame->function->proto != outer);
+        function = frame->function;
+    }
+    return &frame->slots[slot];
+}
+
+// Call the native under the (argCount) arguments on top of the stack
+// over unboxed numbers if it has that form and they are all numbers,
+// false if not.
+bool vm_calldirect(vm_t *vm, int argCount)
+{
+    val_t callee = PEEK(argCount);
+    if (!IS_CFN(callee)) return false;
+
+    const native_t *native = AS_CFN(callee);
+    double result;
+
+    if (native->arity != argCount || native->direct.unary == NULL) return false;
+
+    switch (argCount) {
+        case 1:
+            if (!IS_NUM(PEEK(0))) return false;
+            result = native->direct.unary(AS_NUM(PEEK(0)));
+            break;
+        case 2:
+            if (!IS_NUM(PEEK(0)) || !IS_NUM(PEEK(1))) return false;
+            result = native->direct.binary(AS_NUM(PEEK(1)), AS_NUM(PEEK(0)));
+            break;
+        default:
+            return false;
+    }
+
+    vm->top -= argCount + 1;
+    PUSH(VAL_NUM(result));
+    return true;
+}
+
 int vm_execute(vm_t *vm)
 {
     register uint8_t *ip;
     register val_t *stack;
     register val_t *consts;
+    register val_t *globals;
     register frame_t *frame;
 
+    // Returning from frame (base) hands control back to the caller; this
+    // is 0 for a script and deeper when compiled code calls back in here.
+    int base = vm->frameCount - 1;
+
 #define STORE_FRAME() \
     frame->ip = ip
 
@@ -189,22 +616,159 @@ int vm_execute(vm_t *vm)
     frame = &vm->frames[vm->frameCount - 1]; \
 	ip = frame->ip; \
     stack = frame->slots; \
-    consts = frame->function->chunk.constants.values
+    consts = frame->function->chunk.constants.values; \
+    globals = vm->globalValues->values
 
 #define STACK           (stack)
 #define CONSTS          (consts)
+#define GLOBALS         (globals)
 
 #define PREV_BYTE()     (ip[-1])
 #define READ_BYTE()     *(ip++)
 #define READ_SHORT()    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG()     (ip += 4, (int32_t)((uint32_t)ip[-4] << 24 | ip[-3] << 16 | ip[-2] << 8 | ip[-1]))
 
 #define READ_CONST()    CONSTS[READ_BYTE()]
 #define READ_STR()      AS_STR(READ_CONST())
+#define READ_CACHE()    (&frame->function->chunk.caches[READ_SHORT()])
+#define READ_SITE()     (&frame->function->chunk.calls[READ_SHORT()])
+#define PEEK_SITE()     (&frame->function->chunk.calls[ip[1] << 8 | ip[2]])
+
+// Rewrite the current instruction in place, once it saw enough operands
+// that fit (op), see quick_t. A specialized form that sees operands it
+// was not made for goes back to its generic opcode and re-dispatches.
+// Closures run the code of their prototype and count there.
+#define QUICK_SITE()    chunk_quick(&fun_code(frame->function)->chunk, ip - 1)
+#define QUICKEN(op) \
+    do { \
+        quick_t *quick = QUICK_SITE(); \
+        if (quick->deopts < QUICK_DEOPTS && ++quick->hits == QUICK_HITS) ip[-1] = (op); \
+    } while (0)
+#define DEOPT(op) \
+    do { \
+        quick_t *quick = QUICK_SITE(); \
+        quick->hits = 0; \
+        quick->deopts++; \
+        *--ip = (op); \
+        NEXT; \
+    } while (0)
+
+#define BINARY_NN(generic, type, op) \
+    do { \
+        if (IS_NUM(PEEK(0)) && IS_NUM(PEEK(1))) { \
+            double b = AS_NUM(POP()); \
+            double a = AS_NUM(POP()); \
+            PUSH(type(a op b)); \
+            NEXT; \
+        } \
+        DEOPT(generic); \
+    } while (0)
+
+// Three-address arithmetic on frame slots; (rhs) reads the second operand.
+#define ARITH_R(op, rhs) \
+    do { \
+        uint8_t dst = READ_BYTE(); \
+        val_t a = STACK[READ_BYTE()]; \
+        val_t b = rhs; \
+        double x, y; \
+        if (!val_tonums(a, b, &x, &y)) { \
+            ERROR("Operands must be two numbers/booleans."); \
+        } \
+        STACK[dst] = VAL_NUM(x op y); \
+        NEXT; \
+    } while (0)
+
+#define ADD_R(rhs) \
+    do { \
+        uint8_t dst = READ_BYTE(); \
+        val_t a = STACK[READ_BYTE()]; \
+        val_t b = rhs; \
+        if (IS_NUM(a) && IS_NUM(b)) { \
+            STACK[dst] = VAL_NUM(AS_NUM(a) + AS_NUM(b)); \
+            NEXT; \
+        } \
+        PUSH(a); \
+        PUSH(b); \
+        if (!vm_add(vm)) { \
+            ERROR("Operands must be two numbers/booleans/strings."); \
+        } \
+        STACK[dst] = POP(); \
+        NEXT; \
+    } while (0)
+
+// Pop two operands and take the branch when the comparison does not hold.
+#define JUMP_WHEN(cond) \
+    do { \
+        uint16_t offset = READ_SHORT(); \
+        double a, b; \
+        if (!val_tonums(PEEK(1), PEEK(0), &a, &b)) { \
+            ERROR("Operands must be two numbers/booleans."); \
+        } \
+        vm->top -= 2; \
+        if (cond) ip += offset; \
+        NEXT; \
+    } while (0)
+
+#define JUMP_UNLESS(op) JUMP_WHEN(!(a op b))
+#define JUMP_IF(op)     JUMP_WHEN(a op b)
+
+// The counted loop instructions, past their operands.
+#define FOR_PREP(slot, offset) \
+    do { \
+        double start, limit, step; \
+        if (!val_tonums(slot[0], slot[1], &start, &limit) || \
+            !val_tonums(slot[2], slot[2], &step, &step)) { \
+            ERROR("'For' values must be numbers/booleans."); \
+        } \
+        if (step == 0) { \
+            ERROR("'For' step is zero."); \
+        } \
+        slot[0] = VAL_NUM(start); \
+        slot[1] = VAL_NUM(limit); \
+        slot[2] = VAL_NUM(step); \
+        if (step > 0 ? start <= limit : start >= limit) slot[3] = slot[0]; \
+        else ip += offset; \
+        NEXT; \
+    } while (0)
+
+// A function that spends its time in a loop is compiled for its next
+// call, whatever its call count.
+#ifdef JIT
+#define LOOP_BACK(loop, offset) \
+    do { \
+        fun_t *function = fun_code(frame->function); \
+        ip -= offset; \
+        if (++function->chunk.loops[loop] == JIT_LOOP_THRESHOLD && \
+            function->jit == NULL && function->name != NULL) { \
+            jit_compile(vm, function); \
+        } \
+        NEXT; \
+    } while (0)
+#else
+#define LOOP_BACK(loop, offset) \
+    do { \
+        ip -= offset; \
+        fun_code(frame->function)->chunk.loops[loop]++; \
+        NEXT; \
+    } while (0)
+#endif
+
+#define FOR_LOOP(slot, offset) \
+    do { \
+        double step = AS_NUM(slot[2]); \
+        double counter = AS_NUM(slot[0]) + step; \
+        slot[0] = VAL_NUM(counter); \
+        if (step > 0 ? counter <= AS_NUM(slot[1]) : counter >= AS_NUM(slot[1])) { \
+            slot[3] = slot[0]; \
+            ip -= offset; \
+        } \
+        NEXT; \
+    } while (0)
 
 #define ERROR(fmt, ...) \
     do { \
         STORE_FRAME(); \
-        runtimeError(vm, fmt, ##__VA_ARGS__); \
+        vm_error(vm, fmt, ##__VA_ARGS__); \
         return VM_RUNTIME_ERROR; \
     } while (0)
 
@@ -222,7 +786,7 @@ int vm_execute(vm_t *vm)
 #undef _CODE
     }
 #else
-#define INTERPRET       _loop: switch(READ_BYTE())
+#define INTERPRET       _loop: switch(PROFILE(READ_BYTE()))
 #define CODE(x)         case OP_##x:
 #define CODE_ERR()      default:
 #define NEXT            goto _loop
@@ -231,7 +795,7 @@ int vm_execute(vm_t *vm)
 #define INTERPRET       NEXT;
 #define CODE(x)         _OP_##x:
 #define CODE_ERR()      _err:
-#define NEXT            goto *_jtab[READ_BYTE()]
+#define NEXT            goto *_jtab[PROFILE(READ_BYTE())]
 #define _CODE(x)        &&_OP_##x,
     static void *_jtab[OPCODE_COUNT] = { OPCODES() };
 #endif
@@ -258,6 +822,13 @@ int vm_execute(vm_t *vm)
             NEXT;
         }
 
+        CODE(DROP) {
+            int count = READ_BYTE();
+            PEEK(count) = PEEK(0);
+            POPN(count);
+            NEXT;
+        }
+
         CODE(NIL) {
             PUSH(VAL_NULL);
             NEXT;
@@ -279,12 +850,62 @@ int vm_execute(vm_t *vm)
         }
 
         CODE(CALL) {
+            // A site that calls script functions has no natives to unbox for.
+            if (PEEK_SITE()->kind != SITE_FUN && vm_calldirect(vm, ip[0])) {
+                QUICKEN(OP_CALL_NUM);
+                ip += 3;
+                NEXT;
+            }
+
             int argCount = READ_BYTE();
+            callsite_t *site = READ_SITE();
 
+            // The call may move the frames and the stack.
+            int frameCount = vm->frameCount;
             STORE_FRAME();
-            if (!vm_call(vm, PEEK(argCount), argCount)) {
+            if (!vm_callsite(vm, site, argCount)) {
+                return VM_RUNTIME_ERROR;
+            }
+
+#ifdef JIT
+            if (vm->frameCount > frameCount &&
+                vm->frames[vm->frameCount - 1].function->jit != NULL &&
+                jit_enter(vm) != VM_OK) {
                 return VM_RUNTIME_ERROR;
             }
+#endif
+
+            LOAD_FRAME();
+            NEXT;
+        }
+
+        CODE(CALL_NUM) {
+            if (vm_calldirect(vm, ip[0])) {
+                ip += 3;
+                NEXT;
+            }
+            DEOPT(OP_CALL);
+        }
+
+        CODE(TAILCALL) {
+            int argCount = READ_BYTE();
+            ip += 2;
+
+            // A native returns here, and the RET after this returns its result.
+            STORE_FRAME();
+            if (!IS_FUN(PEEK(argCount))) {
+                if (!vm_call(vm, PEEK(argCount), argCount)) return VM_RUNTIME_ERROR;
+                NEXT;
+            }
+
+            if (!vm_tailcall(vm, argCount)) return VM_RUNTIME_ERROR;
+
+#ifdef JIT
+            if (frame->function->jit != NULL) {
+                if (jit_enter(vm) != VM_OK) return VM_RUNTIME_ERROR;
+                if (vm->frameCount == base) return VM_OK;
+            }
+#endif
 
             LOAD_FRAME();
             NEXT;
@@ -293,8 +914,10 @@ int vm_execute(vm_t *vm)
         CODE(RET) {
             val_t result = POP();
 
-            if (--vm->frameCount == 0) {
-                POP();
+            vm_closeupvalues(vm, frame->slots);
+            if (--vm->frameCount == base) {
+                vm->top = frame->slots;
+                if (base > 0) PUSH(result);
                 return VM_OK;
             }
 
@@ -306,17 +929,17 @@ int vm_execute(vm_t *vm)
         }
 
         CODE(NOT) {
-            PUSH(VAL_BOOL(IS_FALSEY(POP())));
+            PEEK(0) = VAL_BOOL(IS_FALSEY(PEEK(0)));
             NEXT;
         }
 
         CODE(NEG) {
             switch (AS_TYPE(PEEK(0))) {
                 case VT_BOOL:
-                    PUSH(VAL_NUM(-(char)AS_BOOL(POP())));
+                    PEEK(0) = VAL_NUM(-(char)AS_BOOL(PEEK(0)));
                     NEXT;
                 case VT_NUM:
-                    PUSH(VAL_NUM(-AS_NUM(POP())));
+                    PEEK(0) = VAL_NUM(-AS_NUM(PEEK(0)));
                     NEXT;
             }
             ERROR("Operands must be a number/boolean.");
@@ -332,6 +955,7 @@ int vm_execute(vm_t *vm)
         CODE(LT) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
+                    QUICKEN(OP_LT_NN);
                     double b = AS_NUM(POP());
                     double a = AS_NUM(POP());
                     PUSH(VAL_BOOL(a < b));
@@ -362,6 +986,7 @@ int vm_execute(vm_t *vm)
         CODE(LE) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
+                    QUICKEN(OP_LE_NN);
                     double b = AS_NUM(POP());
                     double a = AS_NUM(POP());
                     PUSH(VAL_BOOL(a <= b));
@@ -392,6 +1017,7 @@ int vm_execute(vm_t *vm)
         CODE(ADD) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
+                    QUICKEN(OP_ADD_NN);
                     double b = AS_NUM(POP());
                     double a = AS_NUM(POP());
                     PUSH(VAL_NUM(a + b));
@@ -417,6 +1043,7 @@ int vm_execute(vm_t *vm)
                 }
                 case VT_OBJ_OBJ:
                     if (IS_STR(PEEK(0)) && IS_STR(PEEK(1))) {
+                        QUICKEN(OP_ADD_SS);
                         concatenate(vm);
                         NEXT;
                     }
@@ -427,6 +1054,7 @@ int vm_execute(vm_t *vm)
         CODE(SUB) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
+                    QUICKEN(OP_SUB_NN);
                     double b = AS_NUM(POP());
                     double a = AS_NUM(POP());
                     PUSH(VAL_NUM(a - b));
@@ -457,6 +1085,7 @@ int vm_execute(vm_t *vm)
         CODE(MUL) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
+                    QUICKEN(OP_MUL_NN);
                     double b = AS_NUM(POP());
                     double a = AS_NUM(POP());
                     PUSH(VAL_NUM(a * b));
@@ -487,6 +1116,7 @@ int vm_execute(vm_t *vm)
         CODE(DIV) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
+                    QUICKEN(OP_DIV_NN);
                     double b = AS_NUM(POP());
                     double a = AS_NUM(POP());
                     PUSH(VAL_NUM(a / b));
@@ -514,29 +1144,227 @@ int vm_execute(vm_t *vm)
             ERROR("Operands must be two numbers/booleans.");
         }
 
+        CODE(ADD_NN) {
+            BINARY_NN(OP_ADD, VAL_NUM, +);
+        }
+
+        CODE(SUB_NN) {
+            BINARY_NN(OP_SUB, VAL_NUM, -);
+        }
+
+        CODE(MUL_NN) {
+            BINARY_NN(OP_MUL, VAL_NUM, *);
+        }
+
+        CODE(DIV_NN) {
+            BINARY_NN(OP_DIV, VAL_NUM, /);
+        }
+
+        CODE(LT_NN) {
+            BINARY_NN(OP_LT, VAL_BOOL, <);
+        }
+
+        CODE(LE_NN) {
+            BINARY_NN(OP_LE, VAL_BOOL, <=);
+        }
+
+        CODE(ADD_SS) {
+            if (IS_STR(PEEK(0)) && IS_STR(PEEK(1))) {
+                concatenate(vm);
+                NEXT;
+            }
+            DEOPT(OP_ADD);
+        }
+
+        CODE(JMPT) {
+            uint16_t offset = READ_SHORT();
+            if (!IS_FALSEY(PEEK(0))) ip += offset;
+            NEXT;
+        }
+
+        CODE(JMPF_POP) {
+            uint16_t offset = READ_SHORT();
+            if (IS_FALSEY(POP())) ip += offset;
+            NEXT;
+        }
+
+        CODE(JMPT_POP) {
+            uint16_t offset = READ_SHORT();
+            if (!IS_FALSEY(POP())) ip += offset;
+            NEXT;
+        }
+
+        CODE(JLT) {
+            JUMP_UNLESS(<);
+        }
+
+        CODE(JLE) {
+            JUMP_UNLESS(<=);
+        }
+
+        // The negated forms of JLE and JLT, false on NaN like NOT(LE) and
+        // NOT(LT), rather than IEEE 'a > b' and 'a >= b'.
+        CODE(JGT) {
+            JUMP_IF(<=);
+        }
+
+        CODE(JGE) {
+            JUMP_IF(<);
+        }
+
+        CODE(JEQ) {
+            uint16_t offset = READ_SHORT();
+            val_t b = POP();
+            val_t a = POP();
+            if (!val_equal(a, b)) ip += offset;
+            NEXT;
+        }
+
+        CODE(JNE) {
+            uint16_t offset = READ_SHORT();
+            val_t b = POP();
+            val_t a = POP();
+            if (val_equal(a, b)) ip += offset;
+            NEXT;
+        }
+
+        CODE(LD_LD_ADD) {
+            val_t a = STACK[READ_BYTE()];
+            val_t b = STACK[READ_BYTE()];
+
+            if (IS_NUM(a) && IS_NUM(b)) {
+                PUSH(VAL_NUM(AS_NUM(a) + AS_NUM(b)));
+                NEXT;
+            }
+
+            PUSH(a);
+            PUSH(b);
+            if (!vm_add(vm)) {
+                ERROR("Operands must be two numbers/booleans/strings.");
+            }
+            NEXT;
+        }
+
+        CODE(ADDK) {
+            val_t k = READ_CONST();
+
+            if (IS_NUM(PEEK(0)) && IS_NUM(k)) {
+                PEEK(0) = VAL_NUM(AS_NUM(PEEK(0)) + AS_NUM(k));
+                NEXT;
+            }
+
+            PUSH(k);
+            if (!vm_add(vm)) {
+                ERROR("Operands must be two numbers/booleans/strings.");
+            }
+            NEXT;
+        }
+
+        CODE(SUBK) {
+            val_t k = READ_CONST();
+            double a, b;
+
+            if (!val_tonums(PEEK(0), k, &a, &b)) {
+                ERROR("Operands must be two numbers/booleans.");
+            }
+            PEEK(0) = VAL_NUM(a - b);
+            NEXT;
+        }
+
+        CODE(MOVE) {
+            uint8_t dst = READ_BYTE();
+            STACK[dst] = STACK[READ_BYTE()];
+            NEXT;
+        }
+
+        CODE(LOADK) {
+            uint8_t dst = READ_BYTE();
+            STACK[dst] = READ_CONST();
+            NEXT;
+        }
+
+        CODE(ADDR) {
+            ADD_R(STACK[READ_BYTE()]);
+        }
+
+        CODE(SUBR) {
+            ARITH_R(-, STACK[READ_BYTE()]);
+        }
+
+        CODE(MULR) {
+            ARITH_R(*, STACK[READ_BYTE()]);
+        }
+
+        CODE(DIVR) {
+            ARITH_R(/, STACK[READ_BYTE()]);
+        }
+
+        CODE(ADDRK) {
+            ADD_R(READ_CONST());
+        }
+
+        CODE(SUBRK) {
+            ARITH_R(-, READ_CONST());
+        }
+
+        CODE(MULRK) {
+            ARITH_R(*, READ_CONST());
+        }
+
+        CODE(DIVRK) {
+            ARITH_R(/, READ_CONST());
+        }
+
         CODE(DEF) {
-            str_t *name = READ_STR();
-            tab_set(vm->globals, name, PEEK(0));
-            POP();
+            GLOBALS[READ_BYTE()] = POP();
             NEXT;
         }
 
         CODE(GLD) {
-            str_t *name = READ_STR();
-            val_t value;      
-            if (!tab_get(vm->globals, name, &value)) {
-                ERROR("Undefined variable '%s'.", name->chars);
+            val_t value = GLOBALS[READ_BYTE()];
+            if (IS_UNDEF(value)) {
+                ERROR("Undefined variable '%s'.", vm_global_name(vm, PREV_BYTE())->chars);
             }
             PUSH(value);
             NEXT;
         }
 
         CODE(GST) {
-            str_t *name = READ_STR();
-            if (tab_set(vm->globals, name, PEEK(0))) {
-                tab_remove(vm->globals, name);
-                ERROR("Undefined variable '%s'.", name->chars);
+            val_t *global = &GLOBALS[READ_BYTE()];
+            if (IS_UNDEF(*global)) {
+                ERROR("Undefined variable '%s'.", vm_global_name(vm, PREV_BYTE())->chars);
             }
+            *global = PEEK(0);
+            NEXT;
+        }
+
+        CODE(CONST_W) {
+            PUSH(CONSTS[READ_SHORT()]);
+            NEXT;
+        }
+
+        CODE(DEF_W) {
+            GLOBALS[READ_SHORT()] = POP();
+            NEXT;
+        }
+
+        CODE(GLD_W) {
+            uint16_t slot = READ_SHORT();
+            val_t value = GLOBALS[slot];
+            if (IS_UNDEF(value)) {
+                ERROR("Undefined variable '%s'.", vm_global_name(vm, slot)->chars);
+            }
+            PUSH(value);
+            NEXT;
+        }
+
+        CODE(GST_W) {
+            uint16_t slot = READ_SHORT();
+            val_t *global = &GLOBALS[slot];
+            if (IS_UNDEF(*global)) {
+                ERROR("Undefined variable '%s'.", vm_global_name(vm, slot)->chars);
+            }
+            *global = PEEK(0);
             NEXT;
         }
 
@@ -550,18 +1378,131 @@ int vm_execute(vm_t *vm)
             NEXT;
         }
 
+        CODE(CLOSURE) {
+            vm_closure(vm, AS_FUN(CONSTS[READ_SHORT()]));
+            NEXT;
+        }
+
+        CODE(CLOSE) {
+            vm_closeupvalues(vm, vm->top - 1);
+            POP();
+            NEXT;
+        }
+
+        CODE(ULD) {
+            PUSH(*frame->function->upvalues[READ_BYTE()]->location);
+            NEXT;
+        }
+
+        CODE(UST) {
+            *frame->function->upvalues[READ_BYTE()]->location = PEEK(0);
+            NEXT;
+        }
+
+        CODE(OLD) {
+            uint8_t level = READ_BYTE();
+            PUSH(*vm_outer(vm, level, READ_BYTE()));
+            NEXT;
+        }
+
+        CODE(OST) {
+            uint8_t level = READ_BYTE();
+            *vm_outer(vm, level, READ_BYTE()) = PEEK(0);
+            NEXT;
+        }
+
         CODE(JMP) {
             uint16_t offset = READ_SHORT();
             ip += offset;
             NEXT;
         }
 
+        CODE(JMP_W) {
+            int32_t offset = READ_LONG();
+            ip += offset;
+            NEXT;
+        }
+
         CODE(JMPF) {
             uint16_t offset = READ_SHORT();
             if (IS_FALSEY(PEEK(0))) ip += offset;
             NEXT;
         }
 
+        CODE(LOOP) {
+            uint16_t loop = READ_SHORT();
+            int32_t offset = READ_SHORT();
+            LOOP_BACK(loop, offset);
+        }
+
+        CODE(LOOP_W) {
+            uint16_t loop = READ_SHORT();
+            int32_t offset = READ_LONG();
+            LOOP_BACK(loop, offset);
+        }
+
+        CODE(FORPREP) {
+            val_t *slot = &STACK[READ_BYTE()];
+            int32_t offset = READ_SHORT();
+            FOR_PREP(slot, offset);
+        }
+
+        CODE(FORPREP_W) {
+            val_t *slot = &STACK[READ_BYTE()];
+            int32_t offset = READ_LONG();
+            FOR_PREP(slot, offset);
+        }
+
+        CODE(FORLOOP) {
+            val_t *slot = &STACK[READ_BYTE()];
+            int32_t offset = READ_SHORT();
+            FOR_LOOP(slot, offset);
+        }
+
+        CODE(FORLOOP_W) {
+            val_t *slot = &STACK[READ_BYTE()];
+            int32_t offset = READ_LONG();
+            FOR_LOOP(slot, offset);
+        }
+
+        CODE(JTABLE) {
+            val_t value = STACK[READ_BYTE()];
+            switch_t *table = &frame->function->chunk.switches[READ_SHORT()];
+            double number = IS_NUM(value) ? AS_NUM(value) : 0.5;
+            int index;
+
+            // Integers within the dense table need no other test unless
+            // there are ranges it does not cover.
+            if (table->sparseCount == 0 && number >= table->low &&
+                number < (double)table->low + table->count && number == (int)number) {
+                index = table->dense[(int)number - table->low];
+                if (index < 0) index = table->caseCount;
+            }
+            else {
+                index = switch_find(table, value);
+            }
+
+            ip = frame->function->chunk.code + table->targets[index];
+            NEXT;
+        }
+
+        CODE(JHASH) {
+            val_t value = STACK[READ_BYTE()];
+            switch_t *table = &frame->function->chunk.switches[READ_SHORT()];
+            val_t found;
+            int index;
+
+            if (table->rangeCount == 0 && IS_STR(value)) {
+                index = hash_get(&table->exact, hash_value(value), &found) ? AS_INT(found) : table->caseCount;
+            }
+            else {
+                index = switch_find(table, value);
+            }
+
+            ip = frame->function->chunk.code + table->targets[index];
+            NEXT;
+        }
+
         CODE(MAP) {
             uint8_t count = READ_BYTE();
             map_t *map = map_new(vm);
@@ -579,8 +1520,8 @@ int vm_execute(vm_t *vm)
             if (IS_MAP(PEEK(0))) {
                 map_t *map = AS_MAP(PEEK(0));
                 str_t *name = READ_STR();
-                val_t value = VAL_NULL;
-                tab_get(&map->table, name, &value);
+                val_t value = vm_getfield(map, name, READ_CACHE());
+
                 POP();
                 PUSH(value);
             }
@@ -595,7 +1536,8 @@ int vm_execute(vm_t *vm)
                 map_t *map = AS_MAP(PEEK(1));
                 str_t *name = READ_STR();
                 val_t value = PEEK(0);
-                tab_set(&map->table, name, value);
+
+                vm_setfield(vm, map, name, READ_CACHE(), value);
                 POP();
                 POP();
                 PUSH(value);
@@ -622,7 +1564,7 @@ int vm_execute(vm_t *vm)
                     map_t *map = AS_MAP(PEEK(1));
                     str_t *key = AS_STR(PEEK(0));
                     val_t value = VAL_NULL;
-                    tab_get(&map->table, key, &value);
+                    map_get(map, key, &value);
 
                     POP();
                     POP();
@@ -654,8 +1596,9 @@ int vm_execute(vm_t *vm)
                 {
                     map_t *map = AS_MAP(PEEK(2));
                     str_t *key = AS_STR(PEEK(1));
-                    val_t value = POP();
-                    tab_set(&map->table, key, value);
+                    val_t value = PEEK(0);
+                    map_put(vm, map, key, value);
+                    POP();
 
                     POP();
                     POP();
@@ -685,7 +1628,15 @@ int vm_dofile(vm_t *vm, const char *fname)
     src_t *source = src_new(fname);
 
     if (source != NULL) {
+#ifdef BYTECODE_CACHE
+        fun_t *function = cache_load(vm, fname, source);
+        if (function == NULL) {
+            function = compile(vm, source);
+            if (function != NULL) cache_save(vm, fname, source, function);
+        }
+#else
         fun_t *function = compile(vm, source);
+#endif
         if (function == NULL) return VM_COMPILE_ERROR;
 
         val_t script = VAL_OBJ(function);
@@ -700,13 +1651,24 @@ int vm_dofile(vm_t *vm, const char *fname)
     return result;
 }
 
+int vm_global(vm_t *vm, str_t *name)
+{
+    val_t slot;
+    if (tab_get(vm->globals, name, &slot)) return AS_INT(slot);
+
+    int index = arr_add(vm->globalValues, VAL_UNDEF, true);
+    tab_set(vm->globals, name, VAL_NUM(index));
+    return index;
+}
+
 void set_global(vm_t *vm, const char *name, val_t value)
 {
     val_t global = VAL_OBJ(str_copy(vm, name, (int)strlen(name), true));
 
     PUSH(global);
     PUSH(value);
-    tab_set(vm->globals, AS_STR(global), value);
+    int slot = vm_global(vm, AS_STR(global));
+    vm->globalValues->values[slot] = value;
     POP();
     POP();
 }
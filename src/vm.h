@@ -14,25 +14,40 @@ typedef struct {
 
 struct _vm {
     val_t *top;
-    val_t stack[STACK_MAX];
-    frame_t frames[FRAMES_MAX];
+    val_t *stack;           // stackSize values, grown by vm_reserve()
+    int stackSize;
+    frame_t *frames;        // frameCapacity frames, grown on calls
     int frameCount;
+    int frameCapacity;
+    int maxFrames;          // deepest a call may go, FRAMES_MAX unless set
 
     int numRoots;
     obj_t *tempRoots[8];
     upv_t *openUpvalues;
 
     gc_t  *gc;
+    shp_t *emptyShape;
     tab_t *strings;
-    tab_t *globals;
+    tab_t *globals;         // name -> slot index in globalValues
+    arr_t *globalValues;    // VAL_UNDEF until the global is defined
+    hash_t stores;          // name hash -> weight of the stores to it, see noteStore()
 };
 
+// Keys of vm->stores for the stores include_scan() finds written in the
+// sources, whether or not they run: to a name, to a field, and through
+// an index.
+#define STORED_NAME(hash)   ((uint64_t)1 << 32 | (hash))
+#define STORED_FIELD(hash)  ((uint64_t)2 << 32 | (hash))
+#define STORED_INDEX        ((uint64_t)3 << 32)
+
 vm_t *vm_create();
 void vm_close(vm_t *vm);
 vm_t *vm_clone(vm_t *from);
 
 int vm_dofile(vm_t *vm, const char *fname);
 
+int vm_global(vm_t *vm, str_t *name);
+str_t *vm_global_name(vm_t *vm, int slot);
 void set_global(vm_t *vm, const char *name, val_t value);
 
 void vm_push(vm_t *vm, val_t value);
@@ -40,3 +55,14 @@ val_t vm_pop(vm_t *vm);
 
 int vm_execute(vm_t *vm);
 bool vm_call(vm_t *vm, val_t callee, int argCount);
+bool vm_callsite(vm_t *vm, callsite_t *site, int argCount);
+bool vm_reserve(vm_t *vm, int count);
+bool vm_tailcall(vm_t *vm, int argCount);
+bool vm_calldirect(vm_t *vm, int argCount);
+void vm_closeupvalues(vm_t *vm, val_t *last);
+void vm_closure(vm_t *vm, fun_t *proto);
+val_t *vm_outer(vm_t *vm, int level, int slot);
+bool vm_add(vm_t *vm);
+val_t vm_getfield(map_t *map, str_t *name, icache_t *cache);
+void vm_setfield(vm_t *vm, map_t *map, str_t *name, icache_t *cache, val_t value);
+void vm_error(vm_t *vm, const char *format, ...);